@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include "aead.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// ChaCha20 runs 8 blocks at once, one block per vector lane. The compiler lowers the 8 lane
+// vectors to SSE2 (or NEON) pairs by default, and on x86-64 Linux an AVX2 clone is picked at
+// load time when the CPU has it.
+#define LANES 8
+
+typedef uint32_t vec_t __attribute__((vector_size(4 * LANES)));
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__)
+#define CHACHA_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define CHACHA_CLONES
+#endif
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER(a, b, c, d)                                                                    \
+    a += b;                                                                                    \
+    d ^= a;                                                                                    \
+    d = ROTL(d, 16);                                                                           \
+    c += d;                                                                                    \
+    b ^= c;                                                                                    \
+    b = ROTL(b, 12);                                                                           \
+    a += b;                                                                                    \
+    d ^= a;                                                                                    \
+    d = ROTL(d, 8);                                                                            \
+    c += d;                                                                                    \
+    b ^= c;                                                                                    \
+    b = ROTL(b, 7);
+
+__extension__ typedef unsigned __int128 u128;
+
+// load32()
+// load32() reads a little-endian 32-bit word
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16)
+           | ((uint32_t) p[3] << 24);
+}
+
+// store32()
+// store32() writes a little-endian 32-bit word
+static void store32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// load64()
+// load64() reads a little-endian 64-bit word
+static uint64_t load64(const uint8_t *p) {
+    return (uint64_t) load32(p) | ((uint64_t) load32(p + 4) << 32);
+}
+
+// store64()
+// store64() writes a little-endian 64-bit word
+static void store64(uint8_t *p, uint64_t v) {
+    store32(p, v);
+    store32(p + 4, v >> 32);
+}
+
+// chacha20_blocks()
+// chacha20_blocks() writes LANES consecutive keystream blocks starting at the counter in s[12]
+CHACHA_CLONES
+static void chacha20_blocks(uint8_t out[64 * LANES], const uint32_t s[16]) {
+    vec_t x[16], init[16];
+    for (int i = 0; i < 16; i++) {
+        init[i] = (vec_t) { 0 } + s[i];
+    }
+    for (int b = 0; b < LANES; b++) {
+        init[12][b] += b;
+    }
+    memcpy(x, init, sizeof(x));
+
+    // 10 double rounds, columns then diagonals
+    for (int r = 0; r < 10; r++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        x[i] += init[i];
+    }
+    for (int b = 0; b < LANES; b++) {
+        for (int i = 0; i < 16; i++) {
+            store32(out + 64 * b + 4 * i, x[i][b]);
+        }
+    }
+}
+
+// chacha20_xor()
+// chacha20_xor() xors len bytes of in with the keystream starting at block counter into out
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE], uint32_t counter) {
+    uint32_t s[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };
+    uint8_t ks[64 * LANES];
+    for (int i = 0; i < 8; i++) {
+        s[4 + i] = load32(key + 4 * i);
+    }
+    s[12] = counter;
+    for (int i = 0; i < 3; i++) {
+        s[13 + i] = load32(nonce + 4 * i);
+    }
+
+    while (len > 0) {
+        chacha20_blocks(ks, s);
+        size_t n = len < sizeof(ks) ? len : sizeof(ks);
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] ^ ks[i];
+        }
+        s[12] += LANES;
+        out += n;
+        in += n;
+        len -= n;
+    }
+}
+
+// poly1305_t
+// poly1305_t is the running Poly1305 state with 44/44/42-bit limbs
+typedef struct {
+    uint64_t r[3], h[3], pad[2];
+    uint8_t buf[16];
+    size_t left;
+} poly1305_t;
+
+// poly1305_init()
+// poly1305_init() clamps r and loads the pad from the one-time key
+static void poly1305_init(poly1305_t *st, const uint8_t key[32]) {
+    uint64_t t0 = load64(key);
+    uint64_t t1 = load64(key + 8);
+    st->r[0] = t0 & 0xffc0fffffffULL;
+    st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    st->r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+    st->h[0] = st->h[1] = st->h[2] = 0;
+    st->pad[0] = load64(key + 16);
+    st->pad[1] = load64(key + 24);
+    st->left = 0;
+}
+
+// poly1305_blocks()
+// poly1305_blocks() absorbs whole 16 byte blocks, hibit is 0 only for the padded last block
+static void poly1305_blocks(poly1305_t *st, const uint8_t *m, size_t bytes, uint64_t hibit) {
+    const uint64_t mask44 = 0xfffffffffffULL;
+    const uint64_t mask42 = 0x3ffffffffffULL;
+    uint64_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+
+    while (bytes >= 16) {
+        uint64_t t0 = load64(m);
+        uint64_t t1 = load64(m + 8);
+        h0 += t0 & mask44;
+        h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+        h2 += ((t1 >> 24) & mask42) | hibit;
+
+        // h = h * r mod 2^130 - 5
+        u128 d0 = (u128) h0 * r0 + (u128) h1 * s2 + (u128) h2 * s1;
+        u128 d1 = (u128) h0 * r1 + (u128) h1 * r0 + (u128) h2 * s2;
+        u128 d2 = (u128) h0 * r2 + (u128) h1 * r1 + (u128) h2 * r0;
+        uint64_t c = (uint64_t) (d0 >> 44);
+        h0 = (uint64_t) d0 & mask44;
+        d1 += c;
+        c = (uint64_t) (d1 >> 44);
+        h1 = (uint64_t) d1 & mask44;
+        d2 += c;
+        c = (uint64_t) (d2 >> 42);
+        h2 = (uint64_t) d2 & mask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= mask44;
+        h1 += c;
+
+        m += 16;
+        bytes -= 16;
+    }
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+}
+
+// poly1305_update()
+// poly1305_update() absorbs any number of bytes
+static void poly1305_update(poly1305_t *st, const uint8_t *m, size_t bytes) {
+    if (st->left > 0) {
+        size_t want = 16 - st->left;
+        want = want > bytes ? bytes : want;
+        memcpy(st->buf + st->left, m, want);
+        st->left += want;
+        m += want;
+        bytes -= want;
+        if (st->left < 16) {
+            return;
+        }
+        poly1305_blocks(st, st->buf, 16, 1ULL << 40);
+        st->left = 0;
+    }
+    size_t whole = bytes & ~(size_t) 15;
+    poly1305_blocks(st, m, whole, 1ULL << 40);
+    memcpy(st->buf, m + whole, bytes - whole);
+    st->left = bytes - whole;
+}
+
+// poly1305_finish()
+// poly1305_finish() pads the last block, fully reduces h and adds the pad into the tag
+static void poly1305_finish(poly1305_t *st, uint8_t tag[AEAD_TAG]) {
+    const uint64_t mask44 = 0xfffffffffffULL;
+    const uint64_t mask42 = 0x3ffffffffffULL;
+    if (st->left > 0) {
+        st->buf[st->left] = 1;
+        memset(st->buf + st->left + 1, 0, 16 - st->left - 1);
+        poly1305_blocks(st, st->buf, 16, 0);
+    }
+
+    uint64_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2];
+    uint64_t c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += c;
+    c = h2 >> 42;
+    h2 &= mask42;
+    h0 += c * 5;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += c;
+
+    // g = h - (2^130 - 5), keep g if it didn't go negative
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= mask44;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= mask44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+    c = (g2 >> 63) - 1;
+    g0 &= c;
+    g1 &= c;
+    g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    // h += pad
+    uint64_t t0 = st->pad[0];
+    uint64_t t1 = st->pad[1];
+    h0 += t0 & mask44;
+    c = h0 >> 44;
+    h0 &= mask44;
+    h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c;
+    c = h1 >> 44;
+    h1 &= mask44;
+    h2 += ((t1 >> 24) & mask42) + c;
+    h2 &= mask42;
+
+    store64(tag, h0 | (h1 << 44));
+    store64(tag + 8, (h1 >> 20) | (h2 << 24));
+}
+
+// poly1305()
+// poly1305() computes the one-shot Poly1305 tag of msg
+void poly1305(uint8_t tag[AEAD_TAG], const uint8_t *msg, size_t len, const uint8_t key[32]) {
+    poly1305_t st;
+    poly1305_init(&st, key);
+    poly1305_update(&st, msg, len);
+    poly1305_finish(&st, tag);
+}
+
+// aead_tag()
+// aead_tag() computes the RFC 8439 tag over aad and ciphertext with the block 0 one-time key
+static void aead_tag(uint8_t tag[AEAD_TAG], const uint8_t *ct, size_t len, const uint8_t *aad,
+    size_t aadlen, const uint8_t key[AEAD_KEY], const uint8_t nonce[AEAD_NONCE]) {
+    static const uint8_t zeros[16] = { 0 };
+    uint8_t otk[32] = { 0 };
+    uint8_t lens[16];
+    chacha20_xor(otk, otk, sizeof(otk), key, nonce, 0);
+
+    poly1305_t st;
+    poly1305_init(&st, otk);
+    poly1305_update(&st, aad, aadlen);
+    poly1305_update(&st, zeros, (16 - aadlen % 16) % 16);
+    poly1305_update(&st, ct, len);
+    poly1305_update(&st, zeros, (16 - len % 16) % 16);
+    store64(lens, aadlen);
+    store64(lens + 8, len);
+    poly1305_update(&st, lens, sizeof(lens));
+    poly1305_finish(&st, tag);
+}
+
+// aead_seal()
+// aead_seal() encrypts len bytes of in into out and computes the tag
+void aead_seal(uint8_t *out, uint8_t tag[AEAD_TAG], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aadlen, const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE]) {
+    chacha20_xor(out, in, len, key, nonce, 1);
+    aead_tag(tag, out, len, aad, aadlen, key, nonce);
+}
+
+// aead_open()
+// aead_open() checks the tag and only then decrypts len bytes of in into out
+// Returns false if the tag does not match
+bool aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t tag[AEAD_TAG],
+    const uint8_t *aad, size_t aadlen, const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE]) {
+    uint8_t want[AEAD_TAG];
+    aead_tag(want, in, len, aad, aadlen, key, nonce);
+
+    // Compare in constant time
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG; i++) {
+        diff |= want[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        return false;
+    }
+    chacha20_xor(out, in, len, key, nonce, 1);
+    return true;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// ChaCha20-Poly1305 (RFC 8439) used to encrypt bulk data in the hybrid mode
+#define AEAD_KEY   32
+#define AEAD_NONCE 12
+#define AEAD_TAG   16
+
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE], uint32_t counter);
+
+void poly1305(uint8_t tag[AEAD_TAG], const uint8_t *msg, size_t len, const uint8_t key[32]);
+
+void aead_seal(uint8_t *out, uint8_t tag[AEAD_TAG], const uint8_t *in, size_t len,
+    const uint8_t *aad, size_t aadlen, const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE]);
+
+bool aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t tag[AEAD_TAG],
+    const uint8_t *aad, size_t aadlen, const uint8_t key[AEAD_KEY],
+    const uint8_t nonce[AEAD_NONCE]);
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "arena.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Arena size classes are powers of two from 2^ARENA_MIN_CLASS to 2^ARENA_MAX_CLASS bytes,
+// bigger blocks go straight to malloc()
+// Blocks are carved from ARENA_CHUNK byte chunks and kept on per thread free lists
+#define ARENA_MIN_CLASS 5
+#define ARENA_MAX_CLASS 18
+#define ARENA_CLASSES   (ARENA_MAX_CLASS - ARENA_MIN_CLASS + 1)
+#define ARENA_LARGE     UINT64_MAX
+#define ARENA_CHUNK     (1 << 20)
+
+// Each block is preceded by its class, 16 bytes keeps the limbs aligned
+#define ARENA_HEADER 16
+
+static atomic_uint_fast64_t gmp_calls = 0; // GMP allocations and reallocations
+static atomic_uint_fast64_t system_calls = 0; // malloc() and realloc() calls behind them
+
+static _Thread_local void *free_lists[ARENA_CLASSES];
+static _Thread_local uint8_t *chunk = NULL;
+static _Thread_local size_t chunk_left = 0;
+
+// count_alloc()
+// count_alloc() counts one GMP allocation and passes it to malloc()
+static void *count_alloc(size_t size) {
+    atomic_fetch_add(&gmp_calls, 1);
+    atomic_fetch_add(&system_calls, 1);
+    return malloc(size);
+}
+
+// count_realloc()
+// count_realloc() counts one GMP reallocation and passes it to realloc()
+static void *count_realloc(void *ptr, size_t old_size, size_t new_size) {
+    (void) old_size;
+    atomic_fetch_add(&gmp_calls, 1);
+    atomic_fetch_add(&system_calls, 1);
+    return realloc(ptr, new_size);
+}
+
+// count_free()
+// count_free() passes a GMP free to free()
+static void count_free(void *ptr, size_t size) {
+    (void) size;
+    free(ptr);
+}
+
+// alloc_count_install()
+// alloc_count_install() makes GMP allocate through malloc() while counting the calls
+void alloc_count_install(void) {
+    mp_set_memory_functions(count_alloc, count_realloc, count_free);
+}
+
+// size_class()
+// size_class() returns the smallest class that holds size bytes, or ARENA_LARGE
+static uint64_t size_class(size_t size) {
+    uint64_t c = 0;
+    while (c < ARENA_CLASSES && ((size_t) 1 << (c + ARENA_MIN_CLASS)) < size) {
+        c++;
+    }
+    return c < ARENA_CLASSES ? c : ARENA_LARGE;
+}
+
+// arena_alloc()
+// arena_alloc() pops a block of the right class off this thread's free list, or carves one
+// from the thread's chunk
+static void *arena_alloc(size_t size) {
+    atomic_fetch_add(&gmp_calls, 1);
+    uint64_t c = size_class(size);
+    uint8_t *block;
+    if (c == ARENA_LARGE) {
+        atomic_fetch_add(&system_calls, 1);
+        block = (uint8_t *) malloc(ARENA_HEADER + size);
+    } else if (free_lists[c] != NULL) {
+        block = (uint8_t *) free_lists[c] - ARENA_HEADER;
+        memcpy(&free_lists[c], free_lists[c], sizeof(void *));
+    } else {
+        size_t need = ARENA_HEADER + ((size_t) 1 << (c + ARENA_MIN_CLASS));
+        if (need > chunk_left) {
+            // The rest of the old chunk is abandoned, chunks live until the process exits
+            atomic_fetch_add(&system_calls, 1);
+            chunk = (uint8_t *) malloc(ARENA_CHUNK);
+            chunk_left = ARENA_CHUNK;
+        }
+        block = chunk;
+        chunk += need;
+        chunk_left -= need;
+    }
+    memcpy(block, &c, sizeof(c));
+    return block + ARENA_HEADER;
+}
+
+// arena_free()
+// arena_free() pushes a block onto this thread's free list for its class
+// A block freed on another thread than it came from simply moves to that thread
+static void arena_free(void *ptr, size_t size) {
+    (void) size;
+    uint8_t *block = (uint8_t *) ptr - ARENA_HEADER;
+    uint64_t c;
+    memcpy(&c, block, sizeof(c));
+    if (c == ARENA_LARGE) {
+        free(block);
+        return;
+    }
+    memcpy(ptr, &free_lists[c], sizeof(void *));
+    free_lists[c] = ptr;
+}
+
+// arena_realloc()
+// arena_realloc() keeps the block when its class still fits, otherwise moves it
+static void *arena_realloc(void *ptr, size_t old_size, size_t new_size) {
+    uint64_t c;
+    memcpy(&c, (uint8_t *) ptr - ARENA_HEADER, sizeof(c));
+    if (c != ARENA_LARGE && new_size <= ((size_t) 1 << (c + ARENA_MIN_CLASS))) {
+        atomic_fetch_add(&gmp_calls, 1);
+        return ptr;
+    }
+    void *moved = arena_alloc(new_size);
+    memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+    arena_free(ptr, old_size);
+    return moved;
+}
+
+// arena_install()
+// arena_install() makes GMP allocate from the size class arena
+// Memory handed back to the arena is reused but never returned to the system, so it suits
+// the short lived command line programs rather than the daemon
+void arena_install(void) {
+    mp_set_memory_functions(arena_alloc, arena_realloc, arena_free);
+}
+
+// alloc_calls()
+// alloc_calls() returns the GMP allocations and reallocations counted so far
+uint64_t alloc_calls(void) {
+    return atomic_load(&gmp_calls);
+}
+
+// alloc_system()
+// alloc_system() returns the system allocator calls made for GMP so far, lower than
+// alloc_calls() when the arena serves blocks from its free lists
+uint64_t alloc_system(void) {
+    return atomic_load(&system_calls);
+}
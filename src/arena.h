@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+// GMP memory hooks installed with mp_set_memory_functions(), both count every allocation
+// GMP makes so the hot loops can be checked for allocator traffic
+// Either must be installed before the first GMP allocation
+
+void alloc_count_install(void);
+
+void arena_install(void);
+
+uint64_t alloc_calls(void);
+
+uint64_t alloc_system(void);
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include "batch.h"
+#include "pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// batch_job_t
+// batch_job_t is one batch_run() shared with the pool, every worker claims the next file in
+// order from one cursor instead of its own run of the pool, so the largest files go first
+typedef struct {
+    batch_t *b;
+    atomic_uint_fast64_t next;
+    batch_fn fn;
+    void *arg;
+} batch_job_t;
+
+// batch_init()
+// batch_init() starts an empty batch
+void batch_init(batch_t *b) {
+    memset(b, 0, sizeof(batch_t));
+}
+
+// batch_clear()
+// batch_clear() frees the batch
+void batch_clear(batch_t *b) {
+    for (uint64_t i = 0; i < b->count; i++) {
+        free(b->files[i].in);
+        free(b->files[i].out);
+    }
+    free(b->files);
+    memset(b, 0, sizeof(batch_t));
+}
+
+// batch_add()
+// batch_add() lists in to be worked into out, an input that can't be looked at is still
+// listed and fails when batch_run() tries to open it
+void batch_add(batch_t *b, const char *in, const char *out) {
+    if (b->count == b->cap) {
+        b->cap = b->cap > 0 ? 2 * b->cap : 64;
+        b->files = (batch_file_t *) realloc(b->files, b->cap * sizeof(batch_file_t));
+    }
+    struct stat st;
+    batch_file_t *f = &b->files[b->count++];
+    f->in = strdup(in);
+    f->out = strdup(out);
+    f->size = stat(in, &st) == 0 ? (uint64_t) st.st_size : 0;
+    f->error = NULL;
+}
+
+// batch_manifest()
+// batch_manifest() lists the files of a manifest, one input and output path per line split
+// by a tab, blank lines and lines starting with # are skipped
+// Returns false if a line has no tab, with line set to its number
+bool batch_manifest(batch_t *b, FILE *manifest, uint64_t *line) {
+    char *buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = true;
+    *line = 0;
+    while (ok && (len = getline(&buf, &cap, manifest)) >= 0) {
+        (*line)++;
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) {
+            buf[--len] = '\0';
+        }
+        if (len == 0 || buf[0] == '#') {
+            continue;
+        }
+        char *tab = strchr(buf, '\t');
+        ok = tab != NULL && tab != buf && tab[1] != '\0';
+        if (ok) {
+            *tab = '\0';
+            batch_add(b, buf, tab + 1);
+        }
+    }
+    free(buf);
+    return ok;
+}
+
+// batch_tree()
+// batch_tree() lists every regular file under indir to go to the same path under outdir
+// Symbolic links aren't followed. Returns false if indir or a directory under it can't be read.
+bool batch_tree(batch_t *b, const char *indir, const char *outdir) {
+    DIR *dir = opendir(indir);
+    if (dir == NULL) {
+        return false;
+    }
+    bool ok = true;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char in[4096], out[4096];
+        snprintf(in, sizeof(in), "%s/%s", indir, entry->d_name);
+        snprintf(out, sizeof(out), "%s/%s", outdir, entry->d_name);
+        struct stat st;
+        if (lstat(in, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            ok = batch_tree(b, in, out) && ok;
+        } else if (S_ISREG(st.st_mode)) {
+            batch_add(b, in, out);
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+// make_parents()
+// make_parents() creates the missing directories above path, workers racing to make the same
+// one are fine as an existing directory counts as made
+static bool make_parents(const char *path) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+            return false;
+        }
+        *p = '/';
+    }
+    return true;
+}
+
+// same_file()
+// same_file() checks whether path names the file already open as infile
+static bool same_file(FILE *infile, const char *path) {
+    struct stat in, out;
+    return fstat(fileno(infile), &in) == 0 && stat(path, &out) == 0 && in.st_dev == out.st_dev
+           && in.st_ino == out.st_ino;
+}
+
+// batch_file()
+// batch_file() works the next unclaimed file on worker w, the pool index only counts calls
+// The output is written to a temporary file next to it and renamed over it only once fn
+// reports the file done and written in full, so a failed file leaves no partial output and
+// any earlier one untouched
+static void batch_file(void *arg, uint64_t i, uint64_t w) {
+    (void) i;
+    (void) w;
+    batch_job_t *job = (batch_job_t *) arg;
+    batch_file_t *f = &job->b->files[atomic_fetch_add(&job->next, 1)];
+    FILE *infile = fopen(f->in, "r");
+    if (infile == NULL) {
+        f->error = "failed to open input";
+        return;
+    }
+    if (same_file(infile, f->out)) {
+        f->error = "output is the input";
+        fclose(infile);
+        return;
+    }
+    // O_EXCL also fails a second entry writing the same output in this run
+    char tmppath[4096];
+    int len = snprintf(tmppath, sizeof(tmppath), "%s.%ld.tmp", f->out, (long) getpid());
+    bool fits = len > 0 && (size_t) len < sizeof(tmppath);
+    int fd = fits && make_parents(f->out) ? open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666) : -1;
+    FILE *outfile = fd < 0 ? NULL : fdopen(fd, "w");
+    if (outfile == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmppath);
+        }
+        f->error = "failed to open output";
+        fclose(infile);
+        return;
+    }
+    f->error = job->fn(job->arg, infile, outfile);
+    fclose(infile);
+    if (fclose(outfile) != 0 && f->error == NULL) {
+        f->error = "failed to write output";
+    }
+    if (f->error == NULL && rename(tmppath, f->out) != 0) {
+        f->error = "failed to write output";
+    }
+    if (f->error != NULL) {
+        unlink(tmppath);
+    }
+}
+
+// by_size()
+// by_size() orders files for qsort() largest first, then by path so runs are repeatable
+static int by_size(const void *a, const void *b) {
+    const batch_file_t *x = (const batch_file_t *) a;
+    const batch_file_t *y = (const batch_file_t *) b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return strcmp(x->in, y->in);
+}
+
+// batch_run()
+// batch_run() works every file of the batch with fn on threads workers, largest file first
+// Each file is worked on one thread, a file fn fails is marked with the reason it gives
+// Returns the number of files that failed
+uint64_t batch_run(batch_t *b, uint64_t threads, batch_fn fn, void *arg) {
+    qsort(b->files, b->count, sizeof(batch_file_t), by_size);
+    batch_job_t job = { 0 };
+    job.b = b;
+    atomic_init(&job.next, 0);
+    job.fn = fn;
+    job.arg = arg;
+    pool_t *pool = pool_create(threads);
+    pool_run(pool, b->count, 1, batch_file, &job);
+    pool_destroy(pool);
+
+    uint64_t failed = 0;
+    for (uint64_t i = 0; i < b->count; i++) {
+        failed += b->files[i].error != NULL;
+    }
+    return failed;
+}
+
+// batch_report()
+// batch_report() prints a line for each file that failed, returns how many did
+uint64_t batch_report(batch_t *b, FILE *f) {
+    uint64_t failed = 0;
+    for (uint64_t i = 0; i < b->count; i++) {
+        if (b->files[i].error != NULL) {
+            fprintf(f, "Error: %s: %s.\n", b->files[i].in, b->files[i].error);
+            failed++;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Batch mode of encrypt and decrypt, many files under one key load
+// The files come from a manifest of input and output paths, one pair per line split by a tab,
+// or from a directory tree mirrored into an output directory. batch_run() spreads them over a
+// pool largest first, so the big files start early and the small ones fill in behind them, and
+// one file failing is recorded against it without stopping the others.
+
+// Work on one file, returns why it failed or NULL if it went through, written out in full
+typedef const char *(*batch_fn)(void *arg, FILE *infile, FILE *outfile);
+
+typedef struct {
+    char *in;
+    char *out;
+    uint64_t size; // Bytes in the input when it was listed
+    const char *error; // Why the file failed, NULL if it went through
+} batch_file_t;
+
+typedef struct {
+    batch_file_t *files;
+    uint64_t count;
+    uint64_t cap;
+} batch_t;
+
+void batch_init(batch_t *b);
+
+void batch_clear(batch_t *b);
+
+void batch_add(batch_t *b, const char *in, const char *out);
+
+bool batch_manifest(batch_t *b, FILE *manifest, uint64_t *line);
+
+bool batch_tree(batch_t *b, const char *indir, const char *outdir);
+
+uint64_t batch_run(batch_t *b, uint64_t threads, batch_fn fn, void *arg);
+
+uint64_t batch_report(batch_t *b, FILE *f);
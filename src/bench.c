@@ -0,0 +1,1094 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+#include "mont.h"
+#include "fixed.h"
+#include "rsa.h"
+#include "arena.h"
+#include "sha256.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#define OPTIONS "r:s:m:b:k:f:T:t:j:Ah"
+
+// Most results one run can record for the JSON output
+#define MAX_RESULTS 512
+
+// help()
+// help() prints out the program usage and help.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Benchmarks the number theory primitives, keygen and the file loops.\n\
+\n\
+USAGE\n\
+   ./bench [-h] [-r reps] [-s seed] [-m suites] [-b bits] [-k keys] [-f bytes] [-T ms]\n\
+           [-t threads] [-j jsonfile] [-A]\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -r reps         Exponentiations per measurement in the pow suite (default: 20).\n\
+   -s seed         Random seed (default: 2022).\n\
+   -m suites       Comma separated suites to run: pow, prim, keygen, file,\n\
+                   alloc, check, multi, simd, fixed, hash (default: all).\n\
+   -b bits         Only run this modulus size (default: 1024, 2048, 3072 and 4096, the\n\
+                   multi suite runs 2048 and 4096).\n\
+   -k keys         Keys generated per size for the keygen latency (default: 5).\n\
+   -f bytes        Size of the generated file for the file suite (default: 65536).\n\
+   -T ms           Minimum time per primitive measurement (default: 200).\n\
+   -t threads      Worker threads for the file suite (default: 1).\n\
+   -j jsonfile     Also write every result as JSON to jsonfile.\n\
+   -A              Serve GMP allocations from the size class arena.\n");
+    return;
+}
+
+// result_t
+// result_t is one measurement kept for the JSON output
+typedef struct {
+    const char *suite;
+    const char *op;
+    uint64_t bits;
+    double value;
+    const char *unit;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static uint64_t nresults = 0;
+
+// record()
+// record() keeps a measurement for the JSON output
+static void record(const char *suite, const char *op, uint64_t bits, double value,
+    const char *unit) {
+    if (nresults < MAX_RESULTS) {
+        results[nresults++] = (result_t) { suite, op, bits, value, unit };
+    }
+}
+
+// now()
+// now() returns a monotonic timestamp in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// random_modulus()
+// random_modulus() makes a random odd bits-bit n with the top bit set
+static void random_modulus(mpz_t n, uint64_t bits) {
+    mpz_urandomb(n, state, bits);
+    mpz_setbit(n, bits - 1);
+    mpz_setbit(n, 0);
+}
+
+// bench_pow()
+// bench_pow() times each exponentiation engine and checks they agree
+static bool bench_pow(uint64_t *sizes, size_t nsizes, uint64_t reps) {
+    mpz_t a, d, n, o, ref;
+    mpz_inits(a, d, n, o, ref, NULL);
+    bool agree = true;
+
+    fprintf(stdout, "%6s %14s %14s %14s %10s %10s\n", "bits", "binary op/s", "pow_mod op/s",
+        "mpz_powm op/s", "vs binary", "vs powm");
+    for (size_t i = 0; i < nsizes; i++) {
+        // Random full size odd modulus, base and exponent
+        random_modulus(n, sizes[i]);
+        mpz_urandomm(a, state, n);
+        mpz_urandomb(d, state, sizes[i]);
+
+        double start = now();
+        for (uint64_t r = 0; r < reps; r++) {
+            pow_mod_binary(ref, a, d, n);
+        }
+        double binary = now() - start;
+
+        start = now();
+        for (uint64_t r = 0; r < reps; r++) {
+            pow_mod(o, a, d, n);
+        }
+        double mont = now() - start;
+        agree = agree && mpz_cmp(o, ref) == 0;
+
+        start = now();
+        for (uint64_t r = 0; r < reps; r++) {
+            mpz_powm(o, a, d, n);
+        }
+        double powm = now() - start;
+        agree = agree && mpz_cmp(o, ref) == 0;
+
+        fprintf(stdout, "%6" PRIu64 " %14.1f %14.1f %14.1f %9.2fx %9.2fx\n", sizes[i],
+            reps / binary, reps / mont, reps / powm, binary / mont, powm / mont);
+        record("pow", "pow_mod_binary", sizes[i], reps / binary, "op/s");
+        record("pow", "pow_mod", sizes[i], reps / mont, "op/s");
+        record("pow", "mpz_powm", sizes[i], reps / powm, "op/s");
+    }
+
+    // The short public exponent e = 65537 takes the word-sized fast path, time it with the
+    // context built once like the file loops do
+    fprintf(stdout, "\n%6s %14s %14s %14s %10s %10s\n", "e=65537", "binary op/s", "mont op/s",
+        "mpz_powm op/s", "vs binary", "vs powm");
+    mpz_set_ui(d, 65537);
+    for (size_t i = 0; i < nsizes; i++) {
+        random_modulus(n, sizes[i]);
+        mpz_urandomm(a, state, n);
+        uint64_t ereps = reps * 100;
+        mont_t ctx;
+        mont_init(&ctx, n);
+
+        double start = now();
+        for (uint64_t r = 0; r < ereps; r++) {
+            pow_mod_binary(ref, a, d, n);
+        }
+        double binary = now() - start;
+
+        start = now();
+        for (uint64_t r = 0; r < ereps; r++) {
+            mont_pow(o, a, d, &ctx);
+        }
+        double mont = now() - start;
+        agree = agree && mpz_cmp(o, ref) == 0;
+
+        start = now();
+        for (uint64_t r = 0; r < ereps; r++) {
+            mpz_powm(o, a, d, n);
+        }
+        double powm = now() - start;
+        agree = agree && mpz_cmp(o, ref) == 0;
+        mont_clear(&ctx);
+
+        fprintf(stdout, "%6" PRIu64 " %14.1f %14.1f %14.1f %9.2fx %9.2fx\n", sizes[i],
+            ereps / binary, ereps / mont, ereps / powm, binary / mont, powm / mont);
+        record("pow", "mont_pow_e65537", sizes[i], ereps / mont, "op/s");
+        record("pow", "mpz_powm_e65537", sizes[i], ereps / powm, "op/s");
+    }
+
+    mpz_clears(a, d, n, o, ref, NULL);
+    return agree;
+}
+
+// prim_t
+// prim_t holds the operands for one primitive at one key size
+typedef struct {
+    mpz_t a, b, n, o, p, c;
+    uint64_t bits;
+} prim_t;
+
+// Each primitive is timed at the operand size it sees when making a bits-bit key, so the
+// prime tests and searches run on bits/2-bit numbers
+static void op_pow_mod(prim_t *x) {
+    pow_mod(x->o, x->a, x->b, x->n);
+}
+
+static void op_is_prime(prim_t *x) {
+    is_prime(x->p, 50);
+}
+
+static void op_is_composite(prim_t *x) {
+    is_prime(x->c, 50);
+}
+
+static void op_is_prime_auto(prim_t *x) {
+    is_prime(x->p, PRIME_ITERS_AUTO);
+}
+
+static void op_is_prime_bpsw(prim_t *x) {
+    is_prime_bpsw(x->p);
+}
+
+static void op_make_prime(prim_t *x) {
+    make_prime(x->o, x->bits / 2, 50);
+}
+
+static void op_gcd(prim_t *x) {
+    gcd(x->o, x->a, x->n);
+}
+
+static void op_mod_inverse(prim_t *x) {
+    mod_inverse(x->o, x->a, x->n);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(prim_t *);
+} prims[] = {
+    { "pow_mod", op_pow_mod },
+    { "is_prime", op_is_prime },
+    { "is_prime_composite", op_is_composite },
+    { "is_prime_auto", op_is_prime_auto },
+    { "is_prime_bpsw", op_is_prime_bpsw },
+    { "make_prime", op_make_prime },
+    { "gcd", op_gcd },
+    { "mod_inverse", op_mod_inverse },
+};
+
+// bench_prim()
+// bench_prim() reports operations per second of each primitive, repeating each one until
+// at least budget seconds have passed
+static void bench_prim(uint64_t *sizes, size_t nsizes, double budget) {
+    size_t nprims = sizeof(prims) / sizeof(prims[0]);
+    prim_t x;
+    mpz_inits(x.a, x.b, x.n, x.o, x.p, x.c, NULL);
+
+    fprintf(stdout, "%6s", "bits");
+    for (size_t j = 0; j < nprims; j++) {
+        fprintf(stdout, " %19s", prims[j].name);
+    }
+    fprintf(stdout, "\n");
+
+    for (size_t i = 0; i < nsizes; i++) {
+        x.bits = sizes[i];
+        random_modulus(x.n, sizes[i]);
+        mpz_urandomm(x.a, state, x.n);
+        mpz_urandomb(x.b, state, sizes[i]);
+
+        // A prime that runs every Miller-Rabin round, and an odd composite that doesn't
+        make_prime(x.p, sizes[i] / 2, 50);
+        mpz_mul_ui(x.c, x.p, 3);
+
+        fprintf(stdout, "%6" PRIu64, sizes[i]);
+        for (size_t j = 0; j < nprims; j++) {
+            uint64_t ops = 0;
+            double start = now();
+            double elapsed = 0;
+            do {
+                prims[j].fn(&x);
+                ops++;
+                elapsed = now() - start;
+            } while (elapsed < budget);
+            fprintf(stdout, " %19.1f", ops / elapsed);
+            fflush(stdout);
+            record("prim", prims[j].name, sizes[i], ops / elapsed, "op/s");
+        }
+        fprintf(stdout, "\n");
+    }
+    mpz_clears(x.a, x.b, x.n, x.o, x.p, x.c, NULL);
+}
+
+// alloc_t
+// alloc_t holds the operands and reusable state for the allocation suite at one key size
+typedef struct {
+    mpz_t a, b, n, o, p, c;
+    mpz_t kp, kq, kn, ke, kd, dp, dq, qinv, m;
+    mont_t pctx, qctx;
+    workspace_t ws;
+} alloc_t;
+
+// Each primitive is paired with its workspace form, which should not allocate once the
+// workspace has grown to the operand size
+static void legacy_gcd(alloc_t *x) {
+    gcd(x->o, x->a, x->n);
+}
+
+static void ws_gcd(alloc_t *x) {
+    gcd_ws(x->o, x->a, x->n, &x->ws);
+}
+
+static void legacy_mod_inverse(alloc_t *x) {
+    mod_inverse(x->o, x->a, x->n);
+}
+
+static void ws_mod_inverse(alloc_t *x) {
+    mod_inverse_ws(x->o, x->a, x->n, &x->ws);
+}
+
+static void legacy_pow_mod(alloc_t *x) {
+    pow_mod(x->o, x->a, x->b, x->n);
+}
+
+static void ws_pow_mod(alloc_t *x) {
+    pow_mod_ws(x->o, x->a, x->b, x->n, &x->ws);
+}
+
+static void legacy_is_prime(alloc_t *x) {
+    is_prime(x->p, 50);
+}
+
+static void ws_is_prime(alloc_t *x) {
+    is_prime_ws(x->p, 50, state, &x->ws);
+}
+
+static void legacy_crt(alloc_t *x) {
+    rsa_decrypt_crt(x->m, x->c, x->kp, x->kq, x->dp, x->dq, x->qinv);
+}
+
+static void ws_crt(alloc_t *x) {
+    rsa_decrypt_crt_ctx(x->m, x->c, x->kp, x->kq, x->dp, x->dq, x->qinv, &x->pctx, &x->qctx,
+        &x->ws);
+}
+
+static const struct {
+    const char *name;
+    void (*legacy)(alloc_t *);
+    void (*ws)(alloc_t *);
+} allocs[] = {
+    { "gcd", legacy_gcd, ws_gcd },
+    { "mod_inverse", legacy_mod_inverse, ws_mod_inverse },
+    { "pow_mod", legacy_pow_mod, ws_pow_mod },
+    { "is_prime", legacy_is_prime, ws_is_prime },
+    { "crt_decrypt", legacy_crt, ws_crt },
+};
+
+// measure()
+// measure() repeats fn until at least budget seconds have passed, reporting op/s and the
+// GMP and system allocations per op
+static void measure(void (*fn)(alloc_t *), alloc_t *x, double budget, double *rate,
+    double *calls, double *mallocs) {
+    // One untimed call grows any workspace to the operand size
+    fn(x);
+    uint64_t ops = 0;
+    uint64_t calls0 = alloc_calls();
+    uint64_t system0 = alloc_system();
+    double start = now();
+    double elapsed = 0;
+    do {
+        fn(x);
+        ops++;
+        elapsed = now() - start;
+    } while (elapsed < budget);
+    *rate = ops / elapsed;
+    *calls = (double) (alloc_calls() - calls0) / ops;
+    *mallocs = (double) (alloc_system() - system0) / ops;
+}
+
+// bench_alloc()
+// bench_alloc() compares the allocating primitives with their workspace forms, reporting
+// op/s and allocations per op for each
+static bool bench_alloc(uint64_t *sizes, size_t nsizes, double budget) {
+    size_t nallocs = sizeof(allocs) / sizeof(allocs[0]);
+    alloc_t x;
+    mpz_inits(x.a, x.b, x.n, x.o, x.p, x.c, NULL);
+    mpz_inits(x.kp, x.kq, x.kn, x.ke, x.kd, x.dp, x.dq, x.qinv, x.m, NULL);
+    bool agree = true;
+
+    fprintf(stdout, "%6s %12s %14s %10s %10s %14s %10s %10s\n", "bits", "op", "legacy op/s",
+        "allocs/op", "malloc/op", "ws op/s", "allocs/op", "malloc/op");
+    for (size_t i = 0; i < nsizes; i++) {
+        random_modulus(x.n, sizes[i]);
+        mpz_urandomm(x.a, state, x.n);
+        mpz_urandomb(x.b, state, sizes[i]);
+        make_prime(x.p, sizes[i] / 2, 50);
+
+        rsa_make_pub(x.kp, x.kq, x.kn, x.ke, sizes[i], 50);
+        rsa_make_priv(x.kd, x.ke, x.kp, x.kq);
+        rsa_make_crt(x.dp, x.dq, x.qinv, x.kd, x.kp, x.kq);
+        mpz_urandomm(x.m, state, x.kn);
+        rsa_encrypt(x.c, x.m, x.ke, x.kn);
+        mont_init(&x.pctx, x.kp);
+        mont_init(&x.qctx, x.kq);
+        ws_init(&x.ws, sizes[i]);
+
+        for (size_t j = 0; j < nallocs; j++) {
+            double lrate, lcalls, lmallocs, wrate, wcalls, wmallocs;
+            measure(allocs[j].legacy, &x, budget, &lrate, &lcalls, &lmallocs);
+            measure(allocs[j].ws, &x, budget, &wrate, &wcalls, &wmallocs);
+            fprintf(stdout, "%6" PRIu64 " %12s %14.1f %10.1f %10.1f %14.1f %10.1f %10.1f\n",
+                sizes[i], allocs[j].name, lrate, lcalls, lmallocs, wrate, wcalls, wmallocs);
+            fflush(stdout);
+            record("alloc", allocs[j].name, sizes[i], lcalls, "legacy_allocs/op");
+            record("alloc", allocs[j].name, sizes[i], wcalls, "ws_allocs/op");
+            record("alloc", allocs[j].name, sizes[i], lmallocs, "legacy_mallocs/op");
+            record("alloc", allocs[j].name, sizes[i], wmallocs, "ws_mallocs/op");
+            record("alloc", allocs[j].name, sizes[i], lrate, "legacy_op/s");
+            record("alloc", allocs[j].name, sizes[i], wrate, "ws_op/s");
+        }
+
+        // The last op was the workspace CRT decryption, it should still give back m
+        rsa_decrypt(x.o, x.c, x.kd, x.kn);
+        agree = agree && mpz_cmp(x.o, x.m) == 0;
+
+        ws_clear(&x.ws);
+        mont_clear(&x.pctx);
+        mont_clear(&x.qctx);
+    }
+    mpz_clears(x.kp, x.kq, x.kn, x.ke, x.kd, x.dp, x.dq, x.qinv, x.m, NULL);
+    mpz_clears(x.a, x.b, x.n, x.o, x.p, x.c, NULL);
+    return agree;
+}
+
+// Composites that fool weaker tests: strong pseudoprimes to base 2, Carmichael numbers, strong
+// Lucas pseudoprimes with Selfridge's parameters and the smallest strong pseudoprimes to the
+// first 9, 12 and 13 prime bases
+static const char *pseudoprimes[] = { "2047", "3277", "4033", "4681", "8321", "15841", "29341",
+    "42799", "49141", "52633", "65281", "74665", "80581", "85489", "88357", "90751", "561",
+    "1105", "1729", "2465", "2821", "6601", "8911", "41041", "62745", "63973", "75361",
+    "101101", "126217", "172081", "188461", "252601", "278545", "294409", "314821", "334153",
+    "340561", "399001", "410041", "449065", "488881", "512461", "5459", "5777", "10877",
+    "16109", "18971", "22499", "24569", "25199", "40309", "58519", "75077", "97439",
+    "3825123056546413051", "318665857834031151167461", "3317044064679887385961981" };
+
+// Exponents k where 2^k - 1 is prime, and where it is not
+static const uint64_t mersenne_primes[] = { 61, 89, 107, 127, 521, 607, 1279, 2203 };
+static const uint64_t mersenne_composites[] = { 67, 101, 257, 1061, 2207 };
+
+// Every n below CHECK_LIMIT is checked against a sieve, and CHECK_RANDOM random numbers of
+// each size against GMP
+#define CHECK_LIMIT  (1 << 17)
+#define CHECK_RANDOM 100
+
+// check_t
+// check_t tallies the wrong answers of each engine over one set of numbers
+typedef struct {
+    uint64_t cases;
+    uint64_t mr, automr, bpsw;
+} check_t;
+
+// check_one()
+// check_one() asks every engine about n and counts the ones that disagree with prime
+static void check_one(check_t *c, mpz_t n, bool prime, workspace_t *ws) {
+    c->cases++;
+    c->mr += is_prime_ws(n, 50, state, ws) != prime;
+    c->automr += is_prime_ws(n, PRIME_ITERS_AUTO, state, ws) != prime;
+    c->bpsw += is_prime_bpsw_ws(n, ws) != prime;
+}
+
+// report_check()
+// report_check() prints and records one set, returns false if any engine was wrong
+static bool report_check(const char *name, uint64_t bits, check_t *c) {
+    fprintf(stdout, "%-14s %6" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+        name, bits, c->cases, c->mr, c->automr, c->bpsw);
+    fflush(stdout);
+    record("check", name, bits, c->mr + c->automr + c->bpsw, "failures");
+    return c->mr == 0 && c->automr == 0 && c->bpsw == 0;
+}
+
+// bench_check()
+// bench_check() is the correctness harness for the primality engines, it checks Miller-Rabin
+// with 50 and with automatic rounds and Baillie-PSW against known primes and pseudoprimes,
+// every small number and random numbers at each size
+static bool bench_check(uint64_t *sizes, size_t nsizes) {
+    workspace_t ws;
+    ws_init(&ws, 0);
+    mpz_t n, p;
+    mpz_inits(n, p, NULL);
+    bool agree = true;
+
+    fprintf(stdout, "%-14s %6s %8s %8s %8s %8s\n", "set", "bits", "cases", "mr", "mr auto",
+        "bpsw");
+
+    // Every n below CHECK_LIMIT against a sieve of Eratosthenes
+    uint8_t *composite = (uint8_t *) calloc(CHECK_LIMIT, 1);
+    composite[0] = composite[1] = 1;
+    for (uint64_t i = 2; i * i < CHECK_LIMIT; i++) {
+        for (uint64_t j = i * i; !composite[i] && j < CHECK_LIMIT; j += i) {
+            composite[j] = 1;
+        }
+    }
+    check_t c = { 0, 0, 0, 0 };
+    for (uint64_t i = 0; i < CHECK_LIMIT; i++) {
+        mpz_set_ui(n, i);
+        check_one(&c, n, !composite[i], &ws);
+    }
+    free(composite);
+    agree = report_check("exhaustive", 17, &c) && agree;
+
+    c = (check_t) { 0, 0, 0, 0 };
+    for (size_t i = 0; i < sizeof(pseudoprimes) / sizeof(pseudoprimes[0]); i++) {
+        mpz_set_str(n, pseudoprimes[i], 10);
+        check_one(&c, n, false, &ws);
+    }
+    agree = report_check("pseudoprimes", 82, &c) && agree;
+
+    c = (check_t) { 0, 0, 0, 0 };
+    for (size_t i = 0; i < sizeof(mersenne_primes) / sizeof(mersenne_primes[0]); i++) {
+        mpz_set_ui(n, 0);
+        mpz_setbit(n, mersenne_primes[i]);
+        mpz_sub_ui(n, n, 1);
+        check_one(&c, n, true, &ws);
+    }
+    for (size_t i = 0; i < sizeof(mersenne_composites) / sizeof(mersenne_composites[0]); i++) {
+        mpz_set_ui(n, 0);
+        mpz_setbit(n, mersenne_composites[i]);
+        mpz_sub_ui(n, n, 1);
+        check_one(&c, n, false, &ws);
+    }
+    agree = report_check("mersenne", 2207, &c) && agree;
+
+    // At the prime size of each key, random odd numbers and products of two primes against
+    // GMP, with the primes GMP finds after each random start
+    for (size_t i = 0; i < nsizes; i++) {
+        uint64_t bits = sizes[i] / 2;
+        c = (check_t) { 0, 0, 0, 0 };
+        for (uint64_t k = 0; k < CHECK_RANDOM; k++) {
+            random_modulus(n, bits);
+            check_one(&c, n, mpz_probab_prime_p(n, 50) != 0, &ws);
+            mpz_nextprime(p, n);
+            check_one(&c, p, true, &ws);
+            mpz_mul(n, p, p);
+            check_one(&c, n, false, &ws);
+            mpz_nextprime(n, p);
+            mpz_mul(n, n, p);
+            check_one(&c, n, false, &ws);
+        }
+        agree = report_check("random", bits, &c) && agree;
+    }
+
+    mpz_clears(n, p, NULL);
+    ws_clear(&ws);
+    return agree;
+}
+
+// cmp_double()
+// cmp_double() orders latencies for qsort()
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// bench_keygen()
+// bench_keygen() makes keys seeds seed, seed + 1, ... the way keygen does and reports the
+// latency distribution, which is wide since the prime search length is random
+static void bench_keygen(uint64_t *sizes, size_t nsizes, uint64_t keys, uint64_t seed) {
+    mpz_t p, q, n, e, d, dp, dq, qinv;
+    mpz_inits(p, q, n, e, d, dp, dq, qinv, NULL);
+    double *lat = (double *) calloc(keys, sizeof(double));
+
+    fprintf(stdout, "%6s %6s %10s %10s %10s %10s %10s\n", "bits", "keys", "min ms", "p50 ms",
+        "p90 ms", "max ms", "mean ms");
+    for (size_t i = 0; i < nsizes; i++) {
+        double sum = 0;
+        for (uint64_t k = 0; k < keys; k++) {
+            gmp_randseed_ui(state, seed + k);
+            double start = now();
+            rsa_make_pub(p, q, n, e, sizes[i], 50);
+            rsa_make_priv(d, e, p, q);
+            rsa_make_crt(dp, dq, qinv, d, p, q);
+            lat[k] = (now() - start) * 1e3;
+            sum += lat[k];
+        }
+        qsort(lat, keys, sizeof(double), cmp_double);
+        double p50 = lat[keys / 2];
+        double p90 = lat[(keys * 9) / 10];
+        fprintf(stdout, "%6" PRIu64 " %6" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            sizes[i], keys, lat[0], p50, p90, lat[keys - 1], sum / keys);
+        record("keygen", "min", sizes[i], lat[0], "ms");
+        record("keygen", "p50", sizes[i], p50, "ms");
+        record("keygen", "p90", sizes[i], p90, "ms");
+        record("keygen", "max", sizes[i], lat[keys - 1], "ms");
+        record("keygen", "mean", sizes[i], sum / keys, "ms");
+    }
+    free(lat);
+    mpz_clears(p, q, n, e, d, dp, dq, qinv, NULL);
+}
+
+// Ops recorded by the multi-prime suite for 2, 3 and 4 primes
+static const char *multi_keygen[] = { "keygen_2", "keygen_3", "keygen_4" };
+static const char *multi_decrypt[] = { "decrypt_2", "decrypt_3", "decrypt_4" };
+
+// bench_multi()
+// bench_multi() compares keys of 2 up to RSA_MAX_PRIMES primes at each size, the mean keygen
+// latency over keys keys and the CRT decryptions per second over budget seconds, and checks
+// each key decrypts what it encrypted
+static bool bench_multi(uint64_t *sizes, size_t nsizes, uint64_t keys, uint64_t seed,
+    double budget) {
+    mpz_t p, q, n, e, d, dp, dq, qinv, m, c, o;
+    mpz_inits(p, q, n, e, d, dp, dq, qinv, m, c, o, NULL);
+    rsa_extra_t x;
+    rsa_extra_init(&x);
+    bool agree = true;
+
+    fprintf(stdout, "%6s %6s %12s %12s %10s\n", "bits", "primes", "keygen ms", "decrypt/s",
+        "vs 2");
+    for (size_t i = 0; i < nsizes; i++) {
+        double base = 0;
+        for (uint64_t k = 2; k <= RSA_MAX_PRIMES; k++) {
+            double sum = 0;
+            for (uint64_t key = 0; key < keys; key++) {
+                gmp_randseed_ui(state, seed + key);
+                mpz_set_ui(e, 0);
+                double start = now();
+                rsa_make_pub_multi(p, q, &x, n, e, sizes[i], k, 50, 0, 0);
+                rsa_make_priv_multi(d, e, p, q, &x);
+                rsa_make_crt(dp, dq, qinv, d, p, q);
+                rsa_make_crt_multi(&x, d, p, q);
+                sum += (now() - start) * 1e3;
+            }
+
+            // Decrypt with the contexts built once, as the file loops do
+            mont_t pctx, qctx, xctx[RSA_MAX_PRIMES - 2];
+            workspace_t ws;
+            mont_init(&pctx, p);
+            mont_init(&qctx, q);
+            for (uint64_t j = 0; j < x.count; j++) {
+                mont_init(&xctx[j], x.r[j]);
+            }
+            ws_init(&ws, sizes[i]);
+            mpz_urandomm(m, state, n);
+            rsa_encrypt(c, m, e, n);
+            uint64_t ops = 0;
+            double start = now();
+            double elapsed = 0;
+            do {
+                rsa_decrypt_multi_ctx(o, c, p, q, dp, dq, qinv, &x, &pctx, &qctx, xctx, &ws);
+                ops++;
+                elapsed = now() - start;
+            } while (elapsed < budget);
+            agree = agree && mpz_cmp(o, m) == 0;
+            mont_clear(&pctx);
+            mont_clear(&qctx);
+            for (uint64_t j = 0; j < x.count; j++) {
+                mont_clear(&xctx[j]);
+            }
+            ws_clear(&ws);
+
+            double rate = ops / elapsed;
+            base = k == 2 ? rate : base;
+            fprintf(stdout, "%6" PRIu64 " %6" PRIu64 " %12.1f %12.1f %9.2fx%s\n", sizes[i], k,
+                sum / keys, rate, rate / base, mpz_cmp(o, m) == 0 ? "" : "  MISMATCH");
+            record("multi", multi_keygen[k - 2], sizes[i], sum / keys, "ms");
+            record("multi", multi_decrypt[k - 2], sizes[i], rate, "op/s");
+        }
+    }
+    rsa_extra_clear(&x);
+    mpz_clears(p, q, n, e, d, dp, dq, qinv, m, c, o, NULL);
+    return agree;
+}
+
+// Exponents of the simd suite: a full size d mod n, a CRT half mod a half size modulus as
+// decrypt runs, and e = 65537 as encrypt runs
+static const char *simd_exps[] = { "d", "crt", "65537" };
+
+// Ops recorded by the simd suite, by kernel and exponent
+static const char *simd_ops[][3] = { { "scalar_d", "scalar_crt", "scalar_65537" },
+    { "avx2_d", "avx2_crt", "avx2_65537" },
+    { "avx512ifma_d", "avx512ifma_crt", "avx512ifma_65537" } };
+
+// bench_simd()
+// bench_simd() times the multi-buffer kernels this CPU supports against mont_pow() on one
+// thread, in blocks per second, and checks every lane against pow_mod()
+static bool bench_simd(uint64_t *sizes, size_t nsizes, double budget) {
+    mpz_t n, d, ref, a[MB_MAX_LANES], o[MB_MAX_LANES];
+    mpz_inits(n, d, ref, NULL);
+    for (int l = 0; l < MB_MAX_LANES; l++) {
+        mpz_inits(a[l], o[l], NULL);
+    }
+    bool agree = true;
+
+    fprintf(stdout, "%6s %6s %12s %6s %12s %10s\n", "bits", "exp", "kernel", "lanes", "blocks/s",
+        "vs scalar");
+    for (size_t i = 0; i < nsizes; i++) {
+        for (int x = 0; x < 3; x++) {
+            uint64_t bits = x == 1 ? sizes[i] / 2 : sizes[i];
+            random_modulus(n, bits);
+            if (x == 2) {
+                mpz_set_ui(d, 65537);
+            } else {
+                mpz_urandomb(d, state, bits);
+            }
+            for (int l = 0; l < MB_MAX_LANES; l++) {
+                mpz_urandomm(a[l], state, n);
+            }
+
+            double base = 0;
+            for (int kernel = MB_SCALAR; kernel <= MB_IFMA; kernel++) {
+                if (!mb_supported(kernel)) {
+                    continue;
+                }
+                mont_t ctx;
+                mb_t mb;
+                mont_init(&ctx, n);
+                mb_init(&mb, n, kernel);
+                uint64_t lanes = mb_lanes(kernel);
+                uint64_t blocks = 0;
+                double start = now();
+                double elapsed = 0;
+                do {
+                    if (kernel == MB_SCALAR) {
+                        mont_pow(o[0], a[0], d, &ctx);
+                    } else {
+                        mb_pow(&mb, o, a, lanes, d);
+                    }
+                    blocks += lanes;
+                    elapsed = now() - start;
+                } while (elapsed < budget);
+                bool same = true;
+                for (uint64_t l = 0; l < lanes; l++) {
+                    pow_mod(ref, a[l], d, n);
+                    same = same && mpz_cmp(o[l], ref) == 0;
+                }
+                agree = agree && same;
+                mont_clear(&ctx);
+                mb_clear(&mb);
+
+                double rate = blocks / elapsed;
+                base = kernel == MB_SCALAR ? rate : base;
+                fprintf(stdout, "%6" PRIu64 " %6s %12s %6" PRIu64 " %12.1f %9.2fx%s\n", sizes[i],
+                    simd_exps[x], mb_name(kernel), lanes, rate, rate / base,
+                    same ? "" : "  MISMATCH");
+                record("simd", simd_ops[kernel][x], sizes[i], rate, "blocks/s");
+            }
+        }
+    }
+    for (int l = 0; l < MB_MAX_LANES; l++) {
+        mpz_clears(a[l], o[l], NULL);
+    }
+    mpz_clears(n, d, ref, NULL);
+    return agree;
+}
+
+// Ops recorded by the fixed suite, by exponent as in the simd suite
+static const char *fixed_ops[][3] = { { "gmp_d", "gmp_crt", "gmp_65537" },
+    { "fixed_d", "fixed_crt", "fixed_65537" }, { "mpz_powm_d", "mpz_powm_crt", "mpz_powm_65537" } };
+
+// bench_fixed()
+// bench_fixed() times mont_pow() on the GMP engine and on the fixed-width kernels against
+// mpz_powm() on one thread, at the moduli the key sizes give, and checks them against pow_mod()
+static bool bench_fixed(uint64_t *sizes, size_t nsizes, double budget) {
+    mpz_t n, d, a, o, ref;
+    mpz_inits(n, d, a, o, ref, NULL);
+    bool agree = true;
+
+    fprintf(stdout, "%6s %6s %6s %12s %12s %14s %10s\n", "bits", "exp", "limbs", "gmp op/s",
+        "fixed op/s", "mpz_powm op/s", "vs gmp");
+    for (size_t i = 0; i < nsizes; i++) {
+        for (int x = 0; x < 3; x++) {
+            uint64_t bits = x == 1 ? sizes[i] / 2 : sizes[i];
+            random_modulus(n, bits);
+            if (x == 2) {
+                mpz_set_ui(d, 65537);
+            } else {
+                mpz_urandomb(d, state, bits);
+            }
+            mpz_urandomm(a, state, n);
+            pow_mod(ref, a, d, n);
+
+            // Engine 0 and 1 are mont_pow() on the GMP path and the fixed kernels, 2 is mpz_powm()
+            double rate[3] = { 0 };
+            bool same = true;
+            bool fixed = false;
+            for (int engine = 0; engine < 3; engine++) {
+                mont_t ctx;
+                mont_init(&ctx, n);
+                fixed = (engine == 1 && mont_use(&ctx, fixed_kernel)) || fixed;
+                uint64_t ops = 0;
+                double start = now();
+                double elapsed = 0;
+                do {
+                    if (engine == 2) {
+                        mpz_powm(o, a, d, n);
+                    } else {
+                        mont_pow(o, a, d, &ctx);
+                    }
+                    ops++;
+                    elapsed = now() - start;
+                } while (elapsed < budget);
+                same = same && mpz_cmp(o, ref) == 0;
+                mont_clear(&ctx);
+                rate[engine] = ops / elapsed;
+                record("fixed", fixed_ops[engine][x], sizes[i], rate[engine], "op/s");
+            }
+            agree = agree && same;
+            fprintf(stdout, "%6" PRIu64 " %6s %6zu %12.1f %12.1f %14.1f %9.2fx%s%s\n", sizes[i],
+                simd_exps[x], mpz_size(n), rate[0], rate[1], rate[2], rate[1] / rate[0],
+                fixed ? "" : "  (no kernel)", same ? "" : "  MISMATCH");
+        }
+    }
+    mpz_clears(n, d, a, o, ref, NULL);
+    return agree;
+}
+
+// Bytes hashed per measurement by the hash suite
+#define HASH_BYTES (16 << 20)
+
+// bench_hash()
+// bench_hash() times each SHA-256 kernel this CPU supports in MB/s on one thread, checks the
+// FIPS 180-4 "abc" vector and that the kernels agree on data fed in odd sized pieces
+static bool bench_hash(double budget) {
+    static const uint8_t abc[SHA256_DIGEST] = { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+        0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a,
+        0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad };
+    uint8_t *data = (uint8_t *) malloc(HASH_BYTES);
+    for (uint64_t i = 0; i < HASH_BYTES; i++) {
+        data[i] = (uint8_t) gmp_urandomb_ui(state, 8);
+    }
+    uint8_t ref[SHA256_DIGEST], digest[SHA256_DIGEST];
+    bool agree = true;
+
+    fprintf(stdout, "%12s %12s\n", "kernel", "MB/s");
+    for (int kernel = SHA256_SCALAR; kernel <= SHA256_SHANI; kernel++) {
+        if (!sha256_supported(kernel)) {
+            continue;
+        }
+        sha256_t ctx;
+        sha256_init(&ctx);
+        ctx.kernel = kernel;
+        sha256_update(&ctx, (const uint8_t *) "abc", 3);
+        sha256_final(&ctx, digest);
+        bool same = memcmp(digest, abc, SHA256_DIGEST) == 0;
+
+        // Odd piece sizes cross the block boundaries at every offset
+        sha256_init(&ctx);
+        ctx.kernel = kernel;
+        for (uint64_t off = 0, len = 1; off < 1 << 16; off += len, len = len % 251 + 7) {
+            sha256_update(&ctx, data + off, len);
+        }
+        sha256_final(&ctx, digest);
+        if (kernel == SHA256_SCALAR) {
+            memcpy(ref, digest, SHA256_DIGEST);
+        }
+        same = same && memcmp(digest, ref, SHA256_DIGEST) == 0;
+        agree = agree && same;
+
+        uint64_t bytes = 0;
+        double start = now();
+        double elapsed = 0;
+        do {
+            sha256_init(&ctx);
+            ctx.kernel = kernel;
+            sha256_update(&ctx, data, HASH_BYTES);
+            sha256_final(&ctx, digest);
+            bytes += HASH_BYTES;
+            elapsed = now() - start;
+        } while (elapsed < budget);
+        double rate = bytes / elapsed / 1e6;
+        fprintf(stdout, "%12s %12.1f%s\n", sha256_name(kernel), rate, same ? "" : "  MISMATCH");
+        record("hash", sha256_name(kernel), 0, rate, "MB/s");
+    }
+    free(data);
+    return agree;
+}
+
+// same_file()
+// same_file() compares two files from their start
+static bool same_file(FILE *a, FILE *b) {
+    rewind(a);
+    rewind(b);
+    int x, y;
+    do {
+        x = getc(a);
+        y = getc(b);
+    } while (x == y && x != EOF);
+    return x == y;
+}
+
+// empty()
+// empty() truncates a temporary file so it can be written again
+static void empty(FILE *f) {
+    fflush(f);
+    if (ftruncate(fileno(f), 0) != 0) {
+        fprintf(stderr, "Error: failed to truncate a temporary file.\n");
+    }
+    rewind(f);
+}
+
+// bench_file()
+// bench_file() encrypts and decrypts a generated file of bytes random bytes in each output
+// format and reports plaintext MB/s, checking the round trip
+static bool bench_file(uint64_t *sizes, size_t nsizes, uint64_t bytes, uint64_t threads) {
+    static const struct {
+        const char *name;
+        bool binary, hybrid;
+    } modes[] = { { "hex", false, false }, { "binary", true, false }, { "hybrid", true, true } };
+    size_t nmodes = sizeof(modes) / sizeof(modes[0]);
+    static const char *enc_ops[] = { "encrypt_hex", "encrypt_binary", "encrypt_hybrid" };
+    static const char *dec_ops[] = { "decrypt_hex", "decrypt_binary", "decrypt_hybrid" };
+
+    mpz_t p, q, n, e, d, dp, dq, qinv;
+    mpz_inits(p, q, n, e, d, dp, dq, qinv, NULL);
+    bool agree = true;
+
+    FILE *plain = tmpfile();
+    FILE *cipher = tmpfile();
+    FILE *back = tmpfile();
+    if (plain == NULL || cipher == NULL || back == NULL) {
+        fprintf(stderr, "Error: failed to create temporary files.\n");
+        return false;
+    }
+    for (uint64_t i = 0; i < bytes; i++) {
+        putc(gmp_urandomb_ui(state, 8), plain);
+    }
+
+    fprintf(stdout, "%6s %8s %14s %14s\n", "bits", "mode", "encrypt MB/s", "decrypt MB/s");
+    for (size_t i = 0; i < nsizes; i++) {
+        rsa_make_pub(p, q, n, e, sizes[i], 50);
+        rsa_make_priv(d, e, p, q);
+        rsa_make_crt(dp, dq, qinv, d, p, q);
+        for (size_t j = 0; j < nmodes; j++) {
+            rsa_opts_t opts
+                = { .threads = threads, .binary = modes[j].binary, .hybrid = modes[j].hybrid };
+            rewind(plain);
+            empty(cipher);
+            double start = now();
+            rsa_encrypt_file_opts(plain, cipher, n, e, &opts);
+            fflush(cipher);
+            double enc = now() - start;
+
+            rewind(cipher);
+            empty(back);
+            start = now();
+            bool ok = rsa_decrypt_file_crt_opts(cipher, back, n, p, q, dp, dq, qinv, &opts);
+            fflush(back);
+            double dec = now() - start;
+            agree = agree && ok && same_file(plain, back);
+
+            double mb = bytes / 1e6;
+            fprintf(stdout, "%6" PRIu64 " %8s %14.2f %14.2f\n", sizes[i], modes[j].name,
+                mb / enc, mb / dec);
+            record("file", enc_ops[j], sizes[i], mb / enc, "MB/s");
+            record("file", dec_ops[j], sizes[i], mb / dec, "MB/s");
+        }
+    }
+
+    fclose(plain);
+    fclose(cipher);
+    fclose(back);
+    mpz_clears(p, q, n, e, d, dp, dq, qinv, NULL);
+    return agree;
+}
+
+// write_json()
+// write_json() writes the run parameters and every recorded result to jsonfile
+static void write_json(FILE *jsonfile, uint64_t seed) {
+    fprintf(jsonfile, "{\n  \"seed\": %" PRIu64 ",\n  \"results\": [\n", seed);
+    for (uint64_t i = 0; i < nresults; i++) {
+        result_t *r = &results[i];
+        fprintf(jsonfile,
+            "    {\"suite\": \"%s\", \"op\": \"%s\", \"bits\": %" PRIu64
+            ", \"value\": %.3f, \"unit\": \"%s\"}%s\n",
+            r->suite, r->op, r->bits, r->value, r->unit, i + 1 < nresults ? "," : "");
+    }
+    fprintf(jsonfile, "  ]\n}\n");
+}
+
+// main()
+// main() runs the selected suites at each modulus size, exits 1 if any results disagree.
+int main(int argc, char **argv) {
+    int opt = 0;
+    uint64_t reps = 20;
+    uint64_t seed = 2022;
+    uint64_t keys = 5;
+    uint64_t bytes = 65536;
+    uint64_t threads = 1;
+    double budget = 0.2;
+    char *suites = "pow,prim,keygen,file,alloc,check,multi,simd,fixed,hash";
+    bool arena = false;
+    FILE *jsonfile = NULL;
+    uint64_t sizes[] = { 1024, 2048, 3072, 4096 };
+    size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    uint64_t multi_sizes[] = { 2048, 4096 };
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'r': reps = strtoul(optarg, NULL, 10); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'm': suites = optarg; break;
+        case 'b':
+            sizes[0] = strtoul(optarg, NULL, 10);
+            nsizes = 1;
+            break;
+        case 'k': keys = strtoul(optarg, NULL, 10); break;
+        case 'f': bytes = strtoul(optarg, NULL, 10); break;
+        case 'T': budget = strtoul(optarg, NULL, 10) / 1e3; break;
+        case 't': threads = strtoul(optarg, NULL, 10); break;
+        case 'j':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open jsonfile.\n");
+                return 1;
+            }
+            break;
+        case 'A': arena = true; break;
+        case 'h': help(); return 0;
+        default: help(); return 1;
+        }
+    }
+    if (reps < 1 || keys < 1 || sizes[0] < 64) {
+        fprintf(stderr, "Error: invalid benchmark parameters.\n");
+        return 1;
+    }
+
+    // The hooks go in before the first GMP allocation, the counts feed the alloc suite
+    if (arena) {
+        arena_install();
+    } else {
+        alloc_count_install();
+    }
+    randstate_init(seed);
+    bool agree = true;
+    bool first = true;
+
+    // Run the suites in a fixed order, whatever order they were listed in
+    if (strstr(suites, "pow") != NULL) {
+        agree = bench_pow(sizes, nsizes, reps) && agree;
+        first = false;
+    }
+    if (strstr(suites, "prim") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        bench_prim(sizes, nsizes, budget);
+        first = false;
+    }
+    if (strstr(suites, "keygen") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        bench_keygen(sizes, nsizes, keys, seed);
+        first = false;
+    }
+    if (strstr(suites, "file") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        agree = bench_file(sizes, nsizes, bytes, threads) && agree;
+        first = false;
+    }
+    if (strstr(suites, "alloc") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        agree = bench_alloc(sizes, nsizes, budget) && agree;
+        first = false;
+    }
+    if (strstr(suites, "check") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        agree = bench_check(sizes, nsizes) && agree;
+        first = false;
+    }
+    if (strstr(suites, "multi") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        // Multi-prime keys pay off at the larger sizes, -b still picks one
+        bool one = nsizes == 1;
+        agree = bench_multi(one ? sizes : multi_sizes, one ? 1 : 2, keys, seed, budget) && agree;
+        first = false;
+    }
+    if (strstr(suites, "simd") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        agree = bench_simd(sizes, nsizes, budget) && agree;
+        first = false;
+    }
+    if (strstr(suites, "fixed") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        agree = bench_fixed(sizes, nsizes, budget) && agree;
+        first = false;
+    }
+    if (strstr(suites, "hash") != NULL) {
+        if (!first) {
+            fprintf(stdout, "\n");
+        }
+        agree = bench_hash(budget) && agree;
+    }
+
+    if (jsonfile != NULL) {
+        write_json(jsonfile, seed);
+        fclose(jsonfile);
+    }
+    if (!agree) {
+        fprintf(stderr, "Error: results differ.\n");
+    }
+    randstate_clear();
+    return agree ? 0 : 1;
+}
@@ -3,12 +3,23 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
+#include "keycache.h"
+#include "librsa.h"
+#include "batch.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <getopt.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:r:x:m:D:O:Cvh"
+
+static struct option longopts[] = { { "stats-json", required_argument, NULL, 'J' },
+    { NULL, 0, NULL, 0 } };
 
 /*
 int main(void) {
@@ -22,17 +33,79 @@ void help(void) {
    Encrypted data is encrypted by the encrypt program.\n\
 \n\
 USAGE\n\
-   ./decrypt [-hv] [-i infile] [-o outfile] -n privkey\n\
+   ./decrypt [-hvC] [-i infile] [-o outfile] [-t threads]\n\
+             [-r offset:length [-x idxfile]] [--stats-json file] -n privkey\n\
+   ./decrypt [-hvC] [-m manifest | -D indir -O outdir] [-t threads]\n\
+             [--stats-json file] -n privkey\n\
 \n\
 OPTIONS\n\
    -h              Display program help and usage.\n\
-   -v              Display verbose program output.\n\
+   -v              Display verbose program output, phase timings go to stderr.\n\
    -i infile       Input file of data to decrypt (default: stdin).\n\
    -o outfile      Output file for decrypted data (default: stdout).\n\
-   -n pvfile       Private key file (default: rsa.priv).\n");
+   -n pvfile       Private key file (default: rsa.priv).\n\
+   -t threads      Worker threads for decrypting blocks, or files at once in a batch\n\
+                   (default: 1, all CPUs in a batch).\n\
+   -m manifest     Decrypt every file listed in manifest, one input and output path per\n\
+                   line split by a tab, loading the key only once.\n\
+   -D indir        Decrypt every file under indir to the same path under outdir.\n\
+   -O outdir       Output directory of -D, made as needed.\n\
+   -r off:len      Only decrypt the len plaintext bytes starting at byte off, seeking\n\
+                   straight to the blocks that hold them, or from the start when the\n\
+                   input was compressed with encrypt -z.\n\
+   -x idxfile      Block index written by encrypt -x, lets -r seek in hex input too.\n\
+   -C              Load the key from pvfile.cache, made on the first run and remade\n\
+                   whenever pvfile changes, skipping the parse and setup.\n\
+   --stats-json f  Write phase timings and counters as JSON to f.\n");
     return;
 }
 
+// decrypt_to()
+// decrypt_to() decrypts infile to outfile with key, returns why it failed or NULL if it didn't
+// The writer is closed here so a failed write is told apart from a malformed input
+static const char *decrypt_to(privkey_t *key, FILE *infile, FILE *outfile, rsa_opts_t *opts) {
+    reader_t *reader = reader_open(infile);
+    writer_t *writer = writer_open(outfile);
+    bool ok = privkey_decrypt_stream(key, reader, writer, opts);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    if (!wrote) {
+        return "failed to write output";
+    }
+    return ok ? NULL : "malformed ciphertext";
+}
+
+// batch_arg_t
+// batch_arg_t is what every file of a batch is decrypted with
+typedef struct {
+    privkey_t *key;
+    rsa_opts_t *opts;
+} batch_arg_t;
+
+// batch_decrypt()
+// batch_decrypt() decrypts one file of a batch on the calling thread
+static const char *batch_decrypt(void *arg, FILE *infile, FILE *outfile) {
+    batch_arg_t *a = (batch_arg_t *) arg;
+    return decrypt_to(a->key, infile, outfile, a->opts);
+}
+
+// parse_range()
+// parse_range() reads the offset:length of -r, both plain decimal numbers that fit 64 bits
+// A sign or blank is refused up front, scanf() and strtoull() would take "-5" and wrap it
+static bool parse_range(const char *arg, uint64_t *offset, uint64_t *length) {
+    char *end = NULL;
+    if (!isdigit((unsigned char) arg[0])) {
+        return false;
+    }
+    errno = 0;
+    *offset = strtoull(arg, &end, 10);
+    if (*end != ':' || !isdigit((unsigned char) end[1])) {
+        return false;
+    }
+    *length = strtoull(end + 1, &end, 10);
+    return *end == '\0' && errno == 0;
+}
+
 int main(int argc, char **argv) {
 
     // opt for getopt
@@ -40,14 +113,22 @@ int main(int argc, char **argv) {
 
     // The booleans for command line options
     bool stats = false;
+    bool cache = false;
+    FILE *jsonfile = NULL;
     char *pvpath = "rsa.priv";
+    rsa_opts_t opts = { 0 };
+    opts.threads = 0;
+    // Batch mode inputs
+    char *manifest = NULL;
+    char *indir = NULL;
+    char *outdir = NULL;
 
     // The public/private files
     FILE *infile = stdin;
     FILE *outfile = stdout;
 
     // gets all command line options
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, longopts, NULL)) != -1) {
         switch (opt) {
         case 'i':
             infile = fopen(optarg, "r");
@@ -64,44 +145,168 @@ int main(int argc, char **argv) {
             }
             break;
         case 'n': pvpath = optarg; break;
+        case 'J':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open stats file.\n");
+                return 1;
+            }
+            break;
+        case 't':
+            opts.threads = strtoul(optarg, NULL, 10);
+            if (opts.threads < 1) {
+                fprintf(stderr, "Error: Number of threads is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'r':
+            if (!parse_range(optarg, &opts.offset, &opts.length)) {
+                fprintf(stderr, "Error: Range must be offset:length.\n");
+                return 1;
+            }
+            opts.range = true;
+            break;
+        case 'x':
+            opts.index = fopen(optarg, "r");
+            if (opts.index == NULL) {
+                fprintf(stderr, "Error: failed to open index.\n");
+                return 1;
+            }
+            break;
+        case 'm': manifest = optarg; break;
+        case 'D': indir = optarg; break;
+        case 'O': outdir = optarg; break;
         case 'v': stats = true; break;
+        case 'C': cache = true; break;
         case 'h': help(); return 0;
         default: help(); return 1;
         }
     }
 
+    // List the files of a batch before touching the key, a bad manifest stops here
+    batch_t batch;
+    batch_init(&batch);
+    bool batching = manifest != NULL || indir != NULL;
+    if (batching && (opts.range || (indir != NULL) != (outdir != NULL))) {
+        fprintf(stderr, "Error: a batch takes -m, or -D with -O, and no range.\n");
+        return 1;
+    }
+    if (manifest != NULL) {
+        FILE *list = fopen(manifest, "r");
+        uint64_t line = 0;
+        if (list == NULL) {
+            fprintf(stderr, "Error: failed to open manifest.\n");
+            return 1;
+        }
+        if (!batch_manifest(&batch, list, &line)) {
+            fprintf(stderr, "Error: manifest line %" PRIu64 " is not input<TAB>output.\n", line);
+            fclose(list);
+            batch_clear(&batch);
+            return 1;
+        }
+        fclose(list);
+    }
+    if (indir != NULL && !batch_tree(&batch, indir, outdir)) {
+        fprintf(stderr, "Error: failed to read input directory.\n");
+        batch_clear(&batch);
+        return 1;
+    }
+    // A batch runs each file on one thread and as many files at once as there are CPUs
+    uint64_t workers = opts.threads;
+    if (batching) {
+        workers = workers > 0 ? workers : (uint64_t) sysconf(_SC_NPROCESSORS_ONLN);
+        opts.threads = 1;
+    }
+    opts.threads = opts.threads > 0 ? opts.threads : 1;
+
+    uint64_t start = stats_clock();
     FILE *pvfile = fopen(pvpath, "r");
     // Check if pvfile exists
     if (pvfile == NULL) {
         fprintf(stderr, "Error: failed to open private key.\n");
         fclose(infile);
         fclose(outfile);
-        fclose(pvfile);
+        batch_clear(&batch);
         return 1;
     }
-    mpz_t n, e;
-    mpz_inits(n, e, NULL);
 
-    // Read the private key
-    rsa_read_priv(n, e, pvfile);
+    // Read the private key, crt is false for old keys with only n and d
+    // The cache, when asked for and current, also skips building the contexts
+    privkey_t key;
+    privkey_init(&key);
+    char cachepath[4096];
+    snprintf(cachepath, sizeof(cachepath), "%s%s", pvpath, KEYCACHE_SUFFIX);
+    bool cached = false;
+    if (!privkey_load(&key, pvfile, cache ? cachepath : NULL, &cached)) {
+        fprintf(stderr, "Error: failed to read private key.\n");
+        privkey_clear(&key);
+        fclose(pvfile);
+        fclose(infile);
+        fclose(outfile);
+        batch_clear(&batch);
+        return 1;
+    }
+    if (cache && !cached && !privkey_save(&key, cachepath)) {
+        fprintf(stderr, "Warning: failed to write key cache %s.\n", cachepath);
+    }
+    stats_phase(PHASE_KEY_LOAD, start);
 
     size_t prbits;
     if (stats) {
-        prbits = mpz_sizeinbase(n, 2);
-        gmp_fprintf(stdout, "n (%zu bits) %Zd\n", prbits, n);
-        prbits = mpz_sizeinbase(e, 2);
-        gmp_fprintf(stdout, "e (%zu bits) %Zd\n", prbits, e);
+        prbits = mpz_sizeinbase(key.n, 2);
+        gmp_fprintf(stdout, "n (%zu bits) %Zd\n", prbits, key.n);
+        prbits = mpz_sizeinbase(key.d, 2);
+        gmp_fprintf(stdout, "e (%zu bits) %Zd\n", prbits, key.d);
+        if (key.crt) {
+            prbits = mpz_sizeinbase(key.p, 2);
+            gmp_fprintf(stdout, "p (%zu bits) %Zd\n", prbits, key.p);
+            prbits = mpz_sizeinbase(key.q, 2);
+            gmp_fprintf(stdout, "q (%zu bits) %Zd\n", prbits, key.q);
+            for (uint64_t i = 0; i < key.extra.count; i++) {
+                prbits = mpz_sizeinbase(key.extra.r[i], 2);
+                gmp_fprintf(stdout, "r%" PRIu64 " (%zu bits) %Zd\n", i + 3, prbits,
+                    key.extra.r[i]);
+            }
+        }
     }
 
-    // Decrypt the file
-    rsa_decrypt_file(infile, outfile, n, e);
+    // Decrypt the file, using CRT when the key has the fields for it
+    // Hex lines and the binary container are both accepted, the workers copy the contexts
+    bool ok = true;
+    if (batching) {
+        batch_arg_t arg = { &key, &opts };
+        uint64_t failed = batch_run(&batch, workers, batch_decrypt, &arg);
+        batch_report(&batch, stderr);
+        if (stats) {
+            fprintf(stdout, "batch: %" PRIu64 " files, %" PRIu64 " failed\n", batch.count, failed);
+        }
+        ok = failed == 0;
+    } else {
+        const char *error = decrypt_to(&key, infile, outfile, &opts);
+        if (error != NULL) {
+            fprintf(stderr, "Error: %s.\n", error);
+            ok = false;
+        }
+    }
+    fflush(outfile);
+    if (stats) {
+        stats_print(stderr);
+    }
+    if (jsonfile != NULL) {
+        stats_write_json(jsonfile);
+        fclose(jsonfile);
+    }
 
     // Clear variables and close files
     fclose(pvfile);
     fclose(infile);
     fclose(outfile);
-    mpz_clears(n, e, NULL);
+    if (opts.index != NULL) {
+        fclose(opts.index);
+    }
+    privkey_clear(&key);
+    batch_clear(&batch);
 
     // Exits the program
-    return 0;
+    return ok ? 0 : 1;
 }
@@ -3,13 +3,22 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
+#include "keycache.h"
+#include "librsa.h"
+#include "batch.h"
 
 #include <limits.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <inttypes.h>
 #include <unistd.h>
+#include <getopt.h>
 
-#define OPTIONS "i:o:n:vh"
+#define OPTIONS "i:o:n:t:x:m:D:O:bHzCvh"
+
+static struct option longopts[] = { { "stats-json", required_argument, NULL, 'J' },
+    { NULL, 0, NULL, 0 } };
 
 // help()
 // help() prints out the program usage and help.
@@ -19,17 +28,64 @@ void help(void) {
    Encrypted data is decrypted by the decrypt program.\n\
 \n\
 USAGE\n\
-   ./encrypt [-hv] [-i infile] [-o outfile] -n pubkey\n\
+   ./encrypt [-hvbHzC] [-i infile] [-o outfile] [-t threads] [-x idxfile]\n\
+             [--stats-json file] -n pubkey\n\
+   ./encrypt [-hvbHzC] [-m manifest | -D indir -O outdir] [-t threads]\n\
+             [--stats-json file] -n pubkey\n\
 \n\
 OPTIONS\n\
    -h              Display program help and usage.\n\
-   -v              Display verbose program output.\n\
+   -v              Display verbose program output, phase timings go to stderr.\n\
+   -b              Write the binary ciphertext container instead of hex lines.\n\
+   -H              Hybrid mode, RSA wraps a session key and ChaCha20-Poly1305 encrypts the data.\n\
+   -z              Compress the data before encrypting it, always in the binary container\n\
+                   as it is flagged in the header.\n\
    -i infile       Input file of data to encrypt (default: stdin).\n\
    -o outfile      Output file for encrypted data (default: stdout).\n\
-   -n pbfile       Public key file (default: rsa.pub).\n");
+   -n pbfile       Public key file (default: rsa.pub).\n\
+   -t threads      Worker threads for encrypting blocks, or files at once in a batch\n\
+                   (default: 1, all CPUs in a batch).\n\
+   -m manifest     Encrypt every file listed in manifest, one input and output path per\n\
+                   line split by a tab, loading and checking the key only once.\n\
+   -D indir        Encrypt every file under indir to the same path under outdir.\n\
+   -O outdir       Output directory of -D, made as needed.\n\
+   -x idxfile      Write the block index of the hex lines to idxfile for decrypt -r.\n\
+   -C              Load the key from pbfile.cache, made on the first run and remade\n\
+                   whenever pbfile changes, skipping the parse and signature check.\n\
+   --stats-json f  Write phase timings and counters as JSON to f.\n");
     return;
 }
 
+// encrypt_to()
+// encrypt_to() encrypts infile to outfile with key, returns why it failed or NULL if it didn't
+// The writer is closed here so a failed write is told apart from a session key that couldn't
+// be made
+static const char *encrypt_to(pubkey_t *key, FILE *infile, FILE *outfile, rsa_opts_t *opts) {
+    reader_t *reader = reader_open(infile);
+    writer_t *writer = writer_open(outfile);
+    bool ok = pubkey_encrypt_stream(key, reader, writer, opts);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    if (!wrote) {
+        return "failed to write output";
+    }
+    return ok ? NULL : "failed to make a session key";
+}
+
+// batch_arg_t
+// batch_arg_t is what every file of a batch is encrypted with
+typedef struct {
+    pubkey_t *key;
+    rsa_opts_t *opts;
+} batch_arg_t;
+
+// batch_encrypt()
+// batch_encrypt() encrypts one file of a batch on the calling thread
+static const char *batch_encrypt(void *arg, FILE *infile, FILE *outfile) {
+    batch_arg_t *a = (batch_arg_t *) arg;
+    return encrypt_to(a->key, infile, outfile, a->opts);
+}
+
 // main()
 // main() opens the input file and the public key, and encrypts the input file and saves to the output file.
 int main(int argc, char **argv) {
@@ -39,17 +95,30 @@ int main(int argc, char **argv) {
 
     // Booleans for command line options
     bool stats = false;
+    bool cache = false;
+    FILE *jsonfile = NULL;
     // Files to use
     FILE *infile = stdin;
     FILE *outfile = stdout;
 
     // Path of public key
     char *keypath = "rsa.pub";
+    // Worker threads and output format
+    rsa_opts_t opts = { 0 };
+    opts.threads = 0;
+    // Batch mode inputs
+    char *manifest = NULL;
+    char *indir = NULL;
+    char *outdir = NULL;
     // gets all command line options
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, longopts, NULL)) != -1) {
         switch (opt) {
         case 'h': help(); return 0;
         case 'v': stats = true; break;
+        case 'b': opts.binary = true; break;
+        case 'H': opts.hybrid = true; break;
+        case 'z': opts.compress = true; break;
+        case 'C': cache = true; break;
         case 'i':
             infile = fopen(optarg, "r");
             if (infile == NULL) {
@@ -65,57 +134,186 @@ int main(int argc, char **argv) {
             }
             break;
         case 'n': keypath = optarg; break;
+        case 'J':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open stats file.\n");
+                return 1;
+            }
+            break;
+        case 't':
+            opts.threads = strtoul(optarg, NULL, 10);
+            if (opts.threads < 1) {
+                fprintf(stderr, "Error: Number of threads is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'm': manifest = optarg; break;
+        case 'D': indir = optarg; break;
+        case 'O': outdir = optarg; break;
+        case 'x':
+            opts.index = fopen(optarg, "w");
+            if (opts.index == NULL) {
+                fprintf(stderr, "Error: failed to open index.\n");
+                return 1;
+            }
+            break;
         default: help(); return 1;
         }
     }
+    // The binary container is fixed-width, decrypt -r seeks in it without an index
+    if (opts.index != NULL && (opts.binary || opts.hybrid || opts.compress)) {
+        fprintf(stderr, "Error: the index is only for hex output.\n");
+        return 1;
+    }
+
+    // List the files of a batch before touching the key, a bad manifest stops here
+    batch_t batch;
+    batch_init(&batch);
+    bool batching = manifest != NULL || indir != NULL;
+    if (batching && (opts.index != NULL || (indir != NULL) != (outdir != NULL))) {
+        fprintf(stderr, "Error: a batch takes -m, or -D with -O, and no index.\n");
+        return 1;
+    }
+    if (manifest != NULL) {
+        FILE *list = fopen(manifest, "r");
+        uint64_t line = 0;
+        if (list == NULL) {
+            fprintf(stderr, "Error: failed to open manifest.\n");
+            return 1;
+        }
+        if (!batch_manifest(&batch, list, &line)) {
+            fprintf(stderr, "Error: manifest line %" PRIu64 " is not input<TAB>output.\n", line);
+            fclose(list);
+            batch_clear(&batch);
+            return 1;
+        }
+        fclose(list);
+    }
+    if (indir != NULL && !batch_tree(&batch, indir, outdir)) {
+        fprintf(stderr, "Error: failed to read input directory.\n");
+        batch_clear(&batch);
+        return 1;
+    }
+    // A batch runs each file on one thread and as many files at once as there are CPUs
+    uint64_t workers = opts.threads;
+    if (batching) {
+        workers = workers > 0 ? workers : (uint64_t) sysconf(_SC_NPROCESSORS_ONLN);
+        opts.threads = 1;
+    }
+    opts.threads = opts.threads > 0 ? opts.threads : 1;
 
     // Read the public key
+    uint64_t start = stats_clock();
     FILE *pubkey = fopen(keypath, "r");
 
     // Check if public key is valid
     if (pubkey == NULL) {
         fprintf(stderr, "Error: failed to open public key.\n");
+        batch_clear(&batch);
         return 1;
     }
     // Initalize variables
-    mpz_t n, e, s, user;
-    mpz_inits(n, e, s, user, NULL);
-    char username[1024];
+    pubkey_t key;
+    pubkey_init(&key);
+    rsa_work_t work;
+    rsa_work_init(&work);
     size_t prbits;
 
-    // Read public key
-    rsa_read_pub(n, e, s, username, pubkey);
+    // Read public key, from its cache when asked to and the cache is current
+    char cachepath[4096];
+    snprintf(cachepath, sizeof(cachepath), "%s%s", keypath, KEYCACHE_SUFFIX);
+    bool cached = false;
+    if (!pubkey_load(&key, pubkey, cache ? cachepath : NULL, &cached)) {
+        fprintf(stderr, "Error: failed to read public key.\n");
+        pubkey_clear(&key);
+        rsa_work_clear(&work);
+        fclose(infile);
+        fclose(outfile);
+        fclose(pubkey);
+        batch_clear(&batch);
+        return 1;
+    }
+    stats_phase(PHASE_KEY_LOAD, start);
     // Verbose printing
     if (stats) {
-        gmp_fprintf(stdout, "user = %s\n", username);
-        prbits = mpz_sizeinbase(s, 2);
-        gmp_fprintf(stdout, "s (%zu bits) %Zd\n", prbits, s);
-        prbits = mpz_sizeinbase(n, 2);
-        gmp_fprintf(stdout, "n (%zu bits) %Zd\n", prbits, n);
-        prbits = mpz_sizeinbase(e, 2);
-        gmp_fprintf(stdout, "e (%zu bits) %Zd\n", prbits, e);
+        gmp_fprintf(stdout, "user = %s\n", key.username);
+        prbits = mpz_sizeinbase(key.s, 2);
+        gmp_fprintf(stdout, "s (%zu bits) %Zd\n", prbits, key.s);
+        prbits = mpz_sizeinbase(key.n, 2);
+        gmp_fprintf(stdout, "n (%zu bits) %Zd\n", prbits, key.n);
+        prbits = mpz_sizeinbase(key.e, 2);
+        gmp_fprintf(stdout, "e (%zu bits) %Zd\n", prbits, key.e);
     }
 
-    // Convert username to an mpz_t
-    mpz_set_str(user, username, 62);
-
-    // Verify if signature is valid
-    if (!rsa_verify(user, s, e, n)) {
+    // Verify if signature is valid, a current cache records that it already was
+    start = stats_clock();
+    if (!pubkey_check(&key, &work)) {
         fprintf(stderr, "Error: Couldn't verify signature.\n");
-        mpz_clears(n, e, s, user, NULL);
+        pubkey_clear(&key);
+        rsa_work_clear(&work);
+        fclose(infile);
+        fclose(outfile);
+        fclose(pubkey);
+        batch_clear(&batch);
+        return 1;
+    }
+    stats_phase(PHASE_VERIFY, start);
+
+    // A small e could be undone with an integer root of the wrapped session key
+    if (opts.hybrid && mpz_cmp_ui(key.e, RSA_HYBRID_MIN_E) < 0) {
+        fprintf(stderr, "Error: hybrid mode needs a public exponent of at least %d.\n",
+            RSA_HYBRID_MIN_E);
+        pubkey_clear(&key);
+        rsa_work_clear(&work);
         fclose(infile);
         fclose(outfile);
         fclose(pubkey);
+        batch_clear(&batch);
         return 1;
     }
 
-    // Encrypt the file
-    rsa_encrypt_file(infile, outfile, n, e);
+    // A failed cache write only costs the next run the parse and the verify again
+    if (cache && !cached && !pubkey_save(&key, cachepath)) {
+        fprintf(stderr, "Warning: failed to write key cache %s.\n", cachepath);
+    }
+
+    // Encrypt the file, the workers copy the context for n
+    int rc = 0;
+    if (batching) {
+        batch_arg_t arg = { &key, &opts };
+        uint64_t failed = batch_run(&batch, workers, batch_encrypt, &arg);
+        batch_report(&batch, stderr);
+        if (stats) {
+            fprintf(stdout, "batch: %" PRIu64 " files, %" PRIu64 " failed\n", batch.count, failed);
+        }
+        rc = failed > 0 ? 1 : 0;
+    } else {
+        const char *error = encrypt_to(&key, infile, outfile, &opts);
+        if (error != NULL) {
+            fprintf(stderr, "Error: %s.\n", error);
+            rc = 1;
+        }
+    }
+    fflush(outfile);
+    if (opts.index != NULL && fclose(opts.index) != 0) {
+        fprintf(stderr, "Error: failed to write index.\n");
+        rc = 1;
+    }
+    if (stats) {
+        stats_print(stderr);
+    }
+    if (jsonfile != NULL) {
+        stats_write_json(jsonfile);
+        fclose(jsonfile);
+    }
 
     // Clear mpz_t and close files, exit program
-    mpz_clears(n, e, s, user, NULL);
+    batch_clear(&batch);
+    pubkey_clear(&key);
+    rsa_work_clear(&work);
     fclose(infile);
     fclose(outfile);
     fclose(pubkey);
-    return 0;
+    return rc;
 }
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include "fileio.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Buffers the read ahead thread cycles through, and iovecs a writer gathers before writev()
+#define IO_BUFFERS 2
+#define IO_VECS    1024
+
+struct reader {
+    FILE *file; // NULL for a reader over memory
+    int fd;
+
+    // The bytes being consumed, the whole rest of the file when it is mapped
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    bool eof;
+
+    // A mapped regular file, data starts at file offset start
+    uint8_t *map;
+    size_t map_len;
+    off_t start;
+
+    // The read ahead thread, which fills bufs[i] and marks it full for the loop to consume
+    bool threaded;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint8_t *bufs[IO_BUFFERS];
+    size_t lens[IO_BUFFERS];
+    bool full[IO_BUFFERS];
+    uint64_t cur; // Buffer data points into
+    bool holding; // Whether the loop still holds bufs[cur]
+    bool stop;
+};
+
+struct writer {
+    int fd; // -1 for a writer into memory
+    off_t origin; // File offset the writer started at, -1 if it can't be seeked back to
+    struct iovec iov[IO_VECS];
+    int count;
+    bool ok;
+
+    // Everything a memory writer has flushed, in a buffer grown by doubling
+    uint8_t *mem;
+    size_t mem_len;
+    size_t mem_cap;
+};
+
+// read_ahead()
+// read_ahead() is the reader thread, it fills the buffers in turn as the loop frees them
+// A read that returns nothing or fails marks the end of the input
+// The thread can only be cancelled while it is blocked in read()
+static void *read_ahead(void *arg) {
+    reader_t *r = (reader_t *) arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    for (uint64_t i = 0;; i = (i + 1) % IO_BUFFERS) {
+        pthread_mutex_lock(&r->lock);
+        while (r->full[i] && !r->stop) {
+            pthread_cond_wait(&r->cond, &r->lock);
+        }
+        bool stop = r->stop;
+        pthread_mutex_unlock(&r->lock);
+        if (stop) {
+            break;
+        }
+
+        ssize_t got;
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        do {
+            got = read(r->fd, r->bufs[i], IO_BUFFER);
+        } while (got < 0 && errno == EINTR);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        pthread_mutex_lock(&r->lock);
+        r->lens[i] = got > 0 ? (size_t) got : 0;
+        r->full[i] = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        if (got <= 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// map_file()
+// map_file() maps the rest of a regular file from the current position of infile
+// Returns false if infile isn't a seekable regular file or can't be mapped
+static bool map_file(reader_t *r) {
+    struct stat st;
+    off_t offset = ftello(r->file);
+    if (offset < 0 || fstat(r->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    r->start = offset;
+    if (st.st_size <= offset) {
+        // Nothing left, which mmap() can't map
+        r->eof = true;
+        return true;
+    }
+    off_t aligned = offset & ~(off_t) (sysconf(_SC_PAGESIZE) - 1);
+    r->map_len = st.st_size - aligned;
+    void *map = mmap(NULL, r->map_len, PROT_READ, MAP_PRIVATE, r->fd, aligned);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    madvise(map, r->map_len, MADV_SEQUENTIAL);
+    r->map = (uint8_t *) map;
+    r->data = r->map + (offset - aligned);
+    r->len = st.st_size - offset;
+    return true;
+}
+
+// reader_open()
+// reader_open() starts reading infile from its current position, infile must not hold
+// buffered input of its own
+reader_t *reader_open(FILE *infile) {
+    reader_t *r = (reader_t *) calloc(1, sizeof(reader_t));
+    r->file = infile;
+    r->fd = fileno(infile);
+    if (map_file(r)) {
+        return r;
+    }
+
+    // Pipes, terminals and anything that won't map get the read ahead thread
+    r->threaded = true;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    for (int i = 0; i < IO_BUFFERS; i++) {
+        r->bufs[i] = (uint8_t *) malloc(IO_BUFFER);
+    }
+    pthread_create(&r->thread, NULL, read_ahead, r);
+    return r;
+}
+
+// reader_open_mem()
+// reader_open_mem() reads the len bytes at data, which must outlive the reader
+reader_t *reader_open_mem(const uint8_t *data, size_t len) {
+    reader_t *r = (reader_t *) calloc(1, sizeof(reader_t));
+    r->fd = -1;
+    r->data = data;
+    r->len = len;
+    return r;
+}
+
+// fill()
+// fill() makes sure there is a byte to consume, waiting for the next buffer from the thread
+// when the current one is used up, returns false at the end of the input
+static bool fill(reader_t *r) {
+    if (r->pos < r->len) {
+        return true;
+    }
+    if (!r->threaded || r->eof) {
+        r->eof = true;
+        return false;
+    }
+    pthread_mutex_lock(&r->lock);
+    // Hand the used buffer back and wait for the next one
+    if (r->holding) {
+        r->full[r->cur] = false;
+        r->cur = (r->cur + 1) % IO_BUFFERS;
+        r->holding = false;
+        pthread_cond_broadcast(&r->cond);
+    }
+    while (!r->full[r->cur]) {
+        pthread_cond_wait(&r->cond, &r->lock);
+    }
+    r->holding = true;
+    r->data = r->bufs[r->cur];
+    r->len = r->lens[r->cur];
+    r->pos = 0;
+    pthread_mutex_unlock(&r->lock);
+    r->eof = r->len == 0;
+    return !r->eof;
+}
+
+// reader_read()
+// reader_read() copies the next len bytes into buf, returns fewer only at the end of the input
+size_t reader_read(reader_t *r, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while (got < len && fill(r)) {
+        size_t n = r->len - r->pos < len - got ? r->len - r->pos : len - got;
+        memcpy(buf + got, r->data + r->pos, n);
+        r->pos += n;
+        got += n;
+    }
+    return got;
+}
+
+// reader_next()
+// reader_next() points data at up to len of the next bytes where they already are, the
+// mapping or a read buffer, so a caller that only looks at the input skips the copy
+// The bytes stay valid until the next call on r. Returns 0 only at the end of the input.
+size_t reader_next(reader_t *r, const uint8_t **data, size_t len) {
+    if (!fill(r)) {
+        return 0;
+    }
+    size_t n = r->len - r->pos < len ? r->len - r->pos : len;
+    *data = r->data + r->pos;
+    r->pos += n;
+    return n;
+}
+
+// reader_peek()
+// reader_peek() returns the next byte without consuming it, or EOF
+int reader_peek(reader_t *r) {
+    return fill(r) ? r->data[r->pos] : EOF;
+}
+
+// reader_token()
+// reader_token() skips whitespace and copies the following run of other bytes into buf as a
+// string, returns its length, 0 at the end of the input or cap if it doesn't fit
+size_t reader_token(reader_t *r, char *buf, size_t cap) {
+    while (fill(r) && isspace(r->data[r->pos])) {
+        r->pos++;
+    }
+    size_t got = 0;
+    while (fill(r) && !isspace(r->data[r->pos])) {
+        if (got + 1 >= cap) {
+            return cap;
+        }
+        buf[got++] = r->data[r->pos++];
+    }
+    buf[got] = '\0';
+    return got;
+}
+
+// reader_skip()
+// reader_skip() passes over the next len bytes, returns fewer only at the end of the input
+// A mapped file or memory just moves along, a pipe still has to be read through
+uint64_t reader_skip(reader_t *r, uint64_t len) {
+    uint64_t got = 0;
+    while (got < len && fill(r)) {
+        size_t n = r->len - r->pos < len - got ? r->len - r->pos : len - got;
+        r->pos += n;
+        got += n;
+    }
+    return got;
+}
+
+// reader_close()
+// reader_close() stops the reader, a mapped infile is left positioned after the bytes consumed
+void reader_close(reader_t *r) {
+    if (r->threaded) {
+        pthread_mutex_lock(&r->lock);
+        r->stop = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        // The thread may be blocked reading a pipe that never ends
+        pthread_cancel(r->thread);
+        pthread_join(r->thread, NULL);
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        for (int i = 0; i < IO_BUFFERS; i++) {
+            free(r->bufs[i]);
+        }
+    } else if (r->file != NULL) {
+        if (r->map != NULL) {
+            munmap(r->map, r->map_len);
+        }
+        fseeko(r->file, r->start + r->pos, SEEK_SET);
+    }
+    free(r);
+}
+
+// writer_open()
+// writer_open() starts writing to outfile after flushing anything already written through it
+writer_t *writer_open(FILE *outfile) {
+    fflush(outfile);
+    writer_t *w = (writer_t *) calloc(1, sizeof(writer_t));
+    w->fd = fileno(outfile);
+    // Appending writes ignore the offset, so those can't be patched either
+    w->origin = fcntl(w->fd, F_GETFL) & O_APPEND ? -1 : lseek(w->fd, 0, SEEK_CUR);
+    w->ok = true;
+    return w;
+}
+
+// writer_open_mem()
+// writer_open_mem() starts gathering output in memory, collected with writer_take()
+writer_t *writer_open_mem(void) {
+    writer_t *w = (writer_t *) calloc(1, sizeof(writer_t));
+    w->fd = -1;
+    w->ok = true;
+    return w;
+}
+
+// writer_add()
+// writer_add() queues len bytes of buf, which must stay unchanged until the next flush
+void writer_add(writer_t *w, const void *buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (w->count == IO_VECS) {
+        writer_flush(w);
+    }
+    w->iov[w->count].iov_base = (void *) buf;
+    w->iov[w->count].iov_len = len;
+    w->count++;
+}
+
+// flush_mem()
+// flush_mem() appends everything queued to the memory of a memory writer
+static void flush_mem(writer_t *w) {
+    for (int i = 0; i < w->count; i++) {
+        size_t len = w->iov[i].iov_len;
+        if (w->mem_len + len > w->mem_cap) {
+            size_t cap = w->mem_cap > 0 ? w->mem_cap : IO_BUFFER;
+            while (cap < w->mem_len + len) {
+                cap *= 2;
+            }
+            w->mem = (uint8_t *) realloc(w->mem, cap);
+            w->mem_cap = cap;
+        }
+        memcpy(w->mem + w->mem_len, w->iov[i].iov_base, len);
+        w->mem_len += len;
+    }
+    w->count = 0;
+}
+
+// writer_flush()
+// writer_flush() writes everything queued, returns false if any write so far has failed
+bool writer_flush(writer_t *w) {
+    if (w->fd < 0) {
+        flush_mem(w);
+        return w->ok;
+    }
+    struct iovec *iov = w->iov;
+    int count = w->count;
+    while (count > 0 && w->ok) {
+        ssize_t n = writev(w->fd, iov, count);
+        if (n < 0) {
+            w->ok = errno == EINTR;
+            continue;
+        }
+        // Step over what was written, a short write leaves part of an iovec
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    w->count = 0;
+    return w->ok;
+}
+
+// writer_patch()
+// writer_patch() overwrites len bytes already written at pos bytes from where the writer
+// started, such as a count in a header that is only known at the end
+// Returns false if the output can't be seeked back to or the write fails
+bool writer_patch(writer_t *w, uint64_t pos, const void *buf, size_t len) {
+    if (!writer_flush(w)) {
+        return false;
+    }
+    if (w->fd < 0) {
+        if (pos + len > w->mem_len) {
+            return false;
+        }
+        memcpy(w->mem + pos, buf, len);
+        return true;
+    }
+    if (w->origin < 0) {
+        return false;
+    }
+    const uint8_t *p = (const uint8_t *) buf;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(w->fd, p + done, len - done, w->origin + pos + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// writer_take()
+// writer_take() flushes a memory writer and hands over what it gathered, which the caller
+// frees, the writer starts over empty. Returns NULL with len 0 if nothing was written.
+uint8_t *writer_take(writer_t *w, size_t *len) {
+    writer_flush(w);
+    uint8_t *mem = w->mem;
+    *len = w->mem_len;
+    w->mem = NULL;
+    w->mem_len = 0;
+    w->mem_cap = 0;
+    return mem;
+}
+
+// writer_close()
+// writer_close() flushes and frees the writer, returns false if any write failed
+bool writer_close(writer_t *w) {
+    bool ok = writer_flush(w);
+    free(w->mem);
+    free(w);
+    return ok;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Input and output under the file loops, going to the file descriptor behind a FILE
+// A reader maps regular files and reads anything else on a thread into two large buffers, so
+// reading a pipe overlaps with the work on the last buffer. A writer gathers buffers and
+// hands them to writev() in one call. The _mem forms read from and gather into memory instead,
+// for callers encrypting buffers.
+#define IO_BUFFER (1 << 20)
+
+typedef struct reader reader_t;
+
+typedef struct writer writer_t;
+
+reader_t *reader_open(FILE *infile);
+
+reader_t *reader_open_mem(const uint8_t *data, size_t len);
+
+size_t reader_read(reader_t *r, uint8_t *buf, size_t len);
+
+size_t reader_next(reader_t *r, const uint8_t **data, size_t len);
+
+int reader_peek(reader_t *r);
+
+size_t reader_token(reader_t *r, char *buf, size_t cap);
+
+uint64_t reader_skip(reader_t *r, uint64_t len);
+
+void reader_close(reader_t *r);
+
+writer_t *writer_open(FILE *outfile);
+
+writer_t *writer_open_mem(void);
+
+void writer_add(writer_t *w, const void *buf, size_t len);
+
+bool writer_flush(writer_t *w);
+
+bool writer_patch(writer_t *w, uint64_t pos, const void *buf, size_t len);
+
+uint8_t *writer_take(writer_t *w, size_t *len);
+
+bool writer_close(writer_t *w);
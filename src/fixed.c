@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "fixed.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+__extension__ typedef unsigned __int128 u128;
+
+// The kernel bodies take the limb count as an argument and are forced inline into a wrapper
+// per size that passes a constant, which is what gives each size its own unrolled copy
+#define INLINE static inline __attribute__((always_inline))
+
+// acc_t
+// acc_t is a column sum of the product scanning, 192 bits as a 128-bit low part and the
+// carries out of it, a column of 2k products of k limbs can't overflow it
+typedef struct {
+    u128 lo;
+    mp_limb_t hi;
+} acc_t;
+
+// mac()
+// mac() adds x * y to the column
+INLINE void mac(acc_t *c, mp_limb_t x, mp_limb_t y) {
+    u128 p = (u128) x * y;
+    c->lo += p;
+    c->hi += c->lo < p;
+}
+
+// add()
+// add() adds the column d to c, shifted left by one bit when twice is set for the products
+// a squaring counts twice
+INLINE void add(acc_t *c, acc_t *d, const int twice) {
+    u128 lo = twice ? d->lo << 1 : d->lo;
+    c->hi += twice ? (d->hi << 1) + (mp_limb_t) (d->lo >> 127) : d->hi;
+    c->lo += lo;
+    c->hi += c->lo < lo;
+}
+
+// shift()
+// shift() moves the column down a limb for the next one and returns the limb shifted out
+INLINE mp_limb_t shift(acc_t *c) {
+    mp_limb_t low = (mp_limb_t) c->lo;
+    c->lo = (c->lo >> 64) | ((u128) c->hi << 64);
+    c->hi = 0;
+    return low;
+}
+
+// finish()
+// finish() sets r to t, k limbs with a carry in top, less n when that is at least n
+// Both are computed and one picked, so the time doesn't depend on the result
+INLINE void finish(
+    mp_limb_t *r, const mp_limb_t *t, mp_limb_t top, const mp_limb_t *n, const int k) {
+    mp_limb_t d[k];
+    mp_limb_t borrow = 0;
+    for (int i = 0; i < k; i++) {
+        u128 s = (u128) t[i] - n[i] - borrow;
+        d[i] = (mp_limb_t) s;
+        borrow = (mp_limb_t) (s >> 64) & 1;
+    }
+    // With the carry set t is past n whatever the borrow, without it only if nothing borrowed
+    mp_limb_t keep = (mp_limb_t) 0 - (mp_limb_t) (top < borrow);
+    for (int i = 0; i < k; i++) {
+        r[i] = (t[i] & keep) | (d[i] & ~keep);
+    }
+}
+
+// mul_k()
+// mul_k() sets r = a * b * R^-1 mod n for k limb a, b < n with R = 2^(64k), r may alias a or b
+// Finely integrated product scanning: column i sums the products a[j] b[i - j] and the
+// m[j] n[i - j] of the reduction, where m[i] is picked to clear the low limb of column i
+INLINE void mul_k(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const mp_limb_t *n,
+    mp_limb_t ninv, const int k) {
+    mp_limb_t m[k], t[k];
+    acc_t c = { 0, 0 };
+    for (int i = 0; i < 2 * k - 1; i++) {
+        // The product and the reduction sum into separate columns, two carry chains the CPU
+        // can run side by side, joined before the low limb is needed
+        int lo = i < k ? 0 : i - k + 1;
+        int hi = i < k ? i : k;
+        acc_t d = { 0, 0 };
+        for (int j = lo; j < hi; j++) {
+            mac(&c, m[j], n[i - j]);
+            mac(&d, a[j], b[i - j]);
+        }
+        if (i < k) {
+            mac(&d, a[i], b[0]);
+        }
+        add(&c, &d, 0);
+        if (i < k) {
+            m[i] = (mp_limb_t) c.lo * ninv;
+            mac(&c, m[i], n[0]);
+            shift(&c);
+        } else {
+            t[i - k] = shift(&c);
+        }
+    }
+    t[k - 1] = shift(&c);
+    finish(r, t, (mp_limb_t) c.lo, n, k);
+}
+
+// sqr_k()
+// sqr_k() is mul_k() for a * a, each product a[j] a[i - j] with j < i - j is added once and
+// doubled, so the multiplication takes about half the products
+INLINE void sqr_k(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *n, mp_limb_t ninv,
+    const int k) {
+    mp_limb_t m[k], t[k];
+    acc_t c = { 0, 0 };
+    for (int i = 0; i < 2 * k - 1; i++) {
+        int lo = i < k ? 0 : i - k + 1;
+        int hi = i < k ? i : k;
+        acc_t d = { 0, 0 };
+        for (int j = lo; j < hi; j++) {
+            mac(&c, m[j], n[i - j]);
+        }
+        for (int j = lo; j < i - j; j++) {
+            mac(&d, a[j], a[i - j]);
+        }
+        add(&c, &d, 1);
+        if (i % 2 == 0) {
+            mac(&c, a[i / 2], a[i / 2]);
+        }
+        if (i < k) {
+            m[i] = (mp_limb_t) c.lo * ninv;
+            mac(&c, m[i], n[0]);
+            shift(&c);
+        } else {
+            t[i - k] = shift(&c);
+        }
+    }
+    t[k - 1] = shift(&c);
+    finish(r, t, (mp_limb_t) c.lo, n, k);
+}
+
+// FIXED_SIZE()
+// FIXED_SIZE() makes the kernels for K limbs
+#define FIXED_SIZE(K)                                                                          \
+    static void mul_##K(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b,                  \
+        const mp_limb_t *n, mp_limb_t ninv) {                                                  \
+        mul_k(r, a, b, n, ninv, K);                                                            \
+    }                                                                                          \
+    static void sqr_##K(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *n, mp_limb_t ninv) { \
+        sqr_k(r, a, n, ninv, K);                                                               \
+    }
+
+FIXED_SIZE(8)
+FIXED_SIZE(12)
+FIXED_SIZE(16)
+FIXED_SIZE(24)
+FIXED_SIZE(32)
+FIXED_SIZE(48)
+FIXED_SIZE(64)
+
+// fixed_kernel()
+// fixed_kernel() looks up the kernels for a k limb modulus, returns false if there are none
+bool fixed_kernel(mp_size_t k, mont_mul_t *mul, mont_sqr_t *sqr) {
+    switch (k) {
+    case 8: *mul = mul_8, *sqr = sqr_8; return true;
+    case 12: *mul = mul_12, *sqr = sqr_12; return true;
+    case 16: *mul = mul_16, *sqr = sqr_16; return true;
+    case 24: *mul = mul_24, *sqr = sqr_24; return true;
+    case 32: *mul = mul_32, *sqr = sqr_32; return true;
+    case 48: *mul = mul_48, *sqr = sqr_48; return true;
+    case 64: *mul = mul_64, *sqr = sqr_64; return true;
+    default: return false;
+    }
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+#include "mont.h"
+
+// Fixed-width Montgomery multiplication for the sizes keys come in
+// Each size is its own copy of one generic kernel with the limb count a compile time constant,
+// so the loops unroll, the temporaries live on the stack and the product and the reduction
+// run interleaved in one pass over the columns. They are slower than GMP's assembly, so they
+// are built into bench only, which hands fixed_kernel() to mont_use() to compare them. Other
+// sizes stay on GMP.
+bool fixed_kernel(mp_size_t k, mont_mul_t *mul, mont_sqr_t *sqr);
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include "frame.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// read_full()
+// read_full() reads exactly len bytes, returns false on end of file or error
+bool read_full(int fd, uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t got = read(fd, buf, len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        buf += got;
+        len -= got;
+    }
+    return true;
+}
+
+// write_full()
+// write_full() writes exactly len bytes, returns false on error
+bool write_full(int fd, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t put = write(fd, buf, len);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return false;
+        }
+        buf += put;
+        len -= put;
+    }
+    return true;
+}
+
+// frame_put_len()
+// frame_put_len() stores a frame length big-endian
+void frame_put_len(uint8_t *buf, uint32_t len) {
+    buf[0] = len >> 24;
+    buf[1] = len >> 16;
+    buf[2] = len >> 8;
+    buf[3] = len;
+}
+
+// frame_get_len()
+// frame_get_len() loads a big-endian frame length
+uint32_t frame_get_len(const uint8_t *buf) {
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8)
+           | buf[3];
+}
+
+// frame_read()
+// frame_read() reads one frame into buf, which must hold FRAME_MAX bytes
+// Returns false on end of file, error, or an empty or oversized frame
+bool frame_read(int fd, uint8_t *buf, uint32_t *len) {
+    uint8_t prefix[4];
+    if (!read_full(fd, prefix, 4)) {
+        return false;
+    }
+    *len = frame_get_len(prefix);
+    if (*len == 0 || *len > FRAME_MAX) {
+        return false;
+    }
+    return read_full(fd, buf, *len);
+}
+
+// frame_write()
+// frame_write() writes one frame made of the kind byte (operation or status) and body
+bool frame_write(int fd, uint8_t kind, const uint8_t *body, uint32_t len) {
+    uint8_t head[5];
+    frame_put_len(head, len + 1);
+    head[4] = kind;
+    return write_full(fd, head, 5) && write_full(fd, body, len);
+}
+
+// frame_connect()
+// frame_connect() connects to the Unix domain socket at path, returns -1 on failure
+int frame_connect(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Length-prefixed framing used by rsad, rsac and rsaload over a Unix domain socket
+// Every frame is a 4 byte big-endian length followed by that many bytes. The first byte of a
+// request is the operation and the first byte of a response is the status.
+#define FRAME_MAX (1 << 20)
+
+#define OP_ENCRYPT 'E'
+#define OP_DECRYPT 'D'
+#define OP_SIGN    'S'
+
+#define STATUS_OK    0
+#define STATUS_ERROR 1
+
+bool read_full(int fd, uint8_t *buf, size_t len);
+
+bool write_full(int fd, const uint8_t *buf, size_t len);
+
+bool frame_read(int fd, uint8_t *buf, uint32_t *len);
+
+bool frame_write(int fd, uint8_t kind, const uint8_t *body, uint32_t len);
+
+void frame_put_len(uint8_t *buf, uint32_t len);
+
+uint32_t frame_get_len(const uint8_t *buf);
+
+int frame_connect(const char *path);
@@ -0,0 +1,441 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "keycache.h"
+#include "rsa.h"
+#include "mont.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Cache layout, every integer big-endian:
+// magic[4], version, kind, limb bytes, flags, key file size (8 bytes), key file hash (8 bytes)
+// then the key fields, each integer as a 4 byte length and its bytes, for a private key the
+// count of extra primes and r, d and t of each, then each Montgomery
+// context as its limb count, ninv, R^2 mod n and R mod n, then a hash of everything before it
+#define CACHE_MAGIC   "\x89RKC"
+#define CACHE_VERSION 2
+#define CACHE_HEADER  24
+#define CACHE_TRAILER 8
+
+#define KIND_PUB  'P'
+#define KIND_PRIV 'S'
+
+#define FLAG_VERIFIED 0x01
+#define FLAG_CRT      0x02
+
+// cursor_t
+// cursor_t reads fields off a cache file held in memory, ok goes false on a short read
+typedef struct {
+    const uint8_t *p;
+    size_t left;
+    bool ok;
+} cursor_t;
+
+// cache_out_t
+// cache_out_t is a cache being written, gathered in memory so its hash can go at the end
+typedef struct {
+    FILE *f;
+    char *buf;
+    size_t len;
+} cache_out_t;
+
+// slurp()
+// slurp() reads the rest of f into a malloc()ed buffer, returns NULL on a read error
+static uint8_t *slurp(FILE *f, size_t *len) {
+    size_t cap = 4096;
+    size_t got = 0;
+    uint8_t *buf = (uint8_t *) malloc(cap);
+    while (true) {
+        got += fread(buf + got, sizeof(uint8_t), cap - got, f);
+        if (got < cap) {
+            break;
+        }
+        cap *= 2;
+        buf = (uint8_t *) realloc(buf, cap);
+    }
+    if (ferror(f)) {
+        free(buf);
+        return NULL;
+    }
+    // got < cap, so there is room to terminate the text
+    buf[got] = '\0';
+    *len = got;
+    return buf;
+}
+
+// fnv1a()
+// fnv1a() hashes the key file, which is enough to notice it changed under its cache, and the
+// cache itself to notice it was damaged
+static uint64_t fnv1a(const uint8_t *buf, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// put_u64()
+// put_u64() writes the low bytes of v big-endian
+static void put_u64(FILE *f, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        putc((v >> (8 * i)) & 0xFF, f);
+    }
+}
+
+// put_mpz()
+// put_mpz() writes a non-negative integer as its length and big-endian bytes
+static void put_mpz(FILE *f, mpz_t x) {
+    size_t len = mpz_sgn(x) == 0 ? 0 : (mpz_sizeinbase(x, 2) + 7) / 8;
+    uint8_t *buf = (uint8_t *) malloc(len + 1);
+    mpz_export(buf, NULL, 1, sizeof(uint8_t), 1, 0, x);
+    put_u64(f, len, 4);
+    fwrite(buf, sizeof(uint8_t), len, f);
+    free(buf);
+}
+
+// put_ctx()
+// put_ctx() writes the constants mont_load() needs to rebuild ctx
+static void put_ctx(FILE *f, mont_t *ctx) {
+    put_u64(f, ctx->k, 4);
+    put_u64(f, ctx->ninv, 8);
+    for (mp_size_t i = 0; i < ctx->k; i++) {
+        put_u64(f, ctx->r2[i], 8);
+    }
+    for (mp_size_t i = 0; i < ctx->k; i++) {
+        put_u64(f, ctx->one[i], 8);
+    }
+}
+
+// take()
+// take() consumes len bytes, returns NULL if there aren't that many
+static const uint8_t *take(cursor_t *c, size_t len) {
+    if (!c->ok || c->left < len) {
+        c->ok = false;
+        return NULL;
+    }
+    const uint8_t *p = c->p;
+    c->p += len;
+    c->left -= len;
+    return p;
+}
+
+// get_u64()
+// get_u64() reads a big-endian integer of the given bytes
+static uint64_t get_u64(cursor_t *c, int bytes) {
+    const uint8_t *p = take(c, bytes);
+    uint64_t v = 0;
+    for (int i = 0; p != NULL && i < bytes; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+// get_mpz()
+// get_mpz() reads an integer written by put_mpz()
+static void get_mpz(cursor_t *c, mpz_t x) {
+    uint64_t len = get_u64(c, 4);
+    const uint8_t *p = take(c, len);
+    if (p != NULL) {
+        mpz_import(x, len, 1, sizeof(uint8_t), 1, 0, p);
+    }
+}
+
+// get_ctx()
+// get_ctx() rebuilds a context for n written by put_ctx()
+static void get_ctx(cursor_t *c, mont_t *ctx, mpz_t n) {
+    mp_size_t k = get_u64(c, 4);
+    mp_limb_t ninv = get_u64(c, 8);
+    if (k == 0) {
+        // n had no context, ctx_pow_mod() falls back on a k of 0
+        ctx->k = 0;
+        return;
+    }
+    if (k != (mp_size_t) mpz_size(n)) {
+        c->ok = false;
+        return;
+    }
+    mp_limb_t *limbs = (mp_limb_t *) malloc(2 * k * sizeof(mp_limb_t));
+    for (mp_size_t i = 0; i < 2 * k; i++) {
+        limbs[i] = get_u64(c, 8);
+    }
+    if (c->ok) {
+        mont_load(ctx, k, mpz_limbs_read(n), ninv, limbs, limbs + k);
+    }
+    free(limbs);
+}
+
+// open_cache()
+// open_cache() reads cachepath and checks its header against the key file, returns the
+// file contents with c past the header, or NULL if it is missing, stale or not of kind
+static uint8_t *open_cache(const char *cachepath, int kind, uint64_t size, uint64_t hash,
+    cursor_t *c, uint8_t *flags) {
+    FILE *f = fopen(cachepath, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    size_t len = 0;
+    uint8_t *buf = slurp(f, &len);
+    fclose(f);
+    if (buf == NULL) {
+        return NULL;
+    }
+    // The trailer must match the rest of the file, which the fields are then read from
+    cursor_t t = { buf + len - CACHE_TRAILER, CACHE_TRAILER, len >= CACHE_HEADER + CACHE_TRAILER };
+    if (!t.ok || get_u64(&t, 8) != fnv1a(buf, len - CACHE_TRAILER)) {
+        free(buf);
+        return NULL;
+    }
+    *c = (cursor_t) { buf, len - CACHE_TRAILER, true };
+    const uint8_t *header = take(c, CACHE_HEADER);
+    if (header == NULL || memcmp(header, CACHE_MAGIC, 4) != 0 || header[4] != CACHE_VERSION
+        || header[5] != kind || header[6] != sizeof(mp_limb_t)) {
+        free(buf);
+        return NULL;
+    }
+    *flags = header[7];
+    cursor_t h = { header + 8, 16, true };
+    if (get_u64(&h, 8) != size || get_u64(&h, 8) != hash) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+// create_cache()
+// create_cache() starts a cache in memory and writes the header, the caller writes the fields
+// to out->f and passes it to commit_cache()
+static bool create_cache(cache_out_t *out, int kind, uint8_t flags, uint64_t size, uint64_t hash) {
+    out->f = open_memstream(&out->buf, &out->len);
+    if (out->f == NULL) {
+        return false;
+    }
+    fwrite(CACHE_MAGIC, sizeof(uint8_t), 4, out->f);
+    putc(CACHE_VERSION, out->f);
+    putc(kind, out->f);
+    putc(sizeof(mp_limb_t), out->f);
+    putc(flags, out->f);
+    put_u64(out->f, size, 8);
+    put_u64(out->f, hash, 8);
+    return true;
+}
+
+// commit_cache()
+// commit_cache() hashes the cache, writes it to a temporary file next to cachepath with the
+// given mode and renames it over cachepath, so a reader never sees a half written cache
+static bool commit_cache(cache_out_t *out, const char *cachepath, mode_t mode) {
+    bool ok = fclose(out->f) == 0;
+    char tmppath[4096];
+    snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", cachepath);
+    // mkstemp() creates the file 0600, which the private key cache keeps
+    int fd = ok ? mkstemp(tmppath) : -1;
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (f == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmppath);
+        }
+        free(out->buf);
+        return false;
+    }
+    fchmod(fd, mode);
+    fwrite(out->buf, sizeof(char), out->len, f);
+    put_u64(f, fnv1a((const uint8_t *) out->buf, out->len), 8);
+    free(out->buf);
+    ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmppath, cachepath) == 0;
+    if (!ok) {
+        unlink(tmppath);
+    }
+    return ok;
+}
+
+// pubkey_init()
+// pubkey_init() initializes an empty public key
+void pubkey_init(pubkey_t *key) {
+    memset(key, 0, sizeof(pubkey_t));
+    mpz_inits(key->n, key->e, key->s, NULL);
+}
+
+// pubkey_clear()
+// pubkey_clear() frees the public key
+void pubkey_clear(pubkey_t *key) {
+    mpz_clears(key->n, key->e, key->s, NULL);
+    mont_clear(&key->nctx);
+}
+
+// pubkey_load()
+// pubkey_load() reads the public key in pbfile, from the cache at cachepath when it is
+// current, sets cached to whether it was, and builds the context for n either way
+// cachepath may be NULL to always parse the key file
+// Returns false if pbfile can't be read
+bool pubkey_load(pubkey_t *key, FILE *pbfile, const char *cachepath, bool *cached) {
+    size_t len = 0;
+    uint8_t *text = slurp(pbfile, &len);
+    if (text == NULL) {
+        return false;
+    }
+    key->size = len;
+    key->hash = fnv1a(text, len);
+
+    *cached = false;
+    cursor_t c;
+    uint8_t flags = 0;
+    uint8_t *buf = cachepath == NULL
+                       ? NULL
+                       : open_cache(cachepath, KIND_PUB, key->size, key->hash, &c, &flags);
+    if (buf != NULL) {
+        get_mpz(&c, key->n);
+        get_mpz(&c, key->e);
+        get_mpz(&c, key->s);
+        uint64_t ulen = get_u64(&c, 4);
+        c.ok = c.ok && ulen < KEY_USER_MAX;
+        const uint8_t *user = take(&c, ulen);
+        if (user != NULL) {
+            memcpy(key->username, user, ulen);
+            key->username[ulen] = '\0';
+        }
+        get_ctx(&c, &key->nctx, key->n);
+        key->verified = (flags & FLAG_VERIFIED) != 0;
+        *cached = c.ok;
+        free(buf);
+    }
+
+    if (!*cached) {
+        // Parse the key file the usual way from the copy already in memory
+        FILE *f = fmemopen(text, len > 0 ? len : 1, "r");
+        rsa_read_pub(key->n, key->e, key->s, key->username, f);
+        fclose(f);
+        mont_set(&key->nctx, key->n);
+        key->verified = false;
+    }
+    free(text);
+    return true;
+}
+
+// pubkey_save()
+// pubkey_save() writes the cache for a key loaded by pubkey_load(), returns false if it
+// couldn't be written
+bool pubkey_save(pubkey_t *key, const char *cachepath) {
+    cache_out_t out;
+    if (!create_cache(&out, KIND_PUB, key->verified ? FLAG_VERIFIED : 0, key->size, key->hash)) {
+        return false;
+    }
+    FILE *f = out.f;
+    put_mpz(f, key->n);
+    put_mpz(f, key->e);
+    put_mpz(f, key->s);
+    size_t ulen = strlen(key->username);
+    put_u64(f, ulen, 4);
+    fwrite(key->username, sizeof(char), ulen, f);
+    put_ctx(f, &key->nctx);
+    return commit_cache(&out, cachepath, 0644);
+}
+
+// privkey_init()
+// privkey_init() initializes an empty private key
+void privkey_init(privkey_t *key) {
+    memset(key, 0, sizeof(privkey_t));
+    mpz_inits(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+    rsa_extra_init(&key->extra);
+}
+
+// privkey_clear()
+// privkey_clear() frees the private key
+void privkey_clear(privkey_t *key) {
+    mpz_clears(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv, NULL);
+    rsa_extra_clear(&key->extra);
+    mont_clear(&key->nctx);
+    mont_clear(&key->pctx);
+    mont_clear(&key->qctx);
+}
+
+// privkey_load()
+// privkey_load() reads the private key in pvfile like pubkey_load(), building the contexts
+// for p and q, or for n when the key has no CRT fields
+bool privkey_load(privkey_t *key, FILE *pvfile, const char *cachepath, bool *cached) {
+    size_t len = 0;
+    uint8_t *text = slurp(pvfile, &len);
+    if (text == NULL) {
+        return false;
+    }
+    key->size = len;
+    key->hash = fnv1a(text, len);
+
+    *cached = false;
+    cursor_t c;
+    uint8_t flags = 0;
+    uint8_t *buf = cachepath == NULL
+                       ? NULL
+                       : open_cache(cachepath, KIND_PRIV, key->size, key->hash, &c, &flags);
+    if (buf != NULL) {
+        key->crt = (flags & FLAG_CRT) != 0;
+        mpz_ptr fields[] = { key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv };
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            get_mpz(&c, fields[i]);
+        }
+        key->extra.count = get_u64(&c, 4);
+        c.ok = c.ok && key->extra.count <= RSA_MAX_PRIMES - 2;
+        for (uint64_t i = 0; c.ok && i < key->extra.count; i++) {
+            get_mpz(&c, key->extra.r[i]);
+            get_mpz(&c, key->extra.d[i]);
+            get_mpz(&c, key->extra.t[i]);
+        }
+        if (key->crt) {
+            get_ctx(&c, &key->pctx, key->p);
+            get_ctx(&c, &key->qctx, key->q);
+        } else {
+            get_ctx(&c, &key->nctx, key->n);
+        }
+        *cached = c.ok;
+        free(buf);
+    }
+
+    if (!*cached) {
+        FILE *f = fmemopen(text, len > 0 ? len : 1, "r");
+        key->crt = rsa_read_priv_multi(key->n, key->d, key->p, key->q, key->dp, key->dq,
+            key->qinv, &key->extra, f);
+        fclose(f);
+        if (key->crt) {
+            mont_set(&key->pctx, key->p);
+            mont_set(&key->qctx, key->q);
+        } else {
+            mont_set(&key->nctx, key->n);
+        }
+    }
+    free(text);
+    return true;
+}
+
+// privkey_save()
+// privkey_save() writes the cache for a key loaded by privkey_load(), readable only by its
+// owner like the key file, returns false if it couldn't be written
+bool privkey_save(privkey_t *key, const char *cachepath) {
+    cache_out_t out;
+    if (!create_cache(&out, KIND_PRIV, key->crt ? FLAG_CRT : 0, key->size, key->hash)) {
+        return false;
+    }
+    FILE *f = out.f;
+    mpz_ptr fields[] = { key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv };
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        put_mpz(f, fields[i]);
+    }
+    put_u64(f, key->extra.count, 4);
+    for (uint64_t i = 0; i < key->extra.count; i++) {
+        put_mpz(f, key->extra.r[i]);
+        put_mpz(f, key->extra.d[i]);
+        put_mpz(f, key->extra.t[i]);
+    }
+    if (key->crt) {
+        put_ctx(f, &key->pctx);
+        put_ctx(f, &key->qctx);
+    } else {
+        put_ctx(f, &key->nctx);
+    }
+    return commit_cache(&out, cachepath, 0600);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+#include "mont.h"
+#include "rsa.h"
+
+// Binary key cache kept next to a key file as <key>.cache
+// It holds the parsed key, the Montgomery constants for its moduli and, for a public key,
+// whether the signature has been verified. It is tied to the size and a hash of the key file
+// it was made from and ignored once that file changes.
+#define KEYCACHE_SUFFIX ".cache"
+
+// A public key with its context for n
+typedef struct {
+    mpz_t n, e, s;
+    char username[KEY_USER_MAX];
+    bool verified; // The signature of username has been checked
+    mont_t nctx;
+    uint64_t size, hash; // Of the key file
+} pubkey_t;
+
+// A private key with its contexts, for p and q when crt is set and for n otherwise
+typedef struct {
+    mpz_t n, d, p, q, dp, dq, qinv;
+    rsa_extra_t extra; // The primes past p and q of a multi-prime key
+    bool crt; // Old keys only have n and d
+    mont_t nctx, pctx, qctx;
+    uint64_t size, hash; // Of the key file
+} privkey_t;
+
+void pubkey_init(pubkey_t *key);
+
+void pubkey_clear(pubkey_t *key);
+
+bool pubkey_load(pubkey_t *key, FILE *pbfile, const char *cachepath, bool *cached);
+
+bool pubkey_save(pubkey_t *key, const char *cachepath);
+
+void privkey_init(privkey_t *key);
+
+void privkey_clear(privkey_t *key);
+
+bool privkey_load(privkey_t *key, FILE *pvfile, const char *cachepath, bool *cached);
+
+bool privkey_save(privkey_t *key, const char *cachepath);
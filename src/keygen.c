@@ -4,6 +4,7 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "stats.h"
 
 #include <limits.h>
 
@@ -11,11 +12,15 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <sys/stat.h>
 #include <time.h>
 
 // Command line options
-#define OPTIONS "b:i:n:d:s:vh"
+#define OPTIONS "b:i:n:d:s:t:e:k:P:vh"
+
+static struct option longopts[] = { { "stats-json", required_argument, NULL, 'J' },
+    { "pool", required_argument, NULL, 'Q' }, { NULL, 0, NULL, 0 } };
 
 // help()
 // Parameters: None
@@ -26,16 +31,27 @@ void help(void) {
    Generates an RSA public/private key pair.\n\
 \n\
 USAGE\n\
-   ./keygen [-hv] [-b bits] [-i confidence] [-n pbfile] [-d pvfile] -s seed\n\
+   ./keygen [-hv] [-b bits] [-i confidence] [-n pbfile] [-d pvfile] [-t threads] [-e exponent]\n\
+            [-k primes] [-P engine] [--pool dir] [--stats-json file] -s seed\n\
 \n\
 OPTIONS\n\
    -h              Display program help and usage.\n\
-   -v              Display verbose program output.\n\
+   -v              Display verbose program output, phase timings go to stderr.\n\
    -b bits         Minimum bits needed for public key n.\n\
-   -i confidence   Miller-Rabin iterations for testing primes (default: 50).\n\
+   -i confidence   Miller-Rabin iterations for testing primes (default: 50), auto picks\n\
+                   the rounds for a 2^-128 error bound from the prime size.\n\
+   -P engine       Primality test, mr for Miller-Rabin or bpsw for Baillie-PSW\n\
+                   (default: mr).\n\
    -n pbfile       Public key file (default: rsa.pub).\n\
    -d pvfile       Private key file (default: rsa.priv).\n\
-   -s seed         Random seed for testing.\n");
+   -s seed         Random seed for testing.\n\
+   -t threads      Search for p and q in parallel on this many threads.\n\
+   -e exponent     Fixed public exponent such as 65537 (default: random nbits-bit e).\n\
+   -k primes       Primes in n, 2 to 4, more make keygen and CRT decryption faster\n\
+                   (default: 2).\n\
+   --pool dir      Draw p and q from the prime pool in dir filled by primegen, making\n\
+                   them live once it runs dry.\n\
+   --stats-json f  Write phase timings and counters as JSON to f.\n");
     return;
 }
 
@@ -68,14 +84,19 @@ int main(int argc, char **argv) {
 
     // The booleans for command line options
     bool stats = false;
+    FILE *jsonfile = NULL;
+    char *pooldir = NULL;
 
     // uints for numtheory and rsa
     uint64_t bits = 256;
     uint64_t seed = time(NULL);
     uint64_t iters = 50; // Default is 50
+    uint64_t threads = 0; // 0 keeps the sequential search
+    uint64_t exponent = 0; // 0 picks a random e
+    uint64_t primes = 2;
 
     // gets all command line options
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, OPTIONS, longopts, NULL)) != -1) {
         switch (opt) {
         case 'h': help(); return 0;
         case 'v': stats = true; break;
@@ -86,14 +107,72 @@ int main(int argc, char **argv) {
                 return 1;
             }
             break;
-        case 'i': iters = strtoul(optarg, NULL, 0); break;
+        case 'i':
+            if (strcmp(optarg, "auto") == 0) {
+                iters = PRIME_ITERS_AUTO;
+                break;
+            }
+            iters = strtoul(optarg, NULL, 0);
+            if (iters < 1) {
+                fprintf(stderr, "Error: Number of iterations is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "mr") == 0) {
+                prime_engine = PRIME_MR;
+            } else if (strcmp(optarg, "bpsw") == 0) {
+                prime_engine = PRIME_BPSW;
+            } else {
+                fprintf(stderr, "Error: Primality engine must be mr or bpsw.\n");
+                return 1;
+            }
+            break;
         case 'n': pbpath = optarg; break;
         case 'd': pvpath = optarg; break;
+        case 'J':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open stats file.\n");
+                return 1;
+            }
+            break;
+        case 'Q': pooldir = optarg; break;
         case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'e':
+            exponent = strtoul(optarg, NULL, 0);
+            if (exponent < 3 || exponent % 2 == 0) {
+                fprintf(stderr, "Error: Public exponent must be odd and at least 3.\n");
+                return 1;
+            }
+            break;
+        case 'k':
+            primes = strtoul(optarg, NULL, 10);
+            if (primes < 2 || primes > RSA_MAX_PRIMES) {
+                fprintf(stderr, "Error: Number of primes must be 2 to %d.\n", RSA_MAX_PRIMES);
+                return 1;
+            }
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            if (threads < 1) {
+                fprintf(stderr, "Error: Number of threads is invalid.\n");
+                return 1;
+            }
+            break;
         default: help(); return 1;
         }
     }
 
+    if (primes > 2 && pooldir != NULL) {
+        fprintf(stderr, "Error: The prime pool only makes two prime keys.\n");
+        return 1;
+    }
+    if (primes > 2 && bits < 32 * primes) {
+        fprintf(stderr, "Error: Number of bits is too small for %" PRIu64 " primes.\n", primes);
+        return 1;
+    }
+
     // The public/private files
     FILE *pbfile = fopen(pbpath, "w");
     FILE *pvfile = fopen(pvpath, "w");
@@ -120,15 +199,37 @@ int main(int argc, char **argv) {
     // Initialize p and q (prime numbers), n (product of p * q),
     // e (public exponent), d (private key), user (the username),
     // and s (the signature), prbits (bits for printing)
-    mpz_t p, q, n, e, d, user, s;
+    // dp, dq and qinv are the CRT fields of the private key
+    // extra holds the primes past p and q of a multi-prime key
+    mpz_t p, q, n, e, d, user, s, dp, dq, qinv;
     size_t prbits = 0;
-    mpz_inits(p, q, n, e, d, user, s, NULL);
+    mpz_inits(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+    rsa_extra_t extra;
+    rsa_extra_init(&extra);
 
     // Make public key
-    rsa_make_pub(p, q, n, e, bits, iters);
+    uint64_t start = stats_clock();
+    if (primes > 2) {
+        // e stays 0 for a random exponent
+        mpz_set_ui(e, exponent);
+        rsa_make_pub_multi(p, q, &extra, n, e, bits, primes, iters, threads, seed);
+    } else if (pooldir != NULL) {
+        // e stays 0 for a random exponent
+        mpz_set_ui(e, exponent);
+        rsa_make_pub_pool(p, q, n, e, bits, iters, threads, seed, pooldir);
+    } else if (exponent > 0) {
+        mpz_set_ui(e, exponent);
+        rsa_make_pub_e(p, q, n, e, bits, iters, threads, seed);
+    } else if (threads > 0) {
+        rsa_make_pub_mt(p, q, n, e, bits, iters, threads, seed);
+    } else {
+        rsa_make_pub(p, q, n, e, bits, iters);
+    }
 
     // Make private key
-    rsa_make_priv(d, e, p, q);
+    rsa_make_priv_multi(d, e, p, q, &extra);
+    rsa_make_crt(dp, dq, qinv, d, p, q);
+    rsa_make_crt_multi(&extra, d, p, q);
 
     // Char array for username
     char *username[sizeof(getenv("USER"))];
@@ -137,13 +238,16 @@ int main(int argc, char **argv) {
     mpz_set_str(user, *username, 62);
 
     // Use username to sign
-    rsa_sign(s, user, d, n);
+    rsa_sign_multi(s, user, p, q, dp, dq, qinv, &extra);
+    stats_phase(PHASE_KEYGEN, start);
 
     // Write public key to file
+    start = stats_clock();
     rsa_write_pub(n, e, s, *username, pbfile);
 
     // Write private key to file
-    rsa_write_priv(n, d, pvfile);
+    rsa_write_priv_multi(n, d, p, q, dp, dq, qinv, &extra, pvfile);
+    stats_phase(PHASE_WRITE, start);
 
     // Verbose printing
     if (stats) {
@@ -154,16 +258,29 @@ int main(int argc, char **argv) {
         gmp_fprintf(stdout, "p (%zu bits) %Zd\n", prbits, p);
         prbits = mpz_sizeinbase(q, 2);
         gmp_fprintf(stdout, "q (%zu bits) %Zd\n", prbits, q);
+        for (uint64_t i = 0; i < extra.count; i++) {
+            prbits = mpz_sizeinbase(extra.r[i], 2);
+            gmp_fprintf(stdout, "r%" PRIu64 " (%zu bits) %Zd\n", i + 3, prbits, extra.r[i]);
+        }
         prbits = mpz_sizeinbase(n, 2);
         gmp_fprintf(stdout, "n (%zu bits) %Zd\n", prbits, n);
         prbits = mpz_sizeinbase(e, 2);
         gmp_fprintf(stdout, "e (%zu bits) %Zd\n", prbits, e);
         prbits = mpz_sizeinbase(d, 2);
         gmp_fprintf(stdout, "d (%zu bits) %Zd\n", prbits, d);
+        fprintf(stdout, "candidates sieved out = %" PRIu64 "\n", prime_stats.sieved);
+        fprintf(stdout, "candidates tested = %" PRIu64 "\n", prime_stats.tested);
+        fprintf(stdout, "primes from pool = %" PRIu64 "\n", rsa_stats.pooled);
+        stats_print(stderr);
+    }
+    if (jsonfile != NULL) {
+        stats_write_json(jsonfile);
+        fclose(jsonfile);
     }
 
     // Clear used mpz_t's, closes files,  and exits program
-    mpz_clears(p, q, n, e, d, user, s, NULL);
+    mpz_clears(p, q, n, e, d, user, s, dp, dq, qinv, NULL);
+    rsa_extra_clear(&extra);
     randstate_clear();
     fclose(pbfile);
     fclose(pvfile);
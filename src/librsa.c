@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "librsa.h"
+#include "keycache.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "mont.h"
+#include "sha256.h"
+#include "fileio.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// rsa_work_init()
+// rsa_work_init() initializes the scratch for one thread
+void rsa_work_init(rsa_work_t *work) {
+    memset(work, 0, sizeof(rsa_work_t));
+    ws_init(&work->ws, 0);
+    mpz_init(work->m);
+}
+
+// rsa_work_clear()
+// rsa_work_clear() frees the scratch
+void rsa_work_clear(rsa_work_t *work) {
+    ws_clear(&work->ws);
+    for (int i = 0; i < RSA_MAX_PRIMES; i++) {
+        mont_clear(&work->ctx[i]);
+    }
+    mpz_clear(work->m);
+}
+
+// pubkey_parse()
+// pubkey_parse() reads a public key from the len bytes of key file text, returns false if
+// there is no modulus in it
+bool pubkey_parse(pubkey_t *key, const char *text, size_t len) {
+    FILE *f = len > 0 ? fmemopen((void *) text, len, "r") : NULL;
+    if (f == NULL) {
+        return false;
+    }
+    bool cached = false;
+    bool ok = pubkey_load(key, f, NULL, &cached);
+    fclose(f);
+    return ok && mpz_sgn(key->n) > 0;
+}
+
+// privkey_parse()
+// privkey_parse() reads a private key from the len bytes of key file text, returns false if
+// there is no modulus in it
+bool privkey_parse(privkey_t *key, const char *text, size_t len) {
+    FILE *f = len > 0 ? fmemopen((void *) text, len, "r") : NULL;
+    if (f == NULL) {
+        return false;
+    }
+    bool cached = false;
+    bool ok = privkey_load(key, f, NULL, &cached);
+    fclose(f);
+    return ok && mpz_sgn(key->n) > 0;
+}
+
+// pubkey_text()
+// pubkey_text() returns the key file text of a public key as a string the caller frees
+char *pubkey_text(pubkey_t *key, size_t *len) {
+    char *text = NULL;
+    FILE *f = open_memstream(&text, len);
+    rsa_write_pub(key->n, key->e, key->s, key->username, f);
+    fclose(f);
+    return text;
+}
+
+// privkey_text()
+// privkey_text() returns the key file text of a private key as a string the caller frees
+char *privkey_text(privkey_t *key, size_t *len) {
+    char *text = NULL;
+    FILE *f = open_memstream(&text, len);
+    if (key->crt) {
+        rsa_write_priv_multi(key->n, key->d, key->p, key->q, key->dp, key->dq, key->qinv,
+            &key->extra, f);
+    } else {
+        rsa_write_priv(key->n, key->d, f);
+    }
+    fclose(f);
+    return text;
+}
+
+// rsa_keygen()
+// rsa_keygen() makes a two prime key of nbits bits drawing from rs, signs username with it and
+// fills in initialized pub and priv ready to use, the public key already verified
+void rsa_keygen(pubkey_t *pub, privkey_t *priv, const char *username, uint64_t nbits,
+    uint64_t iters, gmp_randstate_t rs) {
+    rsa_make_pub_r(priv->p, priv->q, priv->n, pub->e, nbits, iters, rs);
+    rsa_make_priv(priv->d, pub->e, priv->p, priv->q);
+    rsa_make_crt(priv->dp, priv->dq, priv->qinv, priv->d, priv->p, priv->q);
+    priv->extra.count = 0;
+    priv->crt = true;
+    mont_set(&priv->pctx, priv->p);
+    mont_set(&priv->qctx, priv->q);
+
+    mpz_set(pub->n, priv->n);
+    snprintf(pub->username, KEY_USER_MAX, "%s", username);
+    mpz_t user;
+    mpz_init(user);
+    mpz_set_str(user, pub->username, 62);
+    rsa_sign_crt(pub->s, user, priv->p, priv->q, priv->dp, priv->dq, priv->qinv);
+    mpz_clear(user);
+    mont_set(&pub->nctx, pub->n);
+    pub->verified = true;
+}
+
+// pubkey_check()
+// pubkey_check() verifies the key's signature of its username unless that was already done,
+// returns whether it holds
+bool pubkey_check(pubkey_t *key, rsa_work_t *work) {
+    if (!key->verified) {
+        mpz_set_str(work->m, key->username, 62);
+        key->verified = rsa_verify_ws(work->m, key->s, key->e, key->n, &work->ws);
+    }
+    return key->verified;
+}
+
+// pubkey_opts()
+// pubkey_opts() copies opts, the defaults when NULL, pointing the workers at the key's context
+static rsa_opts_t pubkey_opts(pubkey_t *key, rsa_opts_t *opts) {
+    rsa_opts_t o = { 0 };
+    if (opts != NULL) {
+        o = *opts;
+    }
+    o.nctx = &key->nctx;
+    return o;
+}
+
+// pubkey_encrypt_stream()
+// pubkey_encrypt_stream() encrypts from reader to writer as rsa_encrypt_stream() does
+// Returns false if the hybrid session key couldn't be made, e is too small for it or a write
+// failed, the writer's own status tells the last apart
+bool pubkey_encrypt_stream(pubkey_t *key, reader_t *reader, writer_t *writer, rsa_opts_t *opts) {
+    rsa_opts_t o = pubkey_opts(key, opts);
+    return rsa_encrypt_stream(reader, writer, key->n, key->e, &o);
+}
+
+// pubkey_encrypt_file()
+// pubkey_encrypt_file() encrypts infile to outfile as rsa_encrypt_file_opts() does
+// Returns false if the hybrid session key couldn't be made, e is too small for it or outfile
+// couldn't be written
+bool pubkey_encrypt_file(pubkey_t *key, FILE *infile, FILE *outfile, rsa_opts_t *opts) {
+    rsa_opts_t o = pubkey_opts(key, opts);
+    return rsa_encrypt_file_opts(infile, outfile, key->n, key->e, &o);
+}
+
+// pubkey_encrypt_buf()
+// pubkey_encrypt_buf() encrypts the len bytes at in into a buffer of outlen bytes at out
+// that the caller frees, in any of the formats rsa_encrypt_file_opts() writes
+// Returns false if the hybrid session key couldn't be made or e is too small for it
+bool pubkey_encrypt_buf(pubkey_t *key, const uint8_t *in, size_t len, uint8_t **out,
+    size_t *outlen, rsa_opts_t *opts) {
+    rsa_opts_t o = pubkey_opts(key, opts);
+    reader_t *reader = reader_open_mem(in, len);
+    writer_t *writer = writer_open_mem();
+    bool ok = rsa_encrypt_stream(reader, writer, key->n, key->e, &o);
+    *out = writer_take(writer, outlen);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    return ok && wrote;
+}
+
+// privkey_opts()
+// privkey_opts() copies opts, the defaults when NULL, pointing the workers at the key's
+// contexts and extra primes
+static rsa_opts_t privkey_opts(privkey_t *key, rsa_opts_t *opts) {
+    rsa_opts_t o = { 0 };
+    if (opts != NULL) {
+        o = *opts;
+    }
+    if (key->crt) {
+        o.pctx = &key->pctx;
+        o.qctx = &key->qctx;
+        o.extra = &key->extra;
+    } else {
+        o.nctx = &key->nctx;
+    }
+    return o;
+}
+
+// privkey_decrypt_stream()
+// privkey_decrypt_stream() decrypts from reader to writer, with CRT when the key has the fields
+// Returns false if the input is malformed or a write failed, the writer's own status tells the
+// last apart
+bool privkey_decrypt_stream(privkey_t *key, reader_t *reader, writer_t *writer, rsa_opts_t *opts) {
+    rsa_opts_t o = privkey_opts(key, opts);
+    if (key->crt) {
+        return rsa_decrypt_stream_crt(
+            reader, writer, key->n, key->p, key->q, key->dp, key->dq, key->qinv, &o);
+    }
+    return rsa_decrypt_stream(reader, writer, key->n, key->d, &o);
+}
+
+// privkey_decrypt_file()
+// privkey_decrypt_file() decrypts infile to outfile, hex lines or the binary container
+// Returns false if the input is malformed or outfile couldn't be written
+bool privkey_decrypt_file(privkey_t *key, FILE *infile, FILE *outfile, rsa_opts_t *opts) {
+    reader_t *reader = reader_open(infile);
+    writer_t *writer = writer_open(outfile);
+    bool ok = privkey_decrypt_stream(key, reader, writer, opts);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    return ok && wrote;
+}
+
+// privkey_decrypt_buf()
+// privkey_decrypt_buf() decrypts the len bytes at in into a buffer of outlen bytes at out that
+// the caller frees. Returns false if the input is malformed, out then holds what was
+// decrypted before the fault.
+bool privkey_decrypt_buf(privkey_t *key, const uint8_t *in, size_t len, uint8_t **out,
+    size_t *outlen, rsa_opts_t *opts) {
+    reader_t *reader = reader_open_mem(in, len);
+    writer_t *writer = writer_open_mem();
+    bool ok = privkey_decrypt_stream(key, reader, writer, opts);
+    *out = writer_take(writer, outlen);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    return ok && wrote;
+}
+
+// privkey_sign_digest()
+// privkey_sign_digest() signs a SHA-256 digest encoded as in rsa_pad_digest()
+// Returns false if n is too small for the encoding
+bool privkey_sign_digest(privkey_t *key, mpz_t s, uint8_t digest[SHA256_DIGEST], rsa_work_t *work) {
+    if (!rsa_pad_digest(work->m, digest, key->n)) {
+        return false;
+    }
+    if (!key->crt) {
+        mont_copy(&work->ctx[0], &key->nctx);
+        rsa_decrypt_ctx(s, work->m, key->d, key->n, &work->ctx[0]);
+        return true;
+    }
+    mont_copy(&work->ctx[0], &key->pctx);
+    mont_copy(&work->ctx[1], &key->qctx);
+    for (uint64_t i = 0; i < key->extra.count; i++) {
+        mont_set(&work->ctx[2 + i], key->extra.r[i]);
+    }
+    rsa_decrypt_multi_ctx(s, work->m, key->p, key->q, key->dp, key->dq, key->qinv, &key->extra,
+        &work->ctx[0], &work->ctx[1], &work->ctx[2], &work->ws);
+    return true;
+}
+
+// privkey_sign_buf()
+// privkey_sign_buf() signs the SHA-256 digest of the len bytes at in
+// Returns false if n is too small for the encoding
+bool privkey_sign_buf(
+    privkey_t *key, mpz_t s, const uint8_t *in, size_t len, rsa_work_t *work) {
+    uint8_t digest[SHA256_DIGEST];
+    sha256(digest, in, len);
+    return privkey_sign_digest(key, s, digest, work);
+}
+
+// pubkey_verify_digest()
+// pubkey_verify_digest() is rsa_verify_digest() in the scratch of work
+bool pubkey_verify_digest(pubkey_t *key, uint8_t digest[SHA256_DIGEST], mpz_t s, rsa_work_t *work) {
+    return mpz_sgn(s) > 0 && mpz_cmp(s, key->n) < 0 && rsa_pad_digest(work->m, digest, key->n)
+           && rsa_verify_ws(work->m, s, key->e, key->n, &work->ws);
+}
+
+// pubkey_verify_buf()
+// pubkey_verify_buf() checks a signature made by privkey_sign_buf() over the len bytes at in
+bool pubkey_verify_buf(pubkey_t *key, const uint8_t *in, size_t len, mpz_t s, rsa_work_t *work) {
+    uint8_t digest[SHA256_DIGEST];
+    sha256(digest, in, len);
+    return pubkey_verify_digest(key, digest, s, work);
+}
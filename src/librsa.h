@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <gmp.h>
+#include "keycache.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "sha256.h"
+
+// The embeddable API of librsa.a and librsa.so, built on the key objects of keycache.h
+// Everything a call needs is passed in: the key, a random state for key generation and an
+// rsa_work_t for the single block operations. A loaded key is only read by these calls, so
+// threads can share one, each with its own rsa_work_t and random state. pubkey_check() is the
+// one call that writes to a key, run it before sharing. prime_engine and the counters in
+// rsa_stats and prime_stats stay process wide.
+
+// Scratch for the single block calls on one thread
+// The key's Montgomery contexts are copied into ctx for each call, which reuses their storage
+typedef struct {
+    workspace_t ws;
+    mont_t ctx[RSA_MAX_PRIMES];
+    mpz_t m; // Encoded message
+} rsa_work_t;
+
+void rsa_work_init(rsa_work_t *work);
+
+void rsa_work_clear(rsa_work_t *work);
+
+bool pubkey_parse(pubkey_t *key, const char *text, size_t len);
+
+bool privkey_parse(privkey_t *key, const char *text, size_t len);
+
+char *pubkey_text(pubkey_t *key, size_t *len);
+
+char *privkey_text(privkey_t *key, size_t *len);
+
+void rsa_keygen(pubkey_t *pub, privkey_t *priv, const char *username, uint64_t nbits,
+    uint64_t iters, gmp_randstate_t rs);
+
+bool pubkey_check(pubkey_t *key, rsa_work_t *work);
+
+bool pubkey_encrypt_stream(pubkey_t *key, reader_t *reader, writer_t *writer, rsa_opts_t *opts);
+
+bool pubkey_encrypt_file(pubkey_t *key, FILE *infile, FILE *outfile, rsa_opts_t *opts);
+
+bool pubkey_encrypt_buf(pubkey_t *key, const uint8_t *in, size_t len, uint8_t **out,
+    size_t *outlen, rsa_opts_t *opts);
+
+bool privkey_decrypt_stream(privkey_t *key, reader_t *reader, writer_t *writer, rsa_opts_t *opts);
+
+bool privkey_decrypt_file(privkey_t *key, FILE *infile, FILE *outfile, rsa_opts_t *opts);
+
+bool privkey_decrypt_buf(privkey_t *key, const uint8_t *in, size_t len, uint8_t **out,
+    size_t *outlen, rsa_opts_t *opts);
+
+bool privkey_sign_digest(privkey_t *key, mpz_t s, uint8_t digest[SHA256_DIGEST], rsa_work_t *work);
+
+bool privkey_sign_buf(
+    privkey_t *key, mpz_t s, const uint8_t *in, size_t len, rsa_work_t *work);
+
+bool pubkey_verify_digest(pubkey_t *key, uint8_t digest[SHA256_DIGEST], mpz_t s, rsa_work_t *work);
+
+bool pubkey_verify_buf(pubkey_t *key, const uint8_t *in, size_t len, mpz_t s, rsa_work_t *work);
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include "lz.h"
+#include "fileio.h"
+#include "stats.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Hash table of the match finder, and the candidates it tries at each position
+#define LZ_HASH_BITS 15
+#define LZ_DEPTH     16
+
+// Farthest back a match can start, the most a 2 byte distance holds
+#define LZ_WINDOW 65535
+
+// Largest payload of a frame, all literals with their length bytes
+#define LZ_BOUND (LZ_FRAME + LZ_FRAME / 255 + 16)
+
+// put_be32()
+// put_be32() stores v big-endian into p
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// get_be32()
+// get_be32() loads a big-endian 32-bit integer from p
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// hash4()
+// hash4() hashes the LZ_MIN bytes at p for the match finder
+static uint32_t hash4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// insert()
+// insert() adds the positions from z->ins up to end to the chains, a position needs LZ_MIN
+// bytes after it to be hashed
+static void insert(lz_enc_t *z, const uint8_t *in, size_t len, size_t end) {
+    for (; z->ins < end; z->ins++) {
+        if (z->ins + LZ_MIN <= len) {
+            uint32_t h = hash4(in + z->ins);
+            z->prev[z->ins] = z->head[h];
+            z->head[h] = (uint32_t) z->ins + 1;
+        }
+    }
+}
+
+// match_len()
+// match_len() counts the bytes a and b have in common, up to limit
+static size_t match_len(const uint8_t *a, const uint8_t *b, size_t limit) {
+    size_t n = 0;
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        memcpy(&x, a + n, sizeof(x));
+        memcpy(&y, b + n, sizeof(y));
+        if (x != y) {
+            return n + __builtin_ctzll(x ^ y) / 8;
+        }
+        n += 8;
+    }
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+// find()
+// find() looks back through the chain of the bytes at i for the longest match, returns its
+// length and sets dist to how far back it starts, or returns 0 if none has LZ_MIN bytes
+static size_t find(lz_enc_t *z, const uint8_t *in, size_t len, size_t i, size_t *dist) {
+    insert(z, in, len, i);
+    if (i + LZ_MIN > len) {
+        return 0;
+    }
+    size_t best = 0;
+    uint32_t cand = z->head[hash4(in + i)];
+    for (int d = 0; d < LZ_DEPTH && cand != 0 && i - (cand - 1) <= LZ_WINDOW; d++) {
+        size_t c = cand - 1;
+        size_t l = match_len(in + c, in + i, len - i);
+        if (l > best) {
+            best = l;
+            *dist = i - c;
+            if (i + l == len) {
+                break;
+            }
+        }
+        cand = z->prev[c];
+    }
+    return best >= LZ_MIN ? best : 0;
+}
+
+// put_len()
+// put_len() writes the part of a length past its nibble as bytes of 255 and a last one below
+static uint8_t *put_len(uint8_t *o, size_t v) {
+    for (; v >= 255; v -= 255) {
+        *o++ = 255;
+    }
+    *o++ = (uint8_t) v;
+    return o;
+}
+
+// sequence()
+// sequence() writes nlit literals and a match of mlen bytes dist back, mlen is 0 for the
+// literals that end the frame
+static uint8_t *sequence(uint8_t *o, const uint8_t *lit, size_t nlit, size_t dist, size_t mlen) {
+    size_t m = mlen > 0 ? mlen - LZ_MIN : 0;
+    *o++ = (uint8_t) ((nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15));
+    if (nlit >= 15) {
+        o = put_len(o, nlit - 15);
+    }
+    memcpy(o, lit, nlit);
+    o += nlit;
+    if (mlen > 0) {
+        *o++ = dist & 0xFF;
+        *o++ = dist >> 8;
+        if (m >= 15) {
+            o = put_len(o, m - 15);
+        }
+    }
+    return o;
+}
+
+// compress()
+// compress() compresses the len bytes at in into out, which holds LZ_BOUND bytes, and returns
+// the payload length
+// Greedy with one step of lazy matching: a longer match starting a byte later is taken instead.
+static size_t compress(lz_enc_t *z, const uint8_t *in, size_t len, uint8_t *out) {
+    memset(z->head, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    z->ins = 0;
+    uint8_t *o = out;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ_MIN <= len) {
+        size_t dist = 0;
+        size_t mlen = find(z, in, len, i, &dist);
+        if (mlen == 0) {
+            i++;
+            continue;
+        }
+        size_t later = 0;
+        size_t next = find(z, in, len, i + 1, &later);
+        if (next > mlen) {
+            i++;
+            mlen = next;
+            dist = later;
+        }
+        o = sequence(o, in + anchor, i - anchor, dist, mlen);
+        i += mlen;
+        anchor = i;
+    }
+    o = sequence(o, in + anchor, len - anchor, 0, 0);
+    return o - out;
+}
+
+// next_frame()
+// next_frame() reads the next LZ_FRAME bytes of plaintext and compresses them into z->frame,
+// keeping them as they are if that doesn't make them smaller
+// Returns false at the end of the plaintext
+static bool next_frame(lz_enc_t *z) {
+    if (z->eof) {
+        return false;
+    }
+    size_t got = reader_read(z->src, z->raw, LZ_FRAME);
+    z->eof = got < LZ_FRAME;
+    if (got == 0) {
+        return false;
+    }
+    uint32_t packed = compress(z, z->raw, got, z->frame + LZ_HEADER);
+    uint32_t stored = 0;
+    if (packed >= got) {
+        memcpy(z->frame + LZ_HEADER, z->raw, got);
+        packed = got;
+        stored = LZ_STORED;
+    }
+    put_be32(z->frame, got);
+    put_be32(z->frame + 4, packed | stored);
+    z->len = LZ_HEADER + packed;
+    z->pos = 0;
+    atomic_fetch_add(&rsa_stats.lz_plain, got);
+    atomic_fetch_add(&rsa_stats.lz_packed, z->len);
+    return true;
+}
+
+// lz_enc_init()
+// lz_enc_init() starts compressing the plaintext read from src
+void lz_enc_init(lz_enc_t *z, reader_t *src) {
+    memset(z, 0, sizeof(lz_enc_t));
+    z->src = src;
+    z->raw = (uint8_t *) malloc(LZ_FRAME);
+    z->frame = (uint8_t *) malloc(LZ_HEADER + LZ_BOUND);
+    z->head = (uint32_t *) malloc(sizeof(uint32_t) << LZ_HASH_BITS);
+    z->prev = (uint32_t *) malloc(LZ_FRAME * sizeof(uint32_t));
+}
+
+// lz_read()
+// lz_read() copies the next len bytes of the compressed stream into buf, returns fewer only
+// at the end of the plaintext, as reader_read() does
+size_t lz_read(lz_enc_t *z, uint8_t *buf, size_t len) {
+    size_t got = 0;
+    while (got < len && (z->pos < z->len || next_frame(z))) {
+        size_t n = z->len - z->pos < len - got ? z->len - z->pos : len - got;
+        memcpy(buf + got, z->frame + z->pos, n);
+        z->pos += n;
+        got += n;
+    }
+    return got;
+}
+
+// lz_enc_clear()
+// lz_enc_clear() frees the compressor
+void lz_enc_clear(lz_enc_t *z) {
+    free(z->raw);
+    free(z->frame);
+    free(z->head);
+    free(z->prev);
+    memset(z, 0, sizeof(lz_enc_t));
+}
+
+// get_len()
+// get_len() adds the length bytes that follow a nibble of 15 to v
+// Returns false if the payload ends first
+static bool get_len(const uint8_t **p, const uint8_t *end, size_t *v) {
+    uint8_t b = 255;
+    while (b == 255) {
+        if (*p == end) {
+            return false;
+        }
+        b = *(*p)++;
+        *v += b;
+    }
+    return true;
+}
+
+// restore()
+// restore() decompresses the frame gathered in z and hands it to z->out
+// Every length and distance is checked against the payload and the frame, as the stream
+// comes off blocks anyone holding the public key can make
+// Returns false if the frame is malformed
+static bool restore(lz_dec_t *z) {
+    uint32_t plain = get_be32(z->frame);
+    uint32_t packed = get_be32(z->frame + 4) & ~LZ_STORED;
+    const uint8_t *p = z->frame + LZ_HEADER;
+    const uint8_t *end = p + packed;
+    if (get_be32(z->frame + 4) & LZ_STORED) {
+        if (packed != plain) {
+            return false;
+        }
+        atomic_fetch_add(&rsa_stats.lz_plain, plain);
+        atomic_fetch_add(&rsa_stats.lz_packed, LZ_HEADER + packed);
+        z->out(z->arg, p, plain);
+        return true;
+    }
+
+    uint8_t *o = z->raw;
+    uint8_t *oend = z->raw + plain;
+    while (true) {
+        if (p == end) {
+            return false;
+        }
+        uint8_t token = *p++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !get_len(&p, end, &nlit)) {
+            return false;
+        }
+        if (nlit > (size_t) (end - p) || nlit > (size_t) (oend - o)) {
+            return false;
+        }
+        memcpy(o, p, nlit);
+        o += nlit;
+        p += nlit;
+        if (p == end) {
+            break;
+        }
+        if (end - p < 2) {
+            return false;
+        }
+        size_t dist = p[0] | (size_t) p[1] << 8;
+        p += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_len(&p, end, &mlen)) {
+            return false;
+        }
+        mlen += LZ_MIN;
+        if (dist == 0 || dist > (size_t) (o - z->raw) || mlen > (size_t) (oend - o)) {
+            return false;
+        }
+        // A match closer than its length repeats the bytes it is copying, one at a time
+        const uint8_t *from = o - dist;
+        if (dist >= mlen) {
+            memcpy(o, from, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; i++) {
+                o[i] = from[i];
+            }
+        }
+        o += mlen;
+    }
+    if (o != oend) {
+        return false;
+    }
+    atomic_fetch_add(&rsa_stats.lz_plain, plain);
+    atomic_fetch_add(&rsa_stats.lz_packed, LZ_HEADER + packed);
+    z->out(z->arg, z->raw, plain);
+    return true;
+}
+
+// lz_dec_init()
+// lz_dec_init() starts decompressing a stream, every restored frame goes to out with arg
+void lz_dec_init(lz_dec_t *z, lz_out_fn out, void *arg) {
+    memset(z, 0, sizeof(lz_dec_t));
+    z->out = out;
+    z->arg = arg;
+    z->frame = (uint8_t *) malloc(LZ_HEADER + LZ_BOUND);
+    z->raw = (uint8_t *) malloc(LZ_FRAME);
+}
+
+// lz_write()
+// lz_write() takes the next len bytes of the compressed stream, restoring each frame as soon
+// as all of it is in
+// Returns false if a frame is malformed
+bool lz_write(lz_dec_t *z, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        // The header first, then as much payload as it says
+        size_t want = LZ_HEADER;
+        if (z->len >= LZ_HEADER) {
+            uint32_t plain = get_be32(z->frame);
+            uint32_t packed = get_be32(z->frame + 4) & ~LZ_STORED;
+            if (plain == 0 || plain > LZ_FRAME || packed == 0 || packed > LZ_BOUND) {
+                return false;
+            }
+            want = LZ_HEADER + packed;
+        }
+        size_t n = want - z->len < len ? want - z->len : len;
+        memcpy(z->frame + z->len, buf, n);
+        z->len += n;
+        buf += n;
+        len -= n;
+        if (z->len == want && want > LZ_HEADER) {
+            if (!restore(z)) {
+                return false;
+            }
+            z->len = 0;
+        }
+    }
+    return true;
+}
+
+// lz_dec_finish()
+// lz_dec_finish() returns false if the stream stopped part way through a frame
+bool lz_dec_finish(lz_dec_t *z) {
+    return z->len == 0;
+}
+
+// lz_dec_clear()
+// lz_dec_clear() frees the decompressor
+void lz_dec_clear(lz_dec_t *z) {
+    free(z->frame);
+    free(z->raw);
+    memset(z, 0, sizeof(lz_dec_t));
+}
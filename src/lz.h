@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "fileio.h"
+
+// LZ compression of the plaintext ahead of the file loops
+// The stream is a run of frames of up to LZ_FRAME plaintext bytes, each compressed on its own:
+// an 8 byte header holding the plaintext length and the payload length, big-endian, with
+// LZ_STORED set on the payload length when the frame didn't shrink and is kept as it was.
+// A payload is a run of sequences, each a token byte holding the literal count in its top
+// nibble and the match length less LZ_MIN in its bottom one, 15 meaning more follows in bytes
+// of 255 and a last byte below it, then the literals, then a 2 byte little-endian distance back
+// into the frame and the rest of the match length. The last sequence is only literals.
+#define LZ_FRAME  (256 * 1024)
+#define LZ_STORED 0x80000000u
+#define LZ_HEADER 8
+#define LZ_MIN    4
+
+// Called with each frame the decoder restores, buf is only valid for the call
+typedef void (*lz_out_fn)(void *arg, const uint8_t *buf, size_t len);
+
+// Compressor pulling plaintext from a reader and serving the frames a block at a time
+typedef struct {
+    reader_t *src;
+    uint8_t *raw; // LZ_FRAME bytes of plaintext being compressed
+    uint8_t *frame; // Header and payload of the frame being served
+    size_t len; // Bytes in frame
+    size_t pos; // Bytes of frame already served
+    bool eof;
+    uint32_t *head; // Last position + 1 of each hash, 0 for none
+    uint32_t *prev; // Position + 1 before each position with the same hash
+    size_t ins; // Positions below this are in the chains
+} lz_enc_t;
+
+// Decompressor taking the frames in pieces of any size and handing out the plaintext
+typedef struct {
+    lz_out_fn out;
+    void *arg;
+    uint8_t *frame; // Header and payload gathered so far
+    size_t len;
+    uint8_t *raw; // LZ_FRAME bytes of restored plaintext
+} lz_dec_t;
+
+void lz_enc_init(lz_enc_t *z, reader_t *src);
+
+size_t lz_read(lz_enc_t *z, uint8_t *buf, size_t len);
+
+void lz_enc_clear(lz_enc_t *z);
+
+void lz_dec_init(lz_dec_t *z, lz_out_fn out, void *arg);
+
+bool lz_write(lz_dec_t *z, const uint8_t *buf, size_t len);
+
+bool lz_dec_finish(lz_dec_t *z);
+
+void lz_dec_clear(lz_dec_t *z);
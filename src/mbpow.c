@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "mbpow.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The kernels are x86-64 intrinsics compiled for their own target, so the rest of the program
+// needs no extra -m flags and runs on any x86-64 CPU
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MB_X86
+#include <immintrin.h>
+#endif
+
+// Largest modulus the kernels take, it keeps the IFMA column sums below 2^64
+#define MB_MAX_BITS 16384
+
+// Largest modulus the AVX2 kernel beats mont_pow() at, past it GMP's assembly pulls ahead
+#define AVX2_MAX_BITS 2048
+
+// Rows the AVX2 kernel adds before carrying its columns back down to 29 bits, each row adds
+// two products below 2^58 to a column so 8 rows stay below 2^63
+#define AVX2_NORM 8
+
+// mb_supported()
+// mb_supported() checks whether this CPU (and its OS) can run the kernel
+bool mb_supported(mb_kernel_t kernel) {
+#ifdef MB_X86
+    __builtin_cpu_init();
+    switch (kernel) {
+    case MB_IFMA:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma");
+    case MB_AVX2: return __builtin_cpu_supports("avx2");
+    default: break;
+    }
+#endif
+    return kernel == MB_SCALAR;
+}
+
+// mb_best()
+// mb_best() picks the widest kernel the CPU supports that is faster than the scalar path for
+// a bits-bit modulus, MB_SCALAR if there is none
+mb_kernel_t mb_best(uint64_t bits) {
+    if (mb_supported(MB_IFMA)) {
+        return MB_IFMA;
+    } else if (bits <= AVX2_MAX_BITS && mb_supported(MB_AVX2)) {
+        return MB_AVX2;
+    }
+    return MB_SCALAR;
+}
+
+// mb_name()
+// mb_name() returns the name of a kernel for reports
+const char *mb_name(mb_kernel_t kernel) {
+    switch (kernel) {
+    case MB_IFMA: return "avx512ifma";
+    case MB_AVX2: return "avx2";
+    default: return "scalar";
+    }
+}
+
+// mb_lanes()
+// mb_lanes() returns the blocks a kernel exponentiates per call, 1 for the scalar path
+uint64_t mb_lanes(mb_kernel_t kernel) {
+    switch (kernel) {
+    case MB_IFMA: return 8;
+    case MB_AVX2: return 4;
+    default: return 1;
+    }
+}
+
+#ifdef MB_X86
+// ifma_mul()
+// ifma_mul() sets r = a * b * R^-1 mod n in each of 8 lanes of radix 2^52 limbs, r may alias
+// a or b
+// Inputs below 2n give a result below 2n (R is at least 4n), so no lane ever needs the final
+// subtraction. Each row adds the low and high halves of a[i] * b and m * n into the 64-bit
+// columns, whose sums stay below 2^64 for any k the context allows, and only the result is
+// carried back down to 52 bits.
+__attribute__((target("avx512f,avx512ifma"))) static void ifma_mul(
+    mb_t *ctx, uint64_t *r, const uint64_t *a, const uint64_t *b) {
+    uint64_t k = ctx->k;
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i mask = _mm512_set1_epi64((1ULL << 52) - 1);
+    const __m512i ninv = _mm512_set1_epi64(ctx->ninv);
+    const __m512i *bv = (const __m512i *) b;
+    const __m512i *nv = (const __m512i *) ctx->ln;
+    __m512i *t = (__m512i *) ctx->prod;
+    for (uint64_t j = 0; j < 2 * k + 1; j++) {
+        t[j] = zero;
+    }
+
+    for (uint64_t i = 0; i < k; i++) {
+        __m512i ai = _mm512_load_si512((const __m512i *) (a + 8 * i));
+
+        // Column i decides m = t[i] * -n^-1 mod 2^52, the row then clears its low 52 bits
+        __m512i x = _mm512_madd52lo_epu64(t[i], ai, bv[0]);
+        __m512i m = _mm512_madd52lo_epu64(zero, x, ninv);
+        x = _mm512_madd52lo_epu64(x, m, nv[0]);
+        __m512i c = _mm512_madd52hi_epu64(t[i + 1], ai, bv[0]);
+        c = _mm512_madd52hi_epu64(c, m, nv[0]);
+        c = _mm512_add_epi64(c, _mm512_srli_epi64(x, 52));
+        for (uint64_t j = 1; j < k; j++) {
+            x = _mm512_madd52lo_epu64(c, ai, bv[j]);
+            t[i + j] = _mm512_madd52lo_epu64(x, m, nv[j]);
+            c = _mm512_madd52hi_epu64(t[i + j + 1], ai, bv[j]);
+            c = _mm512_madd52hi_epu64(c, m, nv[j]);
+        }
+        t[i + k] = c;
+    }
+
+    __m512i carry = zero;
+    for (uint64_t j = 0; j < k; j++) {
+        __m512i x = _mm512_add_epi64(t[k + j], carry);
+        _mm512_store_si512((__m512i *) (r + 8 * j), _mm512_and_si512(x, mask));
+        carry = _mm512_srli_epi64(x, 52);
+    }
+}
+
+// avx2_mul()
+// avx2_mul() is ifma_mul() for 4 lanes of radix 2^29 limbs, whose 58-bit products fit a
+// 64-bit lane whole
+// The columns are carried back down to 29 bits every AVX2_NORM rows so they can't overflow.
+__attribute__((target("avx2"))) static void avx2_mul(
+    mb_t *ctx, uint64_t *r, const uint64_t *a, const uint64_t *b) {
+    uint64_t k = ctx->k;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i mask = _mm256_set1_epi64x((1ULL << 29) - 1);
+    const __m256i ninv = _mm256_set1_epi64x(ctx->ninv);
+    const __m256i *bv = (const __m256i *) b;
+    const __m256i *nv = (const __m256i *) ctx->ln;
+    __m256i *t = (__m256i *) ctx->prod;
+    for (uint64_t j = 0; j < 2 * k + 1; j++) {
+        t[j] = zero;
+    }
+
+    for (uint64_t i = 0; i < k; i++) {
+        __m256i ai = _mm256_load_si256((const __m256i *) (a + 4 * i));
+        __m256i x = _mm256_add_epi64(t[i], _mm256_mul_epu32(ai, bv[0]));
+        __m256i m = _mm256_and_si256(_mm256_mul_epu32(x, ninv), mask);
+        x = _mm256_add_epi64(x, _mm256_mul_epu32(m, nv[0]));
+        t[i + 1] = _mm256_add_epi64(t[i + 1], _mm256_srli_epi64(x, 29));
+        for (uint64_t j = 1; j < k; j++) {
+            x = _mm256_add_epi64(t[i + j], _mm256_mul_epu32(ai, bv[j]));
+            t[i + j] = _mm256_add_epi64(x, _mm256_mul_epu32(m, nv[j]));
+        }
+        if ((i + 1) % AVX2_NORM == 0) {
+            for (uint64_t j = i + 1; j < i + k; j++) {
+                t[j + 1] = _mm256_add_epi64(t[j + 1], _mm256_srli_epi64(t[j], 29));
+                t[j] = _mm256_and_si256(t[j], mask);
+            }
+        }
+    }
+
+    __m256i carry = zero;
+    for (uint64_t j = 0; j < k; j++) {
+        __m256i x = _mm256_add_epi64(t[k + j], carry);
+        _mm256_store_si256((__m256i *) (r + 4 * j), _mm256_and_si256(x, mask));
+        carry = _mm256_srli_epi64(x, 29);
+    }
+}
+#endif
+
+// mb_mul()
+// mb_mul() runs the context's kernel, r = a * b * R^-1 mod n in every lane
+static void mb_mul(mb_t *ctx, uint64_t *r, const uint64_t *a, const uint64_t *b) {
+#ifdef MB_X86
+    if (ctx->kernel == MB_IFMA) {
+        ifma_mul(ctx, r, a, b);
+    } else {
+        avx2_mul(ctx, r, a, b);
+    }
+#else
+    (void) ctx;
+    (void) r;
+    (void) a;
+    (void) b;
+#endif
+}
+
+// to_lane()
+// to_lane() splits x < R into radix-bit limbs and stores them in one lane of v
+static void to_lane(mb_t *ctx, uint64_t *v, uint64_t lane, mpz_t x) {
+    uint64_t words = (ctx->radix * ctx->k + 63) / 64 + 1;
+    uint64_t mask = (1ULL << ctx->radix) - 1;
+    memset(ctx->words, 0, words * sizeof(uint64_t));
+    mpz_export(ctx->words, NULL, -1, sizeof(uint64_t), 0, 0, x);
+    for (uint64_t j = 0; j < ctx->k; j++) {
+        uint64_t bit = j * ctx->radix;
+        uint64_t w = bit / 64, s = bit % 64;
+        uint64_t limb = ctx->words[w] >> s;
+        if (s + ctx->radix > 64) {
+            limb |= ctx->words[w + 1] << (64 - s);
+        }
+        v[j * ctx->lanes + lane] = limb & mask;
+    }
+}
+
+// from_lane()
+// from_lane() joins the limbs in one lane of v back into x
+static void from_lane(mb_t *ctx, mpz_t x, const uint64_t *v, uint64_t lane) {
+    uint64_t words = (ctx->radix * ctx->k + 63) / 64 + 1;
+    memset(ctx->words, 0, words * sizeof(uint64_t));
+    for (uint64_t j = 0; j < ctx->k; j++) {
+        uint64_t bit = j * ctx->radix;
+        uint64_t w = bit / 64, s = bit % 64;
+        uint64_t limb = v[j * ctx->lanes + lane];
+        ctx->words[w] |= limb << s;
+        if (s + ctx->radix > 64) {
+            ctx->words[w + 1] |= limb >> (64 - s);
+        }
+    }
+    mpz_import(x, words, -1, sizeof(uint64_t), 0, 0, ctx->words);
+}
+
+// mb_init()
+// mb_init() builds the context for n on a SIMD kernel
+// Returns false and leaves lanes at 0 if the kernel is MB_SCALAR or not supported here, or
+// if n is even, less than 3 or wider than the kernels take
+bool mb_init(mb_t *ctx, mpz_t n, mb_kernel_t kernel) {
+    memset(ctx, 0, sizeof(mb_t));
+    if (kernel == MB_SCALAR || !mb_supported(kernel) || mpz_cmp_ui(n, 3) < 0 || mpz_even_p(n)
+        || mpz_sizeinbase(n, 2) > MB_MAX_BITS) {
+        return false;
+    }
+    ctx->kernel = kernel;
+    ctx->lanes = mb_lanes(kernel);
+    ctx->radix = kernel == MB_IFMA ? 52 : 29;
+    ctx->k = (mpz_sizeinbase(n, 2) + 2 + ctx->radix - 1) / ctx->radix;
+    uint64_t k = ctx->k;
+    uint64_t size = k * ctx->lanes;
+
+    // One allocation for every array, each a multiple of a vector so all stay aligned
+    uint64_t words = ((ctx->radix * k + 63) / 64 + 1 + 7) & ~7ULL;
+    uint64_t entries = 1ULL << (MONT_WINDOW - 1);
+    uint64_t total = (4 + entries) * size + (2 * k + 2) * ctx->lanes + words;
+    total = (total + 7) & ~7ULL;
+    ctx->ln = (uint64_t *) aligned_alloc(64, total * sizeof(uint64_t));
+    memset(ctx->ln, 0, total * sizeof(uint64_t));
+    ctx->one = ctx->ln + size;
+    ctx->unit = ctx->one + size;
+    ctx->acc = ctx->unit + size;
+    ctx->table = ctx->acc + size;
+    ctx->prod = ctx->table + entries * size;
+    ctx->words = ctx->prod + (2 * k + 2) * ctx->lanes;
+
+    // Newton iteration for n^-1 mod 2^64 as in mont_set(), then cut down to the radix
+    uint64_t n0 = mpz_getlimbn(n, 0);
+    uint64_t x = n0;
+    for (int i = 0; i < 5; i++) {
+        x *= 2 - n0 * x;
+    }
+    ctx->ninv = (0 - x) & ((1ULL << ctx->radix) - 1);
+
+    mpz_init_set(ctx->n, n);
+    mpz_init(ctx->t);
+    mpz_set_ui(ctx->t, 1);
+    mpz_mul_2exp(ctx->t, ctx->t, ctx->radix * k);
+    mpz_mod(ctx->t, ctx->t, n);
+    for (uint64_t l = 0; l < ctx->lanes; l++) {
+        to_lane(ctx, ctx->ln, l, ctx->n);
+        to_lane(ctx, ctx->one, l, ctx->t);
+        ctx->unit[l] = 1;
+    }
+    return true;
+}
+
+// mb_clear()
+// mb_clear() frees the context, a zeroed or rejected context is left as it is
+void mb_clear(mb_t *ctx) {
+    if (ctx->lanes != 0) {
+        free(ctx->ln);
+        mpz_clears(ctx->n, ctx->t, NULL);
+    }
+    mont_plan_clear(&ctx->plan);
+    memset(ctx, 0, sizeof(mb_t));
+}
+
+// mb_pow()
+// mb_pow() sets o[i] = a[i]^d mod n for the count <= lanes blocks in a, the same result as
+// pow_mod() for each
+// d is planned on the first call with it and the plan kept for the calls after.
+// Lanes past count repeat a[0] and are thrown away, so a short call costs a full one.
+void mb_pow(mb_t *ctx, mpz_t *o, mpz_t *a, uint64_t count, mpz_t d) {
+    uint64_t size = ctx->k * ctx->lanes;
+    uint64_t *table = ctx->table;
+    uint64_t *acc = ctx->acc;
+    mont_plan_t *plan = &ctx->plan;
+    mont_plan(plan, d);
+
+    // Convert each block into the Montgomery domain, table[0] = a R mod n
+    for (uint64_t l = 0; l < ctx->lanes; l++) {
+        mpz_mod(ctx->t, a[l < count ? l : 0], ctx->n);
+        mpz_mul_2exp(ctx->t, ctx->t, ctx->radix * ctx->k);
+        mpz_mod(ctx->t, ctx->t, ctx->n);
+        to_lane(ctx, table, l, ctx->t);
+    }
+
+    if (plan->count == 0) {
+        memcpy(acc, ctx->one, size * sizeof(uint64_t));
+    } else {
+        // table[i] = a^(2i+1), built from a^2 held in acc until the first step loads it
+        if (plan->w > 1) {
+            mb_mul(ctx, acc, table, table);
+            for (uint64_t i = 1; i < (1ULL << (plan->w - 1)); i++) {
+                mb_mul(ctx, table + i * size, table + (i - 1) * size, acc);
+            }
+        }
+
+        // The lanes share the plan so they branch together
+        memcpy(acc, table + plan->steps[0].idx * size, size * sizeof(uint64_t));
+        for (uint64_t i = 1; i < plan->count; i++) {
+            for (uint32_t s = 0; s < plan->steps[i].sqr; s++) {
+                mb_mul(ctx, acc, acc, acc);
+            }
+            mb_mul(ctx, acc, acc, table + plan->steps[i].idx * size);
+        }
+        for (uint32_t s = 0; s < plan->tail; s++) {
+            mb_mul(ctx, acc, acc, acc);
+        }
+    }
+
+    // Leave the Montgomery domain, a product with 1 is at most n
+    mb_mul(ctx, acc, acc, ctx->unit);
+    for (uint64_t l = 0; l < count; l++) {
+        from_lane(ctx, o[l], acc, l);
+        if (mpz_cmp(o[l], ctx->n) >= 0) {
+            mpz_sub(o[l], o[l], ctx->n);
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+#include "mont.h"
+
+// Multi-buffer modular exponentiation, one block per SIMD lane
+// The blocks of a file share the modulus and the exponent, so every lane runs the same steps of
+// the exponent's mont_plan_t in lock step. The AVX-512 IFMA kernel holds 8 lanes of radix 2^52
+// limbs and the AVX2 kernel 4 lanes of radix 2^29 limbs. mb_best() picks one by CPUID and the
+// modulus size, and MB_SCALAR means neither is there or pays off, so the callers stay on
+// mont_pow().
+typedef enum { MB_SCALAR, MB_AVX2, MB_IFMA } mb_kernel_t;
+
+// Most lanes of any kernel, callers size their per-lane arrays by this
+#define MB_MAX_LANES 8
+
+// Multi-buffer context for one odd modulus, every limb array is interleaved as
+// [limb][lane] so limb j of all the lanes is one vector
+typedef struct {
+    mb_kernel_t kernel;
+    uint64_t lanes; // Blocks per call, 0 when the context is not in use
+    uint64_t radix; // Bits per limb
+    uint64_t k; // Limbs, radix * k is at least 2 bits wider than n
+    uint64_t ninv; // -n^-1 mod 2^radix
+    mpz_t n;
+    mpz_t t; // Scratch for the conversions
+    uint64_t *ln; // n in every lane
+    uint64_t *one; // R mod n in every lane, R = 2^(radix * k)
+    uint64_t *unit; // 1 in every lane, for leaving the Montgomery domain
+    uint64_t *table; // Odd powers a^1, a^3, ... a^(2^MONT_WINDOW - 1) per lane
+    uint64_t *acc; // Running result
+    uint64_t *prod; // 2k + 1 limb accumulator of the kernels
+    uint64_t *words; // 64-bit words of one lane being converted
+    mont_plan_t plan; // Plan of the last exponent, as in mont_t
+} mb_t;
+
+mb_kernel_t mb_best(uint64_t bits);
+
+bool mb_supported(mb_kernel_t kernel);
+
+const char *mb_name(mb_kernel_t kernel);
+
+uint64_t mb_lanes(mb_kernel_t kernel);
+
+bool mb_init(mb_t *ctx, mpz_t n, mb_kernel_t kernel);
+
+void mb_clear(mb_t *ctx);
+
+void mb_pow(mb_t *ctx, mpz_t *o, mpz_t *a, uint64_t count, mpz_t d);
@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Sieve limit, every odd prime below this goes into the table
+#define LIMIT 32768
+
+// main()
+// main() writes smallprimes.h, the table of odd primes make_prime() sieves candidates with
+int main(void) {
+    bool *composite = (bool *) calloc(LIMIT, sizeof(bool));
+    uint64_t count = 0;
+
+    for (uint64_t i = 2; i * i < LIMIT; i++) {
+        if (!composite[i]) {
+            for (uint64_t j = i * i; j < LIMIT; j += i) {
+                composite[j] = true;
+            }
+        }
+    }
+    for (uint64_t i = 3; i < LIMIT; i += 2) {
+        count += composite[i] ? 0 : 1;
+    }
+
+    fprintf(stdout, "// Generated by mkprimes, do not edit\n");
+    fprintf(stdout, "#pragma once\n\n#include <stdint.h>\n\n");
+    fprintf(stdout, "#define SMALL_PRIMES %lu\n\n", (unsigned long) count);
+    fprintf(stdout, "static const uint16_t small_primes[SMALL_PRIMES] = {");
+    count = 0;
+    for (uint64_t i = 3; i < LIMIT; i += 2) {
+        if (!composite[i]) {
+            fprintf(stdout, "%s%lu,", count++ % 12 == 0 ? "\n    " : " ", (unsigned long) i);
+        }
+    }
+    fprintf(stdout, "\n};\n");
+    free(composite);
+    return 0;
+}
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "mont.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// mont_redc()
+// mont_redc() sets r = t * R^-1 mod n for a 2k limb t < n * R, t is destroyed
+// Each pass clears the lowest limb of t, its carry is parked in the freed limb and added at the end
+static void mont_redc(mp_limb_t *r, mp_limb_t *t, mont_t *ctx) {
+    mp_size_t k = ctx->k;
+    for (mp_size_t i = 0; i < k; i++) {
+        mp_limb_t u = t[i] * ctx->ninv;
+        t[i] = mpn_addmul_1(t + i, ctx->n, k, u);
+    }
+    mp_limb_t top = mpn_add_n(r, t + k, t, k);
+    if (top != 0 || mpn_cmp(r, ctx->n, k) >= 0) {
+        mpn_sub_n(r, r, ctx->n, k);
+    }
+}
+
+// mont_mul()
+// mont_mul() sets r = a * b * R^-1 mod n, r may alias a or b
+static void mont_mul(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, mont_t *ctx) {
+    if (ctx->mul != NULL) {
+        if (a == b) {
+            ctx->sqr(r, a, ctx->n, ctx->ninv);
+        } else {
+            ctx->mul(r, a, b, ctx->n, ctx->ninv);
+        }
+        return;
+    }
+    if (a == b) {
+        mpn_sqr(ctx->prod, a, ctx->k);
+    } else {
+        mpn_mul_n(ctx->prod, a, b, ctx->k);
+    }
+    mont_redc(r, ctx->prod, ctx);
+}
+
+// mont_alloc()
+// mont_alloc() lays out the limb arrays of ctx for a k limb modulus, growing the allocation
+// only when k is larger than any modulus it held before, and looks up kernels for k
+static void mont_alloc(mont_t *ctx, mp_size_t k) {
+    // One allocation for every limb array in the context
+    size_t entries = (size_t) 1 << (MONT_WINDOW - 1);
+    if (k > ctx->cap) {
+        free(ctx->n);
+        ctx->n = (mp_limb_t *) calloc((11 + entries) * k + 3, sizeof(mp_limb_t));
+        ctx->cap = k;
+    }
+    ctx->k = k;
+    ctx->r2 = ctx->n + k;
+    ctx->one = ctx->r2 + k;
+    ctx->acc = ctx->one + k;
+    ctx->tmp = ctx->acc + k;
+    ctx->prod = ctx->tmp + k;
+    ctx->table = ctx->prod + 2 * k;
+    ctx->scratch = ctx->table + entries * k;
+    if (ctx->kernels == NULL || !ctx->kernels(k, &ctx->mul, &ctx->sqr)) {
+        ctx->mul = NULL;
+        ctx->sqr = NULL;
+    }
+}
+
+// mont_init()
+// mont_init() builds the Montgomery context for n, returns false if n is even or less than 3
+bool mont_init(mont_t *ctx, mpz_t n) {
+    memset(ctx, 0, sizeof(mont_t));
+    return mont_set(ctx, n);
+}
+
+// mont_set()
+// mont_set() rebuilds an initialized context for a new n, reusing its storage when n is no
+// larger than before so a caller walking many moduli of one size allocates only once
+// Returns false and leaves k at 0 if n is even or less than 3, the storage is kept
+bool mont_set(mont_t *ctx, mpz_t n) {
+    ctx->k = 0;
+    if (mpz_cmp_ui(n, 3) < 0 || mpz_even_p(n)) {
+        return false;
+    }
+    mp_size_t k = mpz_size(n);
+    mont_alloc(ctx, k);
+    mpn_copyi(ctx->n, mpz_limbs_read(n), k);
+
+    // Newton iteration for n^-1 mod 2^64, n0 is its own inverse mod 8 so start with 3 good bits
+    mp_limb_t n0 = ctx->n[0];
+    mp_limb_t x = n0;
+    for (int i = 0; i < 5; i++) {
+        x *= 2 - n0 * x;
+    }
+    ctx->ninv = -x;
+
+    // R^2 mod n and R mod n, dividing 2^(2k * GMP_NUMB_BITS) and 2^(k * GMP_NUMB_BITS) by n
+    // in the scratch limbs, the quotient goes after the 2k + 1 limb dividend
+    mp_limb_t *num = ctx->scratch;
+    mp_limb_t *quot = num + 2 * k + 1;
+    mpn_zero(num, 2 * k + 1);
+    num[2 * k] = 1;
+    mpn_tdiv_qr(quot, ctx->r2, 0, num, 2 * k + 1, ctx->n, k);
+    mpn_zero(num, k + 1);
+    num[k] = 1;
+    mpn_tdiv_qr(quot, ctx->one, 0, num, k + 1, ctx->n, k);
+    return true;
+}
+
+// mont_use()
+// mont_use() switches ctx to the kernels kernels finds, now and whenever it is set again,
+// NULL goes back to GMP
+// Returns false if there are no kernels for the current limb count, which then stays on GMP
+bool mont_use(mont_t *ctx, mont_kernels_t kernels) {
+    ctx->kernels = kernels;
+    if (kernels == NULL || ctx->k == 0 || !kernels(ctx->k, &ctx->mul, &ctx->sqr)) {
+        ctx->mul = NULL;
+        ctx->sqr = NULL;
+    }
+    return kernels == NULL || ctx->mul != NULL;
+}
+
+// mont_load()
+// mont_load() builds a context from constants saved off an earlier one, skipping the divisions
+// n, r2 and one are k limbs each, ctx is initialized or zeroed
+void mont_load(mont_t *ctx, mp_size_t k, const mp_limb_t *n, mp_limb_t ninv,
+    const mp_limb_t *r2, const mp_limb_t *one) {
+    mont_alloc(ctx, k);
+    mpn_copyi(ctx->n, n, k);
+    mpn_copyi(ctx->r2, r2, k);
+    mpn_copyi(ctx->one, one, k);
+    ctx->ninv = ninv;
+}
+
+// mont_copy()
+// mont_copy() builds dst for the same modulus as src, so each worker can have its own
+// scratch without redoing the setup
+void mont_copy(mont_t *dst, mont_t *src) {
+    dst->kernels = src->kernels;
+    mont_load(dst, src->k, src->n, src->ninv, src->r2, src->one);
+}
+
+// mont_clear()
+// mont_clear() frees the Montgomery context
+void mont_clear(mont_t *ctx) {
+    free(ctx->n);
+    mont_plan_clear(&ctx->plan);
+    memset(ctx, 0, sizeof(mont_t));
+}
+
+// mont_in()
+// mont_in() reduces a mod n and converts it into the Montgomery domain as r = aR mod n
+static void mont_in(mp_limb_t *r, mpz_t a, mont_t *ctx) {
+    mp_size_t k = ctx->k;
+    mp_limb_t *tmp = ctx->tmp;
+
+    // Reduce a into k limbs, only needed when a is not already in [0, n)
+    mpn_zero(tmp, k);
+    mp_size_t as = mpz_size(a);
+    if (mpz_sgn(a) >= 0 && (as < k || (as == k && mpn_cmp(mpz_limbs_read(a), ctx->n, k) < 0))) {
+        mpn_copyi(tmp, mpz_limbs_read(a), as);
+    } else if (mpz_sgn(a) > 0 && as <= 2 * k + 1) {
+        // The quotient has at most k + 2 limbs and is thrown away
+        mpn_tdiv_qr(ctx->scratch, tmp, 0, mpz_limbs_read(a), as, ctx->n, k);
+    } else {
+        mpz_t t, nv;
+        mpz_init(t);
+        mpz_mod(t, a, mpz_roinit_n(nv, ctx->n, k));
+        mpn_copyi(tmp, mpz_limbs_read(t), mpz_size(t));
+        mpz_clear(t);
+    }
+    mont_mul(r, tmp, ctx->r2, ctx);
+}
+
+// mont_out()
+// mont_out() leaves the Montgomery domain by reducing x * 1 and stores the result in o
+static void mont_out(mpz_t o, const mp_limb_t *x, mont_t *ctx) {
+    mp_size_t k = ctx->k;
+    mpn_zero(ctx->prod, 2 * k);
+    mpn_copyi(ctx->prod, x, k);
+    mont_redc(ctx->tmp, ctx->prod, ctx);
+    mpn_copyi(mpz_limbs_write(o, k), ctx->tmp, k);
+    mpz_limbs_finish(o, k);
+}
+
+// mont_pow_ui()
+// mont_pow_ui() calculates o = a^d mod n for a word-sized exponent such as e = 65537
+// Plain left to right square and multiply without a table, 65537 is 16 squarings and 1 multiply
+static void mont_pow_ui(mpz_t o, mpz_t a, unsigned long d, mont_t *ctx) {
+    mp_limb_t *acc = ctx->acc;
+    mp_limb_t *base = ctx->table;
+    if (d == 0) {
+        mont_out(o, ctx->one, ctx);
+        return;
+    }
+    mont_in(base, a, ctx);
+    mpn_copyi(acc, base, ctx->k);
+    int top = (int) (sizeof(unsigned long) * 8 - 1) - __builtin_clzl(d);
+    for (int b = top - 1; b >= 0; b--) {
+        mont_mul(acc, acc, acc, ctx);
+        if ((d >> b) & 1) {
+            mont_mul(acc, acc, base, ctx);
+        }
+    }
+    mont_out(o, acc, ctx);
+}
+
+// window_at()
+// window_at() returns the w bits of d from bit i up, bits past the top of d read as 0
+static uint32_t window_at(mpz_t d, mp_bitcnt_t i, int w) {
+    mp_size_t limb = i / GMP_NUMB_BITS;
+    int off = i % GMP_NUMB_BITS;
+    mp_limb_t v = mpz_getlimbn(d, limb) >> off;
+    if (off + w > GMP_NUMB_BITS) {
+        v |= mpz_getlimbn(d, limb + 1) << (GMP_NUMB_BITS - off);
+    }
+    return (uint32_t) (v & (((mp_limb_t) 1 << w) - 1));
+}
+
+// plan_windows()
+// plan_windows() cuts d into odd windows of at most w bits from the bottom up, each starting
+// at the next set bit, and returns how many there are
+// With steps set it also writes them top window first, steps must hold the count already.
+static uint64_t plan_windows(mpz_t d, int w, mont_step_t *steps, uint64_t count, uint32_t *tail) {
+    uint64_t windows = 0;
+    mp_bitcnt_t last = 0;
+    for (mp_bitcnt_t i = mpz_scan1(d, 0); i != ~(mp_bitcnt_t) 0; i = mpz_scan1(d, i + w)) {
+        if (steps != NULL) {
+            mont_step_t *step = &steps[count - 1 - windows];
+            step->idx = window_at(d, i, w) >> 1;
+            step->sqr = 0;
+            if (windows == 0) {
+                *tail = (uint32_t) i;
+            } else {
+                step[1].sqr = (uint32_t) (i - last);
+            }
+        }
+        last = i;
+        windows++;
+    }
+    return windows;
+}
+
+// plan_reserve()
+// plan_reserve() makes room in plan for count steps and the dn limbs of its exponent
+static void plan_reserve(mont_plan_t *plan, uint64_t count, mp_size_t dn) {
+    if (count > plan->cap) {
+        plan->steps = (mont_step_t *) realloc(plan->steps, count * sizeof(mont_step_t));
+        plan->cap = count;
+    }
+    plan->d = (mp_limb_t *) realloc(plan->d, (dn > 0 ? dn : 1) * sizeof(mp_limb_t));
+    plan->dn = dn;
+}
+
+// plan_set()
+// plan_set() works out the plan for d, a negative d counts as 0 as in mont_pow()
+// Every width up to MONT_WINDOW is tried and the one with the fewest multiplies kept, the
+// table for w > 1 costs a squaring and 2^(w-1) - 1 multiplies and each window past the first
+// one more, the squarings are the same for every width
+static void plan_set(mont_plan_t *plan, mpz_t d) {
+    bool positive = mpz_sgn(d) > 0;
+    int w = 1;
+    uint64_t best = UINT64_MAX;
+    for (int v = 1; positive && v <= MONT_WINDOW; v++) {
+        uint64_t cost = plan_windows(d, v, NULL, 0, NULL) + (v > 1 ? 1ULL << (v - 1) : 0);
+        if (cost < best) {
+            best = cost;
+            w = v;
+        }
+    }
+    uint64_t count = positive ? plan_windows(d, w, NULL, 0, NULL) : 0;
+    plan_reserve(plan, count, positive ? (mp_size_t) mpz_size(d) : 0);
+    plan->w = w;
+    plan->count = count;
+    plan->tail = 0;
+    if (positive) {
+        plan_windows(d, w, plan->steps, count, &plan->tail);
+        mpn_copyi(plan->d, mpz_limbs_read(d), plan->dn);
+    }
+}
+
+// plan_matches()
+// plan_matches() returns whether plan is the plan for d
+static bool plan_matches(const mont_plan_t *plan, mpz_t d) {
+    mp_size_t dn = mpz_sgn(d) > 0 ? (mp_size_t) mpz_size(d) : 0;
+    return plan->d != NULL && plan->dn == dn
+           && (dn == 0 || mpn_cmp(plan->d, mpz_limbs_read(d), dn) == 0);
+}
+
+// mont_plan()
+// mont_plan() makes plan the plan for d, keeping it when it already is
+void mont_plan(mont_plan_t *plan, mpz_t d) {
+    if (!plan_matches(plan, d)) {
+        plan_set(plan, d);
+    }
+}
+
+// mont_plan_clear()
+// mont_plan_clear() frees the plan, leaving none
+void mont_plan_clear(mont_plan_t *plan) {
+    free(plan->steps);
+    free(plan->d);
+    memset(plan, 0, sizeof(mont_plan_t));
+}
+
+// mont_run()
+// mont_run() calculates o = a^d mod n by replaying the plan for d
+static void mont_run(mpz_t o, mpz_t a, const mont_plan_t *plan, mont_t *ctx) {
+    mp_size_t k = ctx->k;
+    mp_limb_t *acc = ctx->acc;
+    mp_limb_t *tmp = ctx->tmp;
+    mp_limb_t *table = ctx->table;
+    if (plan->count == 0) {
+        mont_out(o, ctx->one, ctx);
+        return;
+    }
+
+    // Convert a into the Montgomery domain, table[0] = aR mod n
+    mont_in(table, a, ctx);
+
+    // table[i] = a^(2i+1), built from a^2
+    if (plan->w > 1) {
+        mont_mul(tmp, table, table, ctx);
+        for (size_t i = 1; i < ((size_t) 1 << (plan->w - 1)); i++) {
+            mont_mul(table + i * k, table + (i - 1) * k, tmp, ctx);
+        }
+    }
+
+    // Square up to each window and multiply its odd power in
+    mpn_copyi(acc, table + plan->steps[0].idx * k, k);
+    for (uint64_t i = 1; i < plan->count; i++) {
+        for (uint32_t s = 0; s < plan->steps[i].sqr; s++) {
+            mont_mul(acc, acc, acc, ctx);
+        }
+        mont_mul(acc, acc, table + plan->steps[i].idx * k, ctx);
+    }
+    for (uint32_t s = 0; s < plan->tail; s++) {
+        mont_mul(acc, acc, acc, ctx);
+    }
+
+    mont_out(o, acc, ctx);
+}
+
+// mont_pow()
+// mont_pow() calculates o = a^d mod n with the sliding window plan for d, worked out on the
+// first call with a new d and kept in ctx, so a run of calls with one exponent plans it once
+// Word-sized exponents take the mont_pow_ui() fast path
+void mont_pow(mpz_t o, mpz_t a, mpz_t d, mont_t *ctx) {
+    // Like pow_mod_binary(), a negative exponent counts as 0
+    if (mpz_sgn(d) <= 0 || mpz_fits_ulong_p(d)) {
+        mont_pow_ui(o, a, mpz_sgn(d) > 0 ? mpz_get_ui(d) : 0, ctx);
+        return;
+    }
+    mont_plan(&ctx->plan, d);
+    mont_run(o, a, &ctx->plan, ctx);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// Largest sliding window used by mont_pow(), the odd power table holds 2^(MONT_WINDOW-1) entries
+#define MONT_WINDOW 6
+
+// One step of an exponentiation plan, sqr squarings then a multiply by the odd power
+// 2 idx + 1 of the table
+typedef struct {
+    uint32_t sqr;
+    uint32_t idx;
+} mont_step_t;
+
+// Exponentiation plan for one exponent d, its sliding windows worked out once and replayed for
+// every base, so the blocks of a file don't each scan d bit by bit. The window width is the
+// one with the fewest multiplies for this d, counting the table it needs.
+// The first step loads its power without squaring, tail squarings follow the last one.
+typedef struct {
+    int w; // Window width, the table holds 2^(w-1) odd powers
+    uint32_t tail;
+    mont_step_t *steps;
+    uint64_t count; // Steps, 0 when d is 0
+    uint64_t cap; // Steps the allocation holds
+    mp_limb_t *d; // Limbs of the exponent the plan is for, NULL for no plan
+    mp_size_t dn;
+} mont_plan_t;
+
+// Montgomery multiplication and squaring for one limb count, r = a * b * R^-1 mod n
+typedef void (*mont_mul_t)(
+    mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *b, const mp_limb_t *n, mp_limb_t ninv);
+
+typedef void (*mont_sqr_t)(mp_limb_t *r, const mp_limb_t *a, const mp_limb_t *n, mp_limb_t ninv);
+
+// Looks up the kernels for a k limb modulus, returns false if there are none
+// Every context multiplies with GMP's mpn calls until mont_use() hands it a lookup, which only
+// bench does, with the fixed-width kernels of fixed.h that are linked into bench alone.
+typedef bool (*mont_kernels_t)(mp_size_t k, mont_mul_t *mul, mont_sqr_t *sqr);
+
+// Montgomery context for one odd modulus n, built once and reused for every exponentiation
+typedef struct {
+    mp_size_t k; // Limbs in n
+    mp_limb_t *n; // Modulus limbs
+    mp_limb_t ninv; // -n^-1 mod 2^GMP_NUMB_BITS
+    mp_limb_t *r2; // R^2 mod n, R = 2^(k * GMP_NUMB_BITS)
+    mp_limb_t *one; // R mod n, 1 in the Montgomery domain
+    mp_limb_t *table; // Odd powers a^1, a^3, ... a^(2^MONT_WINDOW - 1)
+    mp_limb_t *acc; // Running result
+    mp_limb_t *tmp; // Scratch for the input/output conversions
+    mp_limb_t *prod; // 2k limb product fed to mont_redc()
+    mp_limb_t *scratch; // 3k + 3 limbs for the divisions in mont_set() and mont_in()
+    mp_size_t cap; // Limbs the allocation was sized for, mont_set() reuses it up to this
+    mont_kernels_t kernels; // Kept when the context is set for a new n and by mont_copy()
+    mont_mul_t mul; // Kernels for k limbs, NULL on the GMP path
+    mont_sqr_t sqr;
+    mont_plan_t plan; // Plan of the last exponent, kept while the same one comes back
+} mont_t;
+
+bool mont_init(mont_t *ctx, mpz_t n);
+
+bool mont_set(mont_t *ctx, mpz_t n);
+
+bool mont_use(mont_t *ctx, mont_kernels_t kernels);
+
+void mont_load(mont_t *ctx, mp_size_t k, const mp_limb_t *n, mp_limb_t ninv,
+    const mp_limb_t *r2, const mp_limb_t *one);
+
+void mont_copy(mont_t *dst, mont_t *src);
+
+void mont_clear(mont_t *ctx);
+
+void mont_pow(mpz_t o, mpz_t a, mpz_t d, mont_t *ctx);
+
+void mont_plan(mont_plan_t *plan, mpz_t d);
+
+void mont_plan_clear(mont_plan_t *plan);
@@ -2,36 +2,131 @@
 #include <gmp.h>
 #include "numtheory.h"
 #include "randstate.h"
+#include "mont.h"
+#include "smallprimes.h"
+#include "pool.h"
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Candidates per sieve window, and the size below which make_prime() just draws at random
+#define SIEVE_WINDOW   4096
+#define SIEVE_MIN_BITS 16
+
+// Temporaries across all the parts of a workspace_t
+#define WS_TEMPS 30
+
+prime_stats_t prime_stats;
+
+prime_engine_t prime_engine = PRIME_MR;
+
+// ws_temps()
+// ws_temps() lists every temporary of ws for ws_init() and ws_clear()
+static void ws_temps(workspace_t *ws, mpz_ptr t[WS_TEMPS]) {
+    mpz_ptr all[WS_TEMPS] = { ws->gcd.t, ws->gcd.na, ws->gcd.nb, ws->inverse.r, ws->inverse.rr,
+        ws->inverse.t, ws->inverse.tt, ws->inverse.q, ws->inverse.temp, ws->inverse.temp2,
+        ws->pow.v, ws->pow.nd, ws->pow.p, ws->prime.r, ws->prime.nminusone, ws->prime.a,
+        ws->prime.y, ws->prime.bounds, ws->lucas.u, ws->lucas.v, ws->lucas.qk, ws->lucas.d,
+        ws->lucas.t, ws->priv.phi, ws->priv.pm1, ws->priv.qm1, ws->crt.m1, ws->crt.m2, ws->crt.h,
+        ws->verify.m };
+    memcpy(t, all, sizeof(all));
+}
+
+// ws_init()
+// ws_init() sizes a workspace for bits-bit moduli, the temporaries get room for a double
+// size product so the hot loops never grow them, 0 leaves them to grow on first use
+void ws_init(workspace_t *ws, uint64_t bits) {
+    mpz_ptr t[WS_TEMPS];
+    ws_temps(ws, t);
+    for (int i = 0; i < WS_TEMPS; i++) {
+        mpz_init2(t[i], bits > 0 ? 2 * bits + GMP_NUMB_BITS : 0);
+    }
+    memset(&ws->mont, 0, sizeof(mont_t));
+}
+
+// ws_clear()
+// ws_clear() frees the workspace
+void ws_clear(workspace_t *ws) {
+    mpz_ptr t[WS_TEMPS];
+    ws_temps(ws, t);
+    for (int i = 0; i < WS_TEMPS; i++) {
+        mpz_clear(t[i]);
+    }
+    mont_clear(&ws->mont);
+}
+
+// Workspace of the calls without a _ws form, one per thread made on its first such call and
+// freed when the thread exits, so repeated calls allocate no more than the _ws forms do
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+// thread_ws_free()
+// thread_ws_free() frees a thread's workspace as the thread exits
+static void thread_ws_free(void *ws) {
+    ws_clear((workspace_t *) ws);
+    free(ws);
+}
+
+// thread_ws_key()
+// thread_ws_key() makes the key the per thread workspaces hang off, once per process
+static void thread_ws_key(void) {
+    pthread_key_create(&thread_key, thread_ws_free);
+}
+
+// thread_ws()
+// thread_ws() returns the calling thread's workspace, making it on the first call
+// None of the _ws forms call back into the wrappers using it, so it is never in use twice.
+static workspace_t *thread_ws(void) {
+    pthread_once(&thread_once, thread_ws_key);
+    workspace_t *ws = (workspace_t *) pthread_getspecific(thread_key);
+    if (ws == NULL) {
+        ws = (workspace_t *) malloc(sizeof(workspace_t));
+        ws_init(ws, 0);
+        pthread_setspecific(thread_key, ws);
+    }
+    return ws;
+}
 
 // gcd()
 // gcd() calculates the greatest common divisor
 void gcd(mpz_t g, mpz_t a, mpz_t b) {
-    mpz_t t, na, nb;
-    mpz_init(t);
-    mpz_init_set(na, a);
-    mpz_init_set(nb, b);
+    gcd_ws(g, a, b, thread_ws());
+}
+
+// gcd_ws()
+// gcd_ws() is gcd() using the temporaries of ws
+void gcd_ws(mpz_t g, mpz_t a, mpz_t b, workspace_t *ws) {
+    mpz_ptr t = ws->gcd.t, na = ws->gcd.na, nb = ws->gcd.nb;
+    mpz_set(na, a);
+    mpz_set(nb, b);
     while (mpz_cmp_ui(nb, 0) != 0) {
         mpz_set(t, nb);
         mpz_mod(nb, na, nb);
         mpz_set(na, t);
     }
     mpz_set(g, na);
-    mpz_clears(t, na, nb, NULL);
     return;
 }
 
 // mod_inverse()
 // mod_inverse() calculates the mod inverse
 void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
-    mpz_t r, rr, t, tt, q, temp, temp2;
-    mpz_init_set(r, n);
-    mpz_init_set(rr, a);
-    mpz_init_set_ui(t, 0);
-    mpz_init_set_ui(tt, 1);
-    mpz_inits(q, temp, temp2, NULL);
+    mod_inverse_ws(o, a, n, thread_ws());
+}
+
+// mod_inverse_ws()
+// mod_inverse_ws() is mod_inverse() using the temporaries of ws
+void mod_inverse_ws(mpz_t o, mpz_t a, mpz_t n, workspace_t *ws) {
+    mpz_ptr r = ws->inverse.r, rr = ws->inverse.rr, t = ws->inverse.t, tt = ws->inverse.tt;
+    mpz_ptr q = ws->inverse.q, temp = ws->inverse.temp, temp2 = ws->inverse.temp2;
+    mpz_set(r, n);
+    mpz_set(rr, a);
+    mpz_set_ui(t, 0);
+    mpz_set_ui(tt, 1);
     while (mpz_cmp_ui(rr, 0) != 0) {
         mpz_fdiv_q(q, r, rr);
         mpz_set(temp, r);
@@ -45,24 +140,29 @@ void mod_inverse(mpz_t o, mpz_t a, mpz_t n) {
     }
     if (mpz_cmp_ui(r, 1) > 0) {
         mpz_set_ui(o, 0);
-        mpz_clears(r, rr, t, tt, q, temp, temp2, NULL);
         return;
     }
     if (mpz_cmp_ui(t, 0) < 0) {
         mpz_add(t, t, n);
     }
     mpz_set(o, t);
-    mpz_clears(r, rr, t, tt, q, temp, temp2, NULL);
     return;
 }
 
-// pow_mod()
-// pow_mod() calculates power mod
-void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
-    mpz_t v, nd, p;
-    mpz_init_set(nd, d);
-    mpz_init_set_ui(v, 1);
-    mpz_init_set(p, a);
+// pow_mod_binary()
+// pow_mod_binary() calculates power mod with plain square and multiply
+// Used for the moduli Montgomery reduction can't handle and as the benchmark baseline
+void pow_mod_binary(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+    pow_mod_binary_ws(o, a, d, n, thread_ws());
+}
+
+// pow_mod_binary_ws()
+// pow_mod_binary_ws() is pow_mod_binary() using the temporaries of ws
+void pow_mod_binary_ws(mpz_t o, mpz_t a, mpz_t d, mpz_t n, workspace_t *ws) {
+    mpz_ptr v = ws->pow.v, nd = ws->pow.nd, p = ws->pow.p;
+    mpz_set(nd, d);
+    mpz_set_ui(v, 1);
+    mpz_set(p, a);
     while (mpz_cmp_ui(nd, 0) > 0) {
         if (mpz_odd_p(nd)) {
             mpz_mul(v, v, p);
@@ -73,80 +173,484 @@ void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
         mpz_fdiv_q_ui(nd, nd, 2);
     }
     mpz_set(o, v);
-    mpz_clears(v, p, nd, NULL);
+}
+
+// pow_mod()
+// pow_mod() calculates power mod, using the Montgomery engine for odd n
+void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n) {
+    pow_mod_ws(o, a, d, n, thread_ws());
+}
+
+// pow_mod_ws()
+// pow_mod_ws() is pow_mod() rebuilding the Montgomery context of ws in place for n
+void pow_mod_ws(mpz_t o, mpz_t a, mpz_t d, mpz_t n, workspace_t *ws) {
+    if (!mont_set(&ws->mont, n)) {
+        pow_mod_binary_ws(o, a, d, n, ws);
+        return;
+    }
+    mont_pow(o, a, d, &ws->mont);
+}
+
+// Miller-Rabin rounds that keep the chance of a random candidate of at least bits bits
+// passing while composite below 2^-128, from Damgard, Landrock and Pomerance's bounds
+static const struct {
+    uint64_t bits;
+    uint64_t rounds;
+} round_table[] = { { 3747, 3 }, { 1345, 4 }, { 476, 5 }, { 400, 6 }, { 347, 7 }, { 308, 8 },
+    { 55, 27 }, { 0, 34 } };
+
+// Primes below 100, the Baillie-PSW test trial divides by them first
+#define BPSW_TRIAL 25
+
+// prime_rounds()
+// prime_rounds() returns the Miller-Rabin rounds PRIME_ITERS_AUTO runs on a bits-bit candidate
+uint64_t prime_rounds(uint64_t bits) {
+    uint64_t i = 0;
+    while (bits < round_table[i].bits) {
+        i++;
+    }
+    return round_table[i].rounds;
 }
 
 // is_prime()
-// is_prime() uses Miller Rabin primality test to check if a number is prime or not
+// is_prime() checks if a number is prime or not with the engine in prime_engine
 bool is_prime(mpz_t n, uint64_t iters) {
-    mpz_t r, nminusone, a, y, j, two, bounds;
-    mp_bitcnt_t s = 0;
-    mpz_init_set_ui(r, 0);
-    mpz_init_set_ui(two, 2);
-    mpz_inits(nminusone, a, y, j, bounds, NULL);
-    mpz_set_ui(a, 0);
-    // Get n - 1
-    mpz_sub_ui(nminusone, n, 1);
-    // Checks base cases 0, 1, 3 and they are composite
+    return is_prime_r(n, iters, state);
+}
+
+// strong_round()
+// strong_round() runs one strong probable prime round to base a on odd n with n - 1 = r 2^s
+// y is scratch, and ws->mont holds n when mont is true
+static bool strong_round(mpz_t n, mpz_t a, mpz_t r, mp_bitcnt_t s, mpz_t nminusone, mpz_t y,
+    workspace_t *ws, bool mont) {
+    if (mont) {
+        mont_pow(y, a, r, &ws->mont);
+    } else {
+        pow_mod_binary_ws(y, a, r, n, ws);
+    }
+    if (mpz_cmp_ui(y, 1) == 0 || mpz_cmp(y, nminusone) == 0) {
+        return true;
+    }
+    // Square up to s - 1 times looking for n - 1, reaching 1 first proves n composite
+    for (mp_bitcnt_t j = 1; j < s; j++) {
+        mpz_mul(y, y, y);
+        mpz_mod(y, y, n);
+        if (mpz_cmp(y, nminusone) == 0) {
+            return true;
+        }
+        if (mpz_cmp_ui(y, 1) == 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// miller_rabin()
+// miller_rabin() is the random base test behind is_prime_ws(), adding the rounds it runs to
+// stats when stats is not NULL
+// iters - 1 rounds are run, or prime_rounds() of them for PRIME_ITERS_AUTO
+static bool miller_rabin(
+    mpz_t n, uint64_t iters, gmp_randstate_t rs, workspace_t *ws, prime_stats_t *stats) {
+    mpz_ptr r = ws->prime.r, nminusone = ws->prime.nminusone, a = ws->prime.a;
+    mpz_ptr y = ws->prime.y, bounds = ws->prime.bounds;
+    // Checks base cases 0, 1, 4 and they are composite
     if (mpz_cmp_ui(n, 0) == 0 || mpz_cmp_ui(n, 1) == 0 || mpz_cmp_ui(n, 4) == 0) {
-        mpz_clears(r, nminusone, a, y, j, two, bounds, NULL);
         return false;
     }
 
     // Checks base cases 2, 3 and they are prime
     if (mpz_cmp_ui(n, 2) == 0 || mpz_cmp_ui(n, 3) == 0) {
-        mpz_clears(r, nminusone, a, y, j, two, bounds, NULL);
         return true;
     }
-    // Gets an r value that is odd
-    while (mpz_even_p(r)) {
-        mpz_tdiv_q_2exp(r, nminusone, s);
-        mpz_fdiv_q_ui(r, r, 2);
-        s++;
+    if (mpz_even_p(n)) {
+        return false;
     }
 
-    // Set s - 1 and the random end bounds (n-3);
-    mp_bitcnt_t sminusone = s - 1;
+    // Write n - 1 = r 2^s with r odd
+    mpz_sub_ui(nminusone, n, 1);
+    mp_bitcnt_t s = mpz_scan1(nminusone, 0);
+    mpz_tdiv_q_2exp(r, nminusone, s);
+
+    // The random end bounds (n - 3)
     mpz_sub_ui(bounds, n, 3);
 
-    // Loop until iterations is met
-    for (uint64_t i = 1; i < iters; i++) {
-        // Get a random number a that is between (2 to n - 3);
-        mpz_urandomm(a, state, bounds);
+    // Build the Montgomery context once for every round, in place in the workspace
+    bool mont = mont_set(&ws->mont, n);
+
+    uint64_t rounds = iters == PRIME_ITERS_AUTO ? prime_rounds(mpz_sizeinbase(n, 2)) : iters - 1;
+    for (uint64_t i = 0; i < rounds; i++) {
+        // Get a random number a that is between (2 to n - 2)
+        mpz_urandomm(a, rs, bounds);
         mpz_add_ui(a, a, 2);
-        pow_mod(y, a, r, n);
-        if ((mpz_cmp_ui(y, 1) != 0) && (mpz_cmp(y, nminusone) != 0)) {
-            mpz_set_ui(j, 1); // Set j to 1
-            // Loop until j <= n - 1 and y != n - 1
-            while (mpz_cmp_ui(j, sminusone) <= 0 && mpz_cmp(y, nminusone) != 0) {
-                pow_mod(y, y, two, n);
-                if (mpz_cmp_ui(y, 1) == 0) { // If y = 1
-                    mpz_clears(r, nminusone, a, y, j, two, bounds, NULL);
-                    return false;
-                }
-                mpz_add_ui(j, j, 1); // Add 1 to j
-            }
-            if (mpz_cmp(y, nminusone) != 0) { // If y != n - 1
-                mpz_clears(r, nminusone, a, y, j, two, bounds, NULL);
-                return false;
-            }
+        if (stats != NULL) {
+            stats->rounds++;
+        }
+        if (!strong_round(n, a, r, s, nminusone, y, ws, mont)) {
+            return false;
         }
     }
-    mpz_clears(r, nminusone, a, y, j, two, bounds, NULL);
     return true;
 }
 
-// make_prime()
-// make_prime() makes a prime number
-void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
+// halve_mod()
+// halve_mod() sets x to x / 2 mod odd n
+static void halve_mod(mpz_t x, mpz_t n) {
+    mpz_mod(x, x, n);
+    if (mpz_odd_p(x)) {
+        mpz_add(x, x, n);
+    }
+    mpz_tdiv_q_2exp(x, x, 1);
+}
+
+// strong_lucas()
+// strong_lucas() runs the strong Lucas probable prime test on odd n > 1 that no prime below
+// 100 divides, with Selfridge's parameters: the first D in 5, -7, 9, -11, ... with a Jacobi
+// symbol (D/n) of -1, P = 1 and Q = (1 - D) / 4
+static bool strong_lucas(mpz_t n, workspace_t *ws) {
+    mpz_ptr u = ws->lucas.u, v = ws->lucas.v, qk = ws->lucas.qk, d = ws->lucas.d;
+    mpz_ptr t = ws->lucas.t;
+    long D = 5;
+    while (true) {
+        int j = mpz_si_kronecker(D, n);
+        if (j == -1) {
+            break;
+        }
+        // D shares a factor with n, which is larger than any D tried
+        if (j == 0) {
+            return false;
+        }
+        // Squares never give -1 and would search forever, so check once the search runs long
+        if (D == 13 && mpz_perfect_square_p(n)) {
+            return false;
+        }
+        D = D > 0 ? -(D + 2) : -(D - 2);
+    }
+    long Q = (1 - D) / 4;
+
+    // Write n + 1 = d 2^s with d odd
+    mpz_add_ui(d, n, 1);
+    mp_bitcnt_t s = mpz_scan1(d, 0);
+    mpz_tdiv_q_2exp(d, d, s);
+
+    // Start from U_1 = 1, V_1 = P and Q^1, then walk the bits of d below the top one
+    mpz_set_ui(u, 1);
+    mpz_set_ui(v, 1);
+    mpz_set_si(qk, Q);
+    mpz_mod(qk, qk, n);
+    for (mp_bitcnt_t b = mpz_sizeinbase(d, 2) - 1; b-- > 0;) {
+        // U_2k = U_k V_k and V_2k = V_k^2 - 2 Q^k
+        mpz_mul(u, u, v);
+        mpz_mod(u, u, n);
+        mpz_mul(v, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+        if (mpz_tstbit(d, b)) {
+            // U_k+1 = (P U_k + V_k) / 2 and V_k+1 = (D U_k + P V_k) / 2
+            mpz_mul_si(t, u, D);
+            mpz_add(u, u, v);
+            halve_mod(u, n);
+            mpz_add(v, v, t);
+            halve_mod(v, n);
+            mpz_mul_si(qk, qk, Q);
+            mpz_mod(qk, qk, n);
+        }
+    }
+    if (mpz_sgn(u) == 0 || mpz_sgn(v) == 0) {
+        return true;
+    }
+    // V_d2^r = 0 for some 0 < r < s
+    for (mp_bitcnt_t r = 1; r < s; r++) {
+        mpz_mul(v, v, v);
+        mpz_submul_ui(v, qk, 2);
+        mpz_mod(v, v, n);
+        if (mpz_sgn(v) == 0) {
+            return true;
+        }
+        mpz_mul(qk, qk, qk);
+        mpz_mod(qk, qk, n);
+    }
+    return false;
+}
+
+// bpsw()
+// bpsw() is the Baillie-PSW test behind is_prime_bpsw_ws(), a strong round to base 2 then a
+// strong Lucas test, counting both in stats when stats is not NULL
+// It draws no random numbers and has no known counterexample
+static bool bpsw(mpz_t n, workspace_t *ws, prime_stats_t *stats) {
+    mpz_ptr r = ws->prime.r, nminusone = ws->prime.nminusone, a = ws->prime.a;
+    mpz_ptr y = ws->prime.y;
+    if (mpz_cmp_ui(n, 2) < 0) {
+        return false;
+    }
+    for (uint64_t i = 0; i < BPSW_TRIAL; i++) {
+        uint64_t sp = i == 0 ? 2 : small_primes[i - 1];
+        if (mpz_cmp_ui(n, sp) == 0) {
+            return true;
+        }
+        if (mpz_divisible_ui_p(n, sp)) {
+            return false;
+        }
+    }
+
+    mpz_sub_ui(nminusone, n, 1);
+    mp_bitcnt_t s = mpz_scan1(nminusone, 0);
+    mpz_tdiv_q_2exp(r, nminusone, s);
+    mpz_set_ui(a, 2);
+    if (stats != NULL) {
+        stats->rounds++;
+    }
+    if (!strong_round(n, a, r, s, nminusone, y, ws, mont_set(&ws->mont, n))) {
+        return false;
+    }
+    if (stats != NULL) {
+        stats->lucas++;
+    }
+    return strong_lucas(n, ws);
+}
+
+// probable_prime()
+// probable_prime() tests n with the engine in prime_engine
+static bool probable_prime(
+    mpz_t n, uint64_t iters, gmp_randstate_t rs, workspace_t *ws, prime_stats_t *stats) {
+    if (prime_engine == PRIME_BPSW) {
+        return bpsw(n, ws, stats);
+    }
+    return miller_rabin(n, iters, rs, ws, stats);
+}
+
+// is_prime_r()
+// is_prime_r() is is_prime() drawing its random bases from rs instead of the global state
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t rs) {
+    return probable_prime(n, iters, rs, thread_ws(), NULL);
+}
+
+// is_prime_ws()
+// is_prime_ws() is is_prime_r() using ws, so testing many candidates of one size allocates
+// nothing after the first
+bool is_prime_ws(mpz_t n, uint64_t iters, gmp_randstate_t rs, workspace_t *ws) {
+    return probable_prime(n, iters, rs, ws, NULL);
+}
+
+// is_prime_bpsw()
+// is_prime_bpsw() runs the Baillie-PSW test whatever prime_engine says
+bool is_prime_bpsw(mpz_t n) {
+    return bpsw(n, thread_ws(), NULL);
+}
+
+// is_prime_bpsw_ws()
+// is_prime_bpsw_ws() is is_prime_bpsw() using ws
+bool is_prime_bpsw_ws(mpz_t n, workspace_t *ws) {
+    return bpsw(n, ws, NULL);
+}
+
+// is_prime_mr()
+// is_prime_mr() runs iters Miller-Rabin rounds whatever prime_engine says
+bool is_prime_mr(mpz_t n, uint64_t iters) {
+    return miller_rabin(n, iters, state, thread_ws(), NULL);
+}
+
+// make_prime_draw()
+// make_prime_draw() makes a prime number by drawing fresh random numbers, used for tiny sizes
+static void make_prime_draw(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rs,
+    workspace_t *ws, prime_stats_t *stats) {
     mp_bitcnt_t b = bits;
     while (true) {
-        mpz_urandomb(p, state, b);
+        mpz_urandomb(p, rs, b);
         if (bits == 1) {
             mpz_add_ui(p, p, 1);
         }
-        if (is_prime(p, iters)) {
+        stats->tested++;
+        if (probable_prime(p, iters, rs, ws, stats)) {
             return;
         }
     }
 }
+
+// random_start()
+// random_start() draws a random odd bits-bit start with the top two bits set, so a product
+// of two such primes has exactly the sum of their sizes in bits
+static void random_start(mpz_t start, uint64_t bits, gmp_randstate_t rs) {
+    mpz_urandomb(start, rs, bits);
+    mpz_setbit(start, bits - 1);
+    mpz_setbit(start, bits - 2);
+    mpz_setbit(start, 0);
+}
+
+// sieve_window()
+// sieve_window() looks for a prime p among start, start + 2, ... start + 2 * (SIEVE_WINDOW - 1)
+// The window is sieved against small_primes and only the survivors are tested, all in ws
+// Returns false if there is none, or the candidates outgrow bits first
+static bool sieve_window(mpz_t p, mpz_t start, uint64_t bits, uint64_t iters, gmp_randstate_t rs,
+    uint8_t *marked, workspace_t *ws, prime_stats_t *stats) {
+    // Candidate i is start + 2i, mark the ones a small prime divides
+    memset(marked, 0, SIEVE_WINDOW);
+    for (uint64_t s = 0; s < SMALL_PRIMES; s++) {
+        uint64_t sp = small_primes[s];
+        uint64_t r = mpz_fdiv_ui(start, sp);
+        // First i with r + 2i = 0 (mod sp), (sp + 1) / 2 is the inverse of 2
+        uint64_t i = ((sp - r) % sp) * ((sp + 1) / 2) % sp;
+        for (; i < SIEVE_WINDOW; i += sp) {
+            marked[i] = 1;
+        }
+    }
+
+    for (uint64_t i = 0; i < SIEVE_WINDOW; i++) {
+        if (marked[i]) {
+            stats->sieved++;
+            continue;
+        }
+        mpz_add_ui(p, start, 2 * i);
+        if (mpz_sizeinbase(p, 2) != bits) {
+            return false;
+        }
+        stats->tested++;
+        if (probable_prime(p, iters, rs, ws, stats)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// find_prime()
+// find_prime() is make_prime() drawing from rs and counting into stats
+// It draws one random start and walks start, start + 2, ... one sieve window at a time
+static void find_prime(
+    mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rs, prime_stats_t *stats) {
+    // Every candidate is tested in the same workspace
+    workspace_t ws;
+    ws_init(&ws, bits);
+    if (bits <= SIEVE_MIN_BITS) {
+        make_prime_draw(p, bits, iters, rs, &ws, stats);
+        ws_clear(&ws);
+        return;
+    }
+
+    mpz_t start;
+    mpz_init(start);
+    uint8_t *marked = (uint8_t *) malloc(SIEVE_WINDOW);
+
+    while (true) {
+        random_start(start, bits, rs);
+
+        // Walk windows until the candidates outgrow bits, then start over
+        while (mpz_sizeinbase(start, 2) == bits) {
+            if (sieve_window(p, start, bits, iters, rs, marked, &ws, stats)) {
+                free(marked);
+                mpz_clear(start);
+                ws_clear(&ws);
+                return;
+            }
+            mpz_add_ui(start, start, 2 * SIEVE_WINDOW);
+        }
+    }
+}
+
+// make_prime()
+// make_prime() makes a prime number
+void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
+    find_prime(p, bits, iters, state, &prime_stats);
+}
+
+// make_prime_r()
+// make_prime_r() is make_prime() drawing from rs instead of the global state, so threads with
+// their own states can search at once, its candidates aren't counted in prime_stats
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rs) {
+    prime_stats_t stats = { 0, 0, 0, 0 };
+    find_prime(p, bits, iters, rs, &stats);
+}
+
+// search_t
+// search_t is the shared state of make_prime_pair()
+// Attempt a for prime k is task 2a + k. An attempt draws its own random start from a state
+// derived from (seed, task) and sieves one window. best[k] is the lowest attempt that found
+// a prime, so the result doesn't depend on how many threads ran or how they were scheduled.
+typedef struct {
+    mpz_ptr primes[2];
+    uint64_t bits[2];
+    uint64_t iters;
+    uint64_t seed;
+    atomic_uint_fast64_t next; // Next task to hand out
+    atomic_uint_fast64_t best[2]; // Lowest successful attempt, UINT64_MAX until found
+    pthread_mutex_t lock; // Guards primes and prime_stats
+} search_t;
+
+// search_worker()
+// search_worker() runs attempts until every remaining task is past both best attempts
+static void search_worker(void *arg, uint64_t index, uint64_t worker) {
+    search_t *search = (search_t *) arg;
+    mpz_t start, p;
+    mpz_inits(start, p, NULL);
+    uint8_t *marked = (uint8_t *) malloc(SIEVE_WINDOW);
+    workspace_t ws;
+    ws_init(&ws, search->bits[0] > search->bits[1] ? search->bits[0] : search->bits[1]);
+    (void) index;
+    (void) worker;
+
+    while (true) {
+        uint64_t task = atomic_fetch_add(&search->next, 1);
+        uint64_t k = task % 2;
+        uint64_t attempt = task / 2;
+        if (attempt > atomic_load(&search->best[0]) && attempt > atomic_load(&search->best[1])) {
+            break;
+        }
+        // Cancelled, a lower attempt already found this prime
+        if (attempt > atomic_load(&search->best[k])) {
+            continue;
+        }
+
+        gmp_randstate_t rs;
+        randstate_derive(rs, search->seed, task);
+        prime_stats_t stats = { 0, 0, 0, 0 };
+        bool found = true;
+        if (search->bits[k] <= SIEVE_MIN_BITS) {
+            make_prime_draw(p, search->bits[k], search->iters, rs, &ws, &stats);
+        } else {
+            random_start(start, search->bits[k], rs);
+            found
+                = sieve_window(p, start, search->bits[k], search->iters, rs, marked, &ws, &stats);
+        }
+        gmp_randclear(rs);
+
+        pthread_mutex_lock(&search->lock);
+        prime_stats.sieved += stats.sieved;
+        prime_stats.tested += stats.tested;
+        prime_stats.rounds += stats.rounds;
+        prime_stats.lucas += stats.lucas;
+        if (found && attempt < atomic_load(&search->best[k])) {
+            atomic_store(&search->best[k], attempt);
+            mpz_set(search->primes[k], p);
+        }
+        pthread_mutex_unlock(&search->lock);
+    }
+
+    free(marked);
+    ws_clear(&ws);
+    mpz_clears(start, p, NULL);
+}
+
+// make_prime_pair()
+// make_prime_pair() makes a pbits-bit prime p and a qbits-bit prime q at the same time,
+// with threads workers testing attempts speculatively
+// The primes depend only on seed, never on threads
+void make_prime_pair(mpz_t p, uint64_t pbits, mpz_t q, uint64_t qbits, uint64_t iters,
+    uint64_t threads, uint64_t seed) {
+    search_t search;
+    search.primes[0] = p;
+    search.primes[1] = q;
+    search.bits[0] = pbits;
+    search.bits[1] = qbits;
+    search.iters = iters;
+    search.seed = seed;
+    atomic_init(&search.next, 0);
+    atomic_init(&search.best[0], UINT64_MAX);
+    atomic_init(&search.best[1], UINT64_MAX);
+    pthread_mutex_init(&search.lock, NULL);
+
+    // Every worker runs search_worker() once and pulls tasks until the search is done
+    pool_t *pool = pool_create(threads);
+    pool_run(pool, pool_threads(pool), 1, search_worker, &search);
+    pool_destroy(pool);
+    pthread_mutex_destroy(&search.lock);
+}
@@ -4,13 +4,116 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include "mont.h"
+
+// Counters for make_prime(), candidates removed by the small prime sieve, candidates
+// sent to is_prime(), the Miller-Rabin rounds those ran and the Lucas tests of Baillie-PSW
+typedef struct {
+    uint64_t sieved;
+    uint64_t tested;
+    uint64_t rounds;
+    uint64_t lucas;
+} prime_stats_t;
+
+extern prime_stats_t prime_stats;
+
+// Primality engines for is_prime() and the prime search
+// PRIME_MR runs random base Miller-Rabin rounds, PRIME_BPSW the Baillie-PSW test: one strong
+// round to base 2 and a strong Lucas test, ignoring iters
+typedef enum { PRIME_MR, PRIME_BPSW } prime_engine_t;
+
+extern prime_engine_t prime_engine;
+
+// iters value that picks the Miller-Rabin rounds from the size of the candidate
+#define PRIME_ITERS_AUTO 0
+
+// Scratch integers and a Montgomery context for the _ws variants, so a caller that repeats an
+// operation allocates nothing once the workspace has grown to the modulus size
+// Every function has its own named temporaries, so one calling another can't overwrite the
+// values it is holding, a workspace is not shared between threads
+typedef struct {
+    mpz_t t, na, nb;
+} ws_gcd_t;
+
+typedef struct {
+    mpz_t r, rr, t, tt, q, temp, temp2;
+} ws_inverse_t;
+
+typedef struct {
+    mpz_t v, nd, p;
+} ws_pow_t;
+
+// Miller-Rabin and the strong round to base 2 of Baillie-PSW
+typedef struct {
+    mpz_t r, nminusone, a, y, bounds;
+} ws_prime_t;
+
+typedef struct {
+    mpz_t u, v, qk, d, t;
+} ws_lucas_t;
+
+// rsa.c, the private exponent, the CRT exponentiations and signature checks
+typedef struct {
+    mpz_t phi, pm1, qm1;
+} ws_priv_t;
+
+typedef struct {
+    mpz_t m1, m2, h;
+} ws_crt_t;
+
+typedef struct {
+    mpz_t m;
+} ws_verify_t;
+
+typedef struct {
+    ws_gcd_t gcd; // gcd_ws()
+    ws_inverse_t inverse; // mod_inverse_ws()
+    ws_pow_t pow; // pow_mod_binary_ws()
+    ws_prime_t prime; // is_prime_ws() and is_prime_bpsw_ws()
+    ws_lucas_t lucas; // The strong Lucas test of is_prime_bpsw_ws()
+    ws_priv_t priv; // rsa_make_priv_ws()
+    ws_crt_t crt; // The CRT decrypts of rsa.c
+    ws_verify_t verify; // rsa_verify_ws()
+    mont_t mont;
+} workspace_t;
+
+void ws_init(workspace_t *ws, uint64_t bits);
+
+void ws_clear(workspace_t *ws);
 
 void gcd(mpz_t g, mpz_t a, mpz_t b);
 
+void gcd_ws(mpz_t g, mpz_t a, mpz_t b, workspace_t *ws);
+
 void mod_inverse(mpz_t o, mpz_t a, mpz_t n);
 
+void mod_inverse_ws(mpz_t o, mpz_t a, mpz_t n, workspace_t *ws);
+
+void pow_mod_binary(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
+
+void pow_mod_binary_ws(mpz_t o, mpz_t a, mpz_t d, mpz_t n, workspace_t *ws);
+
 void pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n);
 
+void pow_mod_ws(mpz_t o, mpz_t a, mpz_t d, mpz_t n, workspace_t *ws);
+
 bool is_prime(mpz_t n, uint64_t iters);
 
+bool is_prime_r(mpz_t n, uint64_t iters, gmp_randstate_t rs);
+
+bool is_prime_ws(mpz_t n, uint64_t iters, gmp_randstate_t rs, workspace_t *ws);
+
+bool is_prime_bpsw(mpz_t n);
+
+bool is_prime_bpsw_ws(mpz_t n, workspace_t *ws);
+
+bool is_prime_mr(mpz_t n, uint64_t iters);
+
+uint64_t prime_rounds(uint64_t bits);
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+void make_prime_r(mpz_t p, uint64_t bits, uint64_t iters, gmp_randstate_t rs);
+
+void make_prime_pair(mpz_t p, uint64_t pbits, mpz_t q, uint64_t qbits, uint64_t iters,
+    uint64_t threads, uint64_t seed);
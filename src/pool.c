@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include "pool.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Each worker owns a contiguous run of chunks [head, tail). It takes chunks from the
+// front of its own run and, once that is empty, steals from the front of the others.
+typedef struct {
+    atomic_uint_fast64_t head;
+    uint64_t tail;
+} run_t;
+
+struct pool {
+    uint64_t threads;
+    pthread_t *tids;
+    run_t *runs;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation; // Bumped by pool_run() to wake the workers
+    uint64_t busy; // Workers still inside the current job
+    bool quit;
+
+    // The current job
+    uint64_t count;
+    uint64_t chunk;
+    pool_fn fn;
+    void *arg;
+};
+
+typedef struct {
+    pool_t *pool;
+    uint64_t worker;
+} worker_arg_t;
+
+// take()
+// take() claims the next chunk from run v, returns false if it is empty
+static bool take(pool_t *pool, uint64_t v, uint64_t *c) {
+    run_t *run = &pool->runs[v];
+    if (atomic_load(&run->head) >= run->tail) {
+        return false;
+    }
+    *c = atomic_fetch_add(&run->head, 1);
+    return *c < run->tail;
+}
+
+// work()
+// work() runs chunks for one worker until every run is empty
+static void work(pool_t *pool, uint64_t worker) {
+    uint64_t c = 0;
+    for (uint64_t i = 0; i < pool->threads; i++) {
+        // Start with our own run, then walk the others
+        uint64_t v = (worker + i) % pool->threads;
+        while (take(pool, v, &c)) {
+            uint64_t end = (c + 1) * pool->chunk;
+            end = end > pool->count ? pool->count : end;
+            for (uint64_t index = c * pool->chunk; index < end; index++) {
+                pool->fn(pool->arg, index, worker);
+            }
+        }
+    }
+}
+
+// worker_main()
+// worker_main() waits for a job, works on it, and reports back until the pool is destroyed
+static void *worker_main(void *arg) {
+    worker_arg_t *wa = (worker_arg_t *) arg;
+    pool_t *pool = wa->pool;
+    uint64_t seen = 0;
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->quit) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        work(pool, wa->worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(wa);
+    return NULL;
+}
+
+// pool_create()
+// pool_create() starts threads - 1 workers, the thread calling pool_run() is worker 0
+pool_t *pool_create(uint64_t threads) {
+    pool_t *pool = (pool_t *) calloc(1, sizeof(pool_t));
+    pool->threads = threads < 1 ? 1 : threads;
+    pool->tids = (pthread_t *) calloc(pool->threads, sizeof(pthread_t));
+    pool->runs = (run_t *) calloc(pool->threads, sizeof(run_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (uint64_t i = 1; i < pool->threads; i++) {
+        worker_arg_t *wa = (worker_arg_t *) malloc(sizeof(worker_arg_t));
+        wa->pool = pool;
+        wa->worker = i;
+        if (pthread_create(&pool->tids[i], NULL, worker_main, wa) != 0) {
+            // Run with however many workers we managed to start
+            free(wa);
+            pool->threads = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+// pool_threads()
+// pool_threads() returns the number of workers including the caller
+uint64_t pool_threads(pool_t *pool) {
+    return pool->threads;
+}
+
+// pool_run()
+// pool_run() calls fn for every index in [0, count), in chunks of chunk indexes,
+// and returns once all of them are done
+void pool_run(pool_t *pool, uint64_t count, uint64_t chunk, pool_fn fn, void *arg) {
+    if (count == 0) {
+        return;
+    }
+    chunk = chunk < 1 ? 1 : chunk;
+    uint64_t chunks = (count + chunk - 1) / chunk;
+
+    // Deal the chunks out evenly, earlier workers get the remainder
+    uint64_t base = chunks / pool->threads;
+    uint64_t extra = chunks % pool->threads;
+    uint64_t next = 0;
+    for (uint64_t i = 0; i < pool->threads; i++) {
+        atomic_store(&pool->runs[i].head, next);
+        next += base + (i < extra ? 1 : 0);
+        pool->runs[i].tail = next;
+    }
+
+    pool->count = count;
+    pool->chunk = chunk;
+    pool->fn = fn;
+    pool->arg = arg;
+    if (pool->threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = pool->threads - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    work(pool, 0);
+
+    if (pool->threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// pool_destroy()
+// pool_destroy() stops and joins the workers and frees the pool
+void pool_destroy(pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (uint64_t i = 1; i < pool->threads; i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->tids);
+    free(pool->runs);
+    free(pool);
+}
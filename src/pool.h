@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+// Work item callback, index is the item to process and worker is in [0, threads)
+typedef void (*pool_fn)(void *arg, uint64_t index, uint64_t worker);
+
+typedef struct pool pool_t;
+
+pool_t *pool_create(uint64_t threads);
+
+uint64_t pool_threads(pool_t *pool);
+
+void pool_run(pool_t *pool, uint64_t count, uint64_t chunk, pool_fn fn, void *arg);
+
+void pool_destroy(pool_t *pool);
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+#include "primepool.h"
+#include "stats.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+// Command line options
+#define OPTIONS "b:c:d:i:s:t:w:P:vh"
+
+static struct option longopts[] = { { "stats-json", required_argument, NULL, 'J' },
+    { NULL, 0, NULL, 0 } };
+
+// help()
+// Parameters: None
+// Returns: N/A
+// Prints out the program help and info message.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Fills a prime pool that keygen --pool draws p and q from.\n\
+\n\
+USAGE\n\
+   ./primegen [-hv] [-b bits] [-c keys] [-d dir] [-i confidence] [-P engine] [-s seed]\n\
+              [-t threads] [-w seconds] [--stats-json file]\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -v              Display verbose program output, phase timings go to stderr.\n\
+   -b bits         Key size the primes are for, as passed to keygen -b (default: 256).\n\
+   -c keys         Keys worth of primes to keep in the pool (default: 16).\n\
+   -d dir          Pool directory (default: rsa.pool).\n\
+   -i confidence   Miller-Rabin iterations for testing primes (default: 50), auto picks\n\
+                   the rounds for a 2^-128 error bound from the prime size.\n\
+   -P engine       Primality test, mr for Miller-Rabin or bpsw for Baillie-PSW\n\
+                   (default: mr).\n\
+   -s seed         Random seed for testing (default: from /dev/urandom).\n\
+   -t threads      Search for primes in parallel on this many threads.\n\
+   -w seconds      Keep running, topping the pool up again every this many seconds.\n\
+   --stats-json f  Write phase timings and counters as JSON to f.\n");
+    return;
+}
+
+// urandom_seed()
+// urandom_seed() reads a seed from /dev/urandom, falling back on the time and process id
+// Two primegen runs must never share a seed, they would add the same primes to the pool
+static uint64_t urandom_seed(void) {
+    uint64_t seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (f != NULL) {
+        if (fread(&seed, sizeof(seed), 1, f) != 1) {
+            seed ^= (uint64_t) clock();
+        }
+        fclose(f);
+    }
+    return seed;
+}
+
+// certified()
+// certified() checks a new prime with both Baillie-PSW and the Miller-Rabin rounds for its
+// size, whichever engine found it
+static bool certified(mpz_t p) {
+    return is_prime_bpsw(p) && is_prime_mr(p, PRIME_ITERS_AUTO);
+}
+
+// fill()
+// fill() tops the pools for a bits-bit key up to keys keys worth of primes, generating one
+// key's pair of primes at a time so the pools for odd sizes grow together
+// Returns false if a pool can't be opened or written
+static bool fill(const char *dir, uint64_t bits, uint64_t keys, uint64_t iters,
+    uint64_t threads, uint64_t seed, uint64_t *round, uint64_t *rejected) {
+    uint64_t pbits = bits - bits / 2;
+    uint64_t qbits = bits / 2;
+    primepool_t ppool, qpool;
+    if (!primepool_open(&ppool, dir, pbits, true)) {
+        return false;
+    }
+    if (!primepool_open(&qpool, dir, qbits, true)) {
+        primepool_close(&ppool);
+        return false;
+    }
+
+    // Equal halves share one pool that needs two primes per key
+    bool shared = pbits == qbits;
+    uint64_t want = shared ? 2 * keys : keys;
+    mpz_t pair[2];
+    mpz_inits(pair[0], pair[1], NULL);
+    bool ok = true;
+    while (ok && (primepool_count(&ppool) < want || primepool_count(&qpool) < want)) {
+        if (threads > 0) {
+            uint64_t rseed = seed ^ ((*round)++ * 0xD1B54A32D192ED03ULL);
+            make_prime_pair(pair[0], pbits, pair[1], qbits, iters, threads, rseed);
+        } else {
+            make_prime(pair[0], pbits, iters);
+            make_prime(pair[1], qbits, iters);
+        }
+        for (int i = 0; i < 2 && ok; i++) {
+            if (!certified(pair[i])) {
+                *rejected += 1;
+                continue;
+            }
+            ok = primepool_put(i == 0 ? &ppool : &qpool, &pair[i], 1);
+        }
+    }
+    mpz_clears(pair[0], pair[1], NULL);
+    primepool_close(&ppool);
+    primepool_close(&qpool);
+    return ok;
+}
+
+// main()
+// main() takes in command line options and fills the prime pool, once or every -w seconds
+int main(int argc, char **argv) {
+
+    // opt for getopt
+    int opt = 0;
+
+    char *dir = "rsa.pool";
+    bool stats = false;
+    FILE *jsonfile = NULL;
+    uint64_t bits = 256;
+    uint64_t keys = 16;
+    uint64_t iters = 50;
+    uint64_t threads = 0;
+    uint64_t interval = 0; // 0 fills the pool once
+    uint64_t seed = 0;
+    bool seeded = false;
+
+    // gets all command line options
+    while ((opt = getopt_long(argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'h': help(); return 0;
+        case 'v': stats = true; break;
+        case 'b':
+            bits = strtoul(optarg, NULL, 0);
+            if (bits < 2 * PRIMEPOOL_MIN_BITS) {
+                fprintf(stderr, "Error: Pooled keys need at least %d bits.\n",
+                    2 * PRIMEPOOL_MIN_BITS);
+                return 1;
+            }
+            break;
+        case 'c':
+            keys = strtoul(optarg, NULL, 0);
+            if (keys < 1) {
+                fprintf(stderr, "Error: Number of keys is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'd': dir = optarg; break;
+        case 'i':
+            if (strcmp(optarg, "auto") == 0) {
+                iters = PRIME_ITERS_AUTO;
+                break;
+            }
+            iters = strtoul(optarg, NULL, 0);
+            if (iters < 1) {
+                fprintf(stderr, "Error: Number of iterations is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'P':
+            if (strcmp(optarg, "mr") == 0) {
+                prime_engine = PRIME_MR;
+            } else if (strcmp(optarg, "bpsw") == 0) {
+                prime_engine = PRIME_BPSW;
+            } else {
+                fprintf(stderr, "Error: Primality engine must be mr or bpsw.\n");
+                return 1;
+            }
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            seeded = true;
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            if (threads < 1) {
+                fprintf(stderr, "Error: Number of threads is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'w':
+            interval = strtoul(optarg, NULL, 10);
+            if (interval < 1) {
+                fprintf(stderr, "Error: Refill interval is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'J':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open stats file.\n");
+                return 1;
+            }
+            break;
+        default: help(); return 1;
+        }
+    }
+    if (bits < 2 * PRIMEPOOL_MIN_BITS) {
+        fprintf(stderr, "Error: Pooled keys need at least %d bits.\n", 2 * PRIMEPOOL_MIN_BITS);
+        return 1;
+    }
+    if (!seeded) {
+        seed = urandom_seed();
+    }
+    randstate_init(seed);
+
+    uint64_t round = 0;
+    uint64_t rejected = 0;
+    bool ok = true;
+    do {
+        uint64_t start = stats_clock();
+        ok = fill(dir, bits, keys, iters, threads, seed, &round, &rejected);
+        stats_phase(PHASE_KEYGEN, start);
+        if (!ok) {
+            fprintf(stderr, "Error: failed to write prime pool %s.\n", dir);
+            break;
+        }
+        if (interval > 0) {
+            sleep(interval);
+        }
+    } while (interval > 0);
+
+    if (stats) {
+        uint64_t sizes[2] = { bits - bits / 2, bits / 2 };
+        for (int i = 0; i < (sizes[0] == sizes[1] ? 1 : 2); i++) {
+            primepool_t pool;
+            if (primepool_open(&pool, dir, sizes[i], false)) {
+                fprintf(stdout, "%s/%" PRIu64 "%s: %" PRIu64 " primes\n", dir, sizes[i],
+                    PRIMEPOOL_SUFFIX, primepool_count(&pool));
+                primepool_close(&pool);
+            }
+        }
+        fprintf(stdout, "primes rejected = %" PRIu64 "\n", rejected);
+        stats_print(stderr);
+    }
+    if (jsonfile != NULL) {
+        stats_write_json(jsonfile);
+        fclose(jsonfile);
+    }
+    randstate_clear();
+    return ok ? 0 : 1;
+}
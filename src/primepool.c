@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "primepool.h"
+#include "numtheory.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+// Pool file layout, every integer big-endian:
+// magic[4], version, 3 reserved bytes, prime bits (4 bytes), 4 reserved bytes, then the primes
+// as records of (bits + 7) / 8 bytes
+// A record cut short by a crash is ignored and overwritten by the next put
+#define POOL_MAGIC   "\x89RPP"
+#define POOL_VERSION 1
+#define POOL_HEADER  16
+
+// records()
+// records() returns the whole records in the pool, the lock must be held
+static uint64_t records(primepool_t *pool) {
+    struct stat st;
+    if (fstat(pool->fd, &st) != 0 || st.st_size < POOL_HEADER) {
+        return 0;
+    }
+    return (st.st_size - POOL_HEADER) / pool->width;
+}
+
+// check_header()
+// check_header() writes the header of a new, empty pool file or checks the one there, the
+// lock must be held
+static bool check_header(primepool_t *pool) {
+    uint8_t header[POOL_HEADER] = { 0 };
+    ssize_t got = pread(pool->fd, header, POOL_HEADER, 0);
+    if (got == 0) {
+        memcpy(header, POOL_MAGIC, 4);
+        header[4] = POOL_VERSION;
+        for (int i = 0; i < 4; i++) {
+            header[8 + i] = (pool->bits >> (8 * (3 - i))) & 0xFF;
+        }
+        return pwrite(pool->fd, header, POOL_HEADER, 0) == POOL_HEADER;
+    }
+    uint64_t bits = 0;
+    for (int i = 0; i < 4; i++) {
+        bits = (bits << 8) | header[8 + i];
+    }
+    return got == POOL_HEADER && memcmp(header, POOL_MAGIC, 4) == 0
+           && header[4] == POOL_VERSION && bits == pool->bits;
+}
+
+// primepool_open()
+// primepool_open() opens the pool of bits-bit primes in dir, creating the directory and the
+// file readable only by their owner when create is set
+// Returns false if the pool doesn't exist or isn't a pool of bits-bit primes
+bool primepool_open(primepool_t *pool, const char *dir, uint64_t bits, bool create) {
+    if (bits < PRIMEPOOL_MIN_BITS) {
+        return false;
+    }
+    if (create && mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%" PRIu64 "%s", dir, bits, PRIMEPOOL_SUFFIX);
+    pool->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600);
+    pool->bits = bits;
+    pool->width = (bits + 7) / 8;
+    if (pool->fd < 0) {
+        return false;
+    }
+    flock(pool->fd, LOCK_EX);
+    bool ok = check_header(pool);
+    flock(pool->fd, LOCK_UN);
+    if (!ok) {
+        close(pool->fd);
+        pool->fd = -1;
+    }
+    return ok;
+}
+
+// primepool_count()
+// primepool_count() returns the primes left in the pool
+uint64_t primepool_count(primepool_t *pool) {
+    flock(pool->fd, LOCK_EX);
+    uint64_t count = records(pool);
+    flock(pool->fd, LOCK_UN);
+    return count;
+}
+
+// cut()
+// cut() zeros the len bytes of the pool from end and then truncates it to end, synced in
+// between so the primes don't linger in the freed disk blocks
+// Overwriting in place is all a file can do, a copy-on-write filesystem or an SSD may still
+// keep the old blocks
+static bool cut(primepool_t *pool, off_t end, uint64_t len) {
+    uint8_t zero[4096] = { 0 };
+    uint64_t done = 0;
+    while (done < len) {
+        uint64_t chunk = len - done < sizeof(zero) ? len - done : sizeof(zero);
+        ssize_t n = pwrite(pool->fd, zero, chunk, end + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    return done == len && fdatasync(pool->fd) == 0 && ftruncate(pool->fd, end) == 0;
+}
+
+// primepool_put()
+// primepool_put() appends count primes of the pool's size in one write
+// Returns false if the write failed, in which case none of them were added
+bool primepool_put(primepool_t *pool, mpz_t *primes, uint64_t count) {
+    uint64_t len = count * pool->width;
+    uint8_t *buf = (uint8_t *) calloc(len + 1, sizeof(uint8_t));
+    for (uint64_t i = 0; i < count; i++) {
+        // Right-align each prime in its record
+        size_t size = (mpz_sizeinbase(primes[i], 2) + 7) / 8;
+        mpz_export(buf + (i + 1) * pool->width - size, NULL, 1, sizeof(uint8_t), 1, 0, primes[i]);
+    }
+
+    flock(pool->fd, LOCK_EX);
+    off_t end = POOL_HEADER + records(pool) * pool->width;
+    uint64_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(pool->fd, buf + done, len - done, end + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done < len) {
+        // Drop whatever part made it, so the pool holds only whole records
+        if (!cut(pool, end, done)) {
+            done = 0;
+        }
+    }
+    flock(pool->fd, LOCK_UN);
+    memset(buf, 0, len);
+    free(buf);
+    return done == len;
+}
+
+// primepool_take()
+// primepool_take() removes the last prime from the pool and sets p to it
+// Each prime drawn is rechecked with Baillie-PSW, so a damaged pool can't yield a composite,
+// records that fail are dropped
+// Returns false when the pool is empty
+bool primepool_take(primepool_t *pool, mpz_t p) {
+    uint8_t *buf = (uint8_t *) malloc(pool->width);
+    bool found = false;
+    while (!found) {
+        flock(pool->fd, LOCK_EX);
+        uint64_t count = records(pool);
+        off_t last = POOL_HEADER + (count - 1) * pool->width;
+        bool got = count > 0
+                   && pread(pool->fd, buf, pool->width, last) == (ssize_t) pool->width
+                   && cut(pool, last, pool->width);
+        flock(pool->fd, LOCK_UN);
+        if (!got) {
+            break;
+        }
+        mpz_import(p, pool->width, 1, sizeof(uint8_t), 1, 0, buf);
+        found = mpz_sizeinbase(p, 2) == pool->bits && is_prime_bpsw(p);
+    }
+    memset(buf, 0, pool->width);
+    free(buf);
+    return found;
+}
+
+// primepool_close()
+// primepool_close() closes the pool
+void primepool_close(primepool_t *pool) {
+    if (pool->fd >= 0) {
+        close(pool->fd);
+    }
+    pool->fd = -1;
+}
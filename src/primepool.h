@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+// On-disk pool of primes made ahead of time by primegen and drawn by keygen --pool
+// A pool directory holds one file per prime size, <bits>.pool, of fixed-width records behind a
+// short header. Every operation holds an exclusive flock() on the file, so several primegen
+// and keygen processes can share a pool, and drawing a prime truncates it off the end so no
+// prime is ever handed out twice.
+#define PRIMEPOOL_SUFFIX ".pool"
+
+// Smallest prime the pool stores, smaller keys are always generated live
+#define PRIMEPOOL_MIN_BITS 32
+
+typedef struct {
+    int fd;
+    uint64_t bits;
+    uint64_t width; // Bytes per record
+} primepool_t;
+
+bool primepool_open(primepool_t *pool, const char *dir, uint64_t bits, bool create);
+
+uint64_t primepool_count(primepool_t *pool);
+
+bool primepool_put(primepool_t *pool, mpz_t *primes, uint64_t count);
+
+bool primepool_take(primepool_t *pool, mpz_t p);
+
+void primepool_close(primepool_t *pool);
@@ -17,3 +17,16 @@ void randstate_init(uint64_t seed) {
 void randstate_clear(void) {
     gmp_randclear(state);
 }
+
+// randstate_derive()
+// randstate_derive() initializes rs with a seed mixed from seed and stream, so independent
+// workers get independent but reproducible random states
+void randstate_derive(gmp_randstate_t rs, uint64_t seed, uint64_t stream) {
+    // splitmix64 finalizer over both inputs
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL * (stream + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    gmp_randinit_mt(rs);
+    gmp_randseed_ui(rs, z);
+}
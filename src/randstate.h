@@ -8,3 +8,5 @@ extern gmp_randstate_t state;
 void randstate_init(uint64_t seed);
 
 void randstate_clear(void);
+
+void randstate_derive(gmp_randstate_t rs, uint64_t seed, uint64_t stream);
@@ -3,47 +3,330 @@
 #include "randstate.h"
 #include "numtheory.h"
 #include "rsa.h"
+#include "mont.h"
+#include "mbpow.h"
+#include "pool.h"
+#include "aead.h"
+#include "sha256.h"
+#include "stats.h"
+#include "fileio.h"
+#include "primepool.h"
+#include "lz.h"
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <inttypes.h>
 #include <math.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #define BLOCK 1024
 
-// rsa_make_pub()
-// rsa_make_pub() makes the public key
-void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
-    mpz_t nq, np, totient, randexp, res;
-    mpz_inits(np, nq, totient, randexp, res, NULL);
+// Expands x before quoting it, so a macro becomes the string of its value
+#define QUOTE(x)  #x
+#define STRING(x) QUOTE(x)
+
+// Blocks read per worker before a batch is handed to the pool, and blocks per stolen chunk
+#define BATCH 256
+#define CHUNK 8
+
+// Binary ciphertext container, the magic starts with a byte that is never a hex digit
+#define RSA_MAGIC       "\x89RSA"
+#define RSA_VERSION     1
+#define RSA_HEADER_SIZE 20
+
+// Container flags, a hybrid container holds one RSA block wrapping a session key followed by
+// ChaCha20-Poly1305 records of up to HYBRID_RECORD bytes, and a compressed one holds the LZ
+// frames of lz.h in place of the plaintext, either way
+#define RSA_FLAG_HYBRID 0x01
+#define RSA_FLAG_LZ     0x02
+#define HYBRID_RECORD   (64 * 1024)
+#define HYBRID_FINAL    0x80000000u
+
+// The session key is wrapped with EME-PKCS1-v1_5 (RFC 8017): 0x00, 0x02, at least
+// HYBRID_PAD random non-zero bytes, 0x00 and the key, filling every byte below n
+#define HYBRID_PAD 8
+
+// Block index of a hex ciphertext, a sidecar file as hex lines vary in length and a trailer
+// would break older readers. It holds the byte offset of every RSA_INDEX_STRIDE-th line, a
+// range decrypt seeks to the mark below its first block and steps over the rest of the lines.
+// magic[4], version, 3 reserved bytes, stride (4 bytes), plaintext block bytes k (4 bytes),
+// block count (8 bytes), then one 8 byte offset per mark, all big-endian
+#define RSA_INDEX_MAGIC  "\x89RIX"
+#define RSA_INDEX_SIZE   24
+#define RSA_INDEX_STRIDE 64
+
+// totient_exponent()
+// totient_exponent() gets a random nbits-bit e coprime to totient, drawn from rs
+static void totient_exponent(mpz_t e, mpz_t totient, uint64_t nbits, gmp_randstate_t rs) {
+    mpz_t randexp, res;
+    mpz_inits(randexp, res, NULL);
+    workspace_t ws;
+    ws_init(&ws, nbits);
+
+    // Get an e where it is coprime to totient
+    while (mpz_cmp_ui(res, 1) != 0) {
+        mpz_urandomb(randexp, rs, nbits);
+        gcd_ws(res, totient, randexp, &ws);
+    }
+    mpz_set(e, randexp);
+    ws_clear(&ws);
+    mpz_clears(randexp, res, NULL);
+}
+
+// make_exponent()
+// make_exponent() gets a random nbits-bit e coprime to the totient (p-1)(q-1), drawn from rs
+static void make_exponent(mpz_t e, mpz_t p, mpz_t q, uint64_t nbits, gmp_randstate_t rs) {
+    mpz_t nq, np, totient;
+    mpz_inits(np, nq, totient, NULL);
+
+    // Get p-1 and q-1 for totient calculation
+    mpz_sub_ui(np, p, 1);
+    mpz_sub_ui(nq, q, 1);
+    mpz_mul(totient, np, nq);
+    totient_exponent(e, totient, nbits, rs);
+    mpz_clears(np, nq, totient, NULL);
+}
+
+// make_primes()
+// make_primes() finds p and q so that n = p*q has nbits bits, searching on threads workers
+// when threads > 0 and with make_prime() otherwise
+// When fixed is not NULL the primes are retried until fixed is coprime to (p-1)(q-1)
+static void make_primes(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed, mpz_ptr fixed) {
+    mpz_t t, res;
+    mpz_inits(t, res, NULL);
+    uint64_t round = 0;
+    bool done = false;
 
     // Loop until log2(n) = nbits
     // Create random # of bits for p and q, then make prime and n (p*q)
-    do {
+    while (!done) {
         uint64_t pbits = (random() % (nbits / 2)) + (nbits / 4);
         uint64_t qbits = nbits - pbits;
-        make_prime(p, pbits, iters);
-        make_prime(q, qbits, iters);
+        if (threads > 0) {
+            // Each retry searches a fresh set of random streams
+            uint64_t rseed = seed ^ (round++ * 0xD1B54A32D192ED03ULL);
+            make_prime_pair(p, pbits, q, qbits, iters, threads, rseed);
+        } else {
+            make_prime(p, pbits, iters);
+            make_prime(q, qbits, iters);
+        }
+        mpz_mul(n, p, q);
+        done = mpz_sizeinbase(n, 2) == nbits;
+
+        // e has to be invertible mod (p-1)(q-1)
+        if (done && fixed != NULL) {
+            mpz_sub_ui(t, p, 1);
+            gcd(res, t, fixed);
+            done = mpz_cmp_ui(res, 1) == 0;
+            mpz_sub_ui(t, q, 1);
+            gcd(res, t, fixed);
+            done = done && mpz_cmp_ui(res, 1) == 0;
+        }
+        rsa_stats.retries += done ? 0 : 1;
+    }
+    mpz_clears(t, res, NULL);
+}
+
+// rsa_make_pub()
+// rsa_make_pub() makes the public key
+void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters) {
+    make_primes(p, q, n, nbits, iters, 0, 0, NULL);
+    make_exponent(e, p, q, nbits, state);
+    return;
+}
+
+// rsa_make_pub_r()
+// rsa_make_pub_r() is rsa_make_pub() drawing everything from rs instead of the global state,
+// so threads each holding their own state can make keys at the same time
+void rsa_make_pub_r(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    gmp_randstate_t rs) {
+    do {
+        uint64_t pbits = gmp_urandomm_ui(rs, nbits / 2) + nbits / 4;
+        make_prime_r(p, pbits, iters, rs);
+        make_prime_r(q, nbits - pbits, iters, rs);
         mpz_mul(n, p, q);
     } while (mpz_sizeinbase(n, 2) != nbits);
+    make_exponent(e, p, q, nbits, rs);
+}
 
-    // Get p-1 and q-1 for totient calculation
-    mpz_sub_ui(np, p, 1);
-    mpz_sub_ui(nq, q, 1);
-    mpz_mul(totient, np, nq);
+// rsa_make_pub_mt()
+// rsa_make_pub_mt() makes the public key, searching for p and q at the same time on threads
+// workers. The primes depend on seed but not on threads.
+void rsa_make_pub_mt(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed) {
+    make_primes(p, q, n, nbits, iters, threads, seed, NULL);
+    make_exponent(e, p, q, nbits, state);
+    return;
+}
 
-    // Get an e where it is coprime to totient
-    while (mpz_cmp_ui(res, 1) != 0) {
-        mpz_urandomb(randexp, state, nbits);
-        gcd(res, totient, randexp);
+// rsa_make_pub_e()
+// rsa_make_pub_e() makes the public key for the fixed public exponent passed in e, such as
+// 65537. threads and seed work as in rsa_make_pub_mt(), 0 threads searches sequentially.
+void rsa_make_pub_e(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed) {
+    make_primes(p, q, n, nbits, iters, threads, seed, e);
+    return;
+}
+
+// pool_prime()
+// pool_prime() draws a bits-bit prime from the pool in pooldir, dropping any that fixed isn't
+// coprime to p - 1 when fixed is not NULL, returns false once the pool has none left
+static bool pool_prime(mpz_t p, const char *pooldir, uint64_t bits, mpz_ptr fixed) {
+    primepool_t pool;
+    if (!primepool_open(&pool, pooldir, bits, false)) {
+        return false;
+    }
+    mpz_t t, res;
+    mpz_inits(t, res, NULL);
+    bool found = false;
+    while (!found && primepool_take(&pool, p)) {
+        rsa_stats.pooled++;
+        found = true;
+        if (fixed != NULL) {
+            mpz_sub_ui(t, p, 1);
+            gcd(res, t, fixed);
+            found = mpz_cmp_ui(res, 1) == 0;
+        }
+    }
+    primepool_close(&pool);
+    mpz_clears(t, res, NULL);
+    return found;
+}
+
+// live_prime()
+// live_prime() makes a bits-bit prime other than other, with p - 1 coprime to fixed when
+// fixed is not NULL
+static void live_prime(mpz_t p, uint64_t bits, uint64_t iters, mpz_t other, mpz_ptr fixed) {
+    mpz_t t, res;
+    mpz_inits(t, res, NULL);
+    bool done = false;
+    while (!done) {
+        make_prime(p, bits, iters);
+        done = mpz_cmp(p, other) != 0;
+        if (done && fixed != NULL) {
+            mpz_sub_ui(t, p, 1);
+            gcd(res, t, fixed);
+            done = mpz_cmp_ui(res, 1) == 0;
+        }
+    }
+    mpz_clears(t, res, NULL);
+}
+
+// rsa_make_pub_pool()
+// rsa_make_pub_pool() makes the public key from primes drawn from the prime pool in pooldir,
+// so p and q are an even split of nbits
+// e is kept as a fixed public exponent when it is nonzero, a random one is made otherwise
+// A prime the pool can't give is generated live, both as rsa_make_pub_mt() or
+// rsa_make_pub_e() would with threads and seed
+void rsa_make_pub_pool(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed, const char *pooldir) {
+    mpz_ptr fixed = mpz_sgn(e) > 0 ? e : NULL;
+    uint64_t pbits = nbits - nbits / 2;
+    uint64_t qbits = nbits / 2;
+    bool havep = pool_prime(p, pooldir, pbits, fixed);
+    bool haveq = pool_prime(q, pooldir, qbits, fixed);
+    while (havep && haveq && mpz_cmp(p, q) == 0) {
+        haveq = pool_prime(q, pooldir, qbits, fixed);
+    }
+
+    if (!havep && !haveq) {
+        make_primes(p, q, n, nbits, iters, threads, seed, fixed);
+    } else {
+        // The pool primes have their top two bits set like make_prime() ones, so n has nbits
+        if (!havep) {
+            live_prime(p, pbits, iters, q, fixed);
+        }
+        if (!haveq) {
+            live_prime(q, qbits, iters, p, fixed);
+        }
+        mpz_mul(n, p, q);
+    }
+    if (fixed == NULL) {
+        make_exponent(e, p, q, nbits, state);
     }
-    mpz_set(e, randexp);
-    mpz_clears(np, nq, totient, randexp, res, NULL);
     return;
 }
 
+// rsa_extra_init()
+// rsa_extra_init() initializes the extra primes of a key, with none in use
+void rsa_extra_init(rsa_extra_t *x) {
+    x->count = 0;
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_inits(x->r[i], x->d[i], x->t[i], NULL);
+    }
+}
+
+// rsa_extra_clear()
+// rsa_extra_clear() frees the extra primes
+void rsa_extra_clear(rsa_extra_t *x) {
+    for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+        mpz_clears(x->r[i], x->d[i], x->t[i], NULL);
+    }
+    x->count = 0;
+}
+
+// rsa_make_pub_multi()
+// rsa_make_pub_multi() makes the public key of a key with primes primes, p, q and the rest in
+// x, splitting nbits evenly between them
+// e is kept as a fixed public exponent when it is nonzero, a random one is made otherwise
+// threads and seed work as in rsa_make_pub_mt(), each pair of primes is searched together
+void rsa_make_pub_multi(mpz_t p, mpz_t q, rsa_extra_t *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t primes, uint64_t iters, uint64_t threads, uint64_t seed) {
+    mpz_ptr fixed = mpz_sgn(e) > 0 ? e : NULL;
+    mpz_ptr r[RSA_MAX_PRIMES] = { p, q, x->r[0], x->r[1] };
+    uint64_t bits[RSA_MAX_PRIMES];
+    for (uint64_t i = 0; i < primes; i++) {
+        bits[i] = nbits / primes + (i < nbits % primes ? 1 : 0);
+    }
+    x->count = primes - 2;
+
+    mpz_t t, res, totient;
+    mpz_inits(t, res, totient, NULL);
+    uint64_t round = 0;
+    bool done = false;
+    while (!done) {
+        for (uint64_t i = 0; i < primes; i += 2) {
+            if (threads > 0 && i + 1 < primes) {
+                uint64_t rseed = seed ^ (round++ * 0xD1B54A32D192ED03ULL);
+                make_prime_pair(r[i], bits[i], r[i + 1], bits[i + 1], iters, threads, rseed);
+            } else {
+                make_prime(r[i], bits[i], iters);
+                if (i + 1 < primes) {
+                    make_prime(r[i + 1], bits[i + 1], iters);
+                }
+            }
+        }
+
+        // The primes must differ, n must have nbits bits and e has to be invertible mod
+        // every r - 1
+        mpz_set_ui(n, 1);
+        mpz_set_ui(totient, 1);
+        done = true;
+        for (uint64_t i = 0; i < primes; i++) {
+            for (uint64_t j = 0; j < i; j++) {
+                done = done && mpz_cmp(r[i], r[j]) != 0;
+            }
+            mpz_mul(n, n, r[i]);
+            mpz_sub_ui(t, r[i], 1);
+            mpz_mul(totient, totient, t);
+            if (fixed != NULL) {
+                gcd(res, t, fixed);
+                done = done && mpz_cmp_ui(res, 1) == 0;
+            }
+        }
+        done = done && mpz_sizeinbase(n, 2) == nbits;
+        rsa_stats.retries += done ? 0 : 1;
+    }
+    if (fixed == NULL) {
+        totient_exponent(e, totient, nbits, state);
+    }
+    mpz_clears(t, res, totient, NULL);
+}
+
 // rsa_write_pub()
 // rsa_write_pub() writes the public key to a file
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
@@ -52,15 +335,25 @@ void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
 
 // rsa_read_pub()
 // rsa_read_pub() reads the public key from a file
+// username must hold KEY_USER_MAX bytes, a longer name is cut short rather than overrunning it
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile) {
-    gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n%s\n", n, e, s, username);
+    username[0] = '\0';
+    gmp_fscanf(pbfile, "%Zx\n%Zx\n%Zx\n%" STRING(KEY_USER_LEN) "s\n", n, e, s, username);
 }
 
 // rsa_make_priv()
 // rsa_make_priv() makes the private key
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
-    mpz_t n, np, nq;
-    mpz_inits(n, np, nq, NULL);
+    workspace_t ws;
+    ws_init(&ws, 0);
+    rsa_make_priv_ws(d, e, p, q, &ws);
+    ws_clear(&ws);
+}
+
+// rsa_make_priv_ws()
+// rsa_make_priv_ws() is rsa_make_priv() using the temporaries of ws
+void rsa_make_priv_ws(mpz_t d, mpz_t e, mpz_t p, mpz_t q, workspace_t *ws) {
+    mpz_ptr n = ws->priv.phi, np = ws->priv.pm1, nq = ws->priv.qm1;
 
     // Get q-1 and p-1
     mpz_sub_ui(np, p, 1);
@@ -70,8 +363,7 @@ void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q) {
     mpz_mul(n, np, nq);
 
     // Get mod inverse
-    mod_inverse(d, e, n);
-    mpz_clears(n, nq, np, NULL);
+    mod_inverse_ws(d, e, n, ws);
     return;
 }
 
@@ -87,45 +379,645 @@ void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile) {
     gmp_fscanf(pvfile, "%Zx\n%Zx\n", n, d);
 }
 
+// rsa_make_crt()
+// rsa_make_crt() makes the CRT exponents dp = d mod (p-1), dq = d mod (q-1) and qinv = q^-1 mod p
+void rsa_make_crt(mpz_t dp, mpz_t dq, mpz_t qinv, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_t np, nq;
+    mpz_inits(np, nq, NULL);
+
+    // Get p-1 and q-1
+    mpz_sub_ui(np, p, 1);
+    mpz_sub_ui(nq, q, 1);
+
+    // Reduce d by p-1 and q-1
+    mpz_mod(dp, d, np);
+    mpz_mod(dq, d, nq);
+
+    // Get q inverse mod p for recombining
+    mod_inverse(qinv, q, p);
+    mpz_clears(np, nq, NULL);
+    return;
+}
+
+// rsa_write_priv_crt()
+// rsa_write_priv_crt() writes the extended private key (n, d, then the CRT fields) to a file
+void rsa_write_priv_crt(
+    mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, FILE *pvfile) {
+    gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", n, d, p, q, dp, dq, qinv);
+}
+
+// rsa_read_priv_crt()
+// rsa_read_priv_crt() reads in a private key and returns true if it has valid CRT fields
+// Old files with only n and d still load, but return false
+bool rsa_read_priv_crt(
+    mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, FILE *pvfile) {
+    int fields
+        = gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", n, d, p, q, dp, dq, qinv);
+    if (fields != 7) {
+        return false;
+    }
+
+    // Only trust the CRT fields if they actually factor n
+    mpz_t t;
+    mpz_init(t);
+    mpz_mul(t, p, q);
+    bool valid = mpz_cmp(t, n) == 0;
+    mpz_clear(t);
+    return valid;
+}
+
+// rsa_make_priv_multi()
+// rsa_make_priv_multi() makes the private key of a multi-prime key, the inverse of e mod
+// (p-1)(q-1)(r[0]-1)...
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t p, mpz_t q, rsa_extra_t *x) {
+    mpz_t totient, t;
+    mpz_inits(totient, t, NULL);
+    mpz_sub_ui(totient, p, 1);
+    mpz_sub_ui(t, q, 1);
+    mpz_mul(totient, totient, t);
+    for (uint64_t i = 0; i < x->count; i++) {
+        mpz_sub_ui(t, x->r[i], 1);
+        mpz_mul(totient, totient, t);
+    }
+    mod_inverse(d, e, totient);
+    mpz_clears(totient, t, NULL);
+}
+
+// rsa_make_crt_multi()
+// rsa_make_crt_multi() makes the CRT exponent and Garner coefficient of each extra prime,
+// rsa_make_crt() makes the ones for p and q
+void rsa_make_crt_multi(rsa_extra_t *x, mpz_t d, mpz_t p, mpz_t q) {
+    mpz_t prod, t;
+    mpz_inits(prod, t, NULL);
+    mpz_mul(prod, p, q);
+    for (uint64_t i = 0; i < x->count; i++) {
+        mpz_sub_ui(t, x->r[i], 1);
+        mpz_mod(x->d[i], d, t);
+        mpz_mod(t, prod, x->r[i]);
+        mod_inverse(x->t[i], t, x->r[i]);
+        mpz_mul(prod, prod, x->r[i]);
+    }
+    mpz_clears(prod, t, NULL);
+}
+
+// rsa_write_priv_multi()
+// rsa_write_priv_multi() writes the extended private key followed by r, d and t of each extra
+// prime, a two prime key comes out as from rsa_write_priv_crt()
+void rsa_write_priv_multi(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, FILE *pvfile) {
+    rsa_write_priv_crt(n, d, p, q, dp, dq, qinv, pvfile);
+    for (uint64_t i = 0; i < x->count; i++) {
+        gmp_fprintf(pvfile, "%Zx\n%Zx\n%Zx\n", x->r[i], x->d[i], x->t[i]);
+    }
+}
+
+// rsa_read_priv_multi()
+// rsa_read_priv_multi() reads in a private key with any extra primes and returns true if the
+// CRT fields are valid, x->count is 0 for a two prime key
+// rsa_read_priv_crt() still loads a multi-prime key, as n and d only since p q isn't n
+bool rsa_read_priv_multi(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, FILE *pvfile) {
+    x->count = 0;
+    int fields
+        = gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n%Zx\n", n, d, p, q, dp, dq, qinv);
+    if (fields != 7) {
+        return false;
+    }
+    while (x->count < RSA_MAX_PRIMES - 2
+           && gmp_fscanf(pvfile, "%Zx\n%Zx\n%Zx\n", x->r[x->count], x->d[x->count],
+                  x->t[x->count])
+                  == 3) {
+        x->count++;
+    }
+
+    // Only trust the CRT fields if all the primes together factor n
+    mpz_t t;
+    mpz_init(t);
+    mpz_mul(t, p, q);
+    for (uint64_t i = 0; i < x->count; i++) {
+        mpz_mul(t, t, x->r[i]);
+    }
+    bool valid = mpz_cmp(t, n) == 0;
+    mpz_clear(t);
+    if (!valid) {
+        x->count = 0;
+    }
+    return valid;
+}
+
 // rsa_encrypt()
 // rsa_encrypt() encrypts a message using the encryption formula
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n) {
     pow_mod(c, m, e, n);
 }
 
+// ctx_pow_mod()
+// ctx_pow_mod() calculates power mod with a prebuilt Montgomery context,
+// falling back to pow_mod() when mont_init() rejected n
+static void ctx_pow_mod(mpz_t o, mpz_t a, mpz_t d, mpz_t n, mont_t *ctx) {
+    if (ctx->k != 0) {
+        mont_pow(o, a, d, ctx);
+    } else {
+        pow_mod(o, a, d, n);
+    }
+}
+
+// put_be()
+// put_be() stores the low bytes of v big-endian into buf
+static void put_be(uint8_t *buf, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        buf[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+// get_be()
+// get_be() loads a big-endian integer of the given bytes from buf
+static uint64_t get_be(uint8_t *buf, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v = (v << 8) | buf[i];
+    }
+    return v;
+}
+
+// write_header()
+// write_header() writes the binary container header, returns false if the write failed
+// magic[4], version, flags, 2 reserved bytes, block width (4 bytes), block count (8 bytes)
+static bool write_header(writer_t *out, uint8_t flags, uint64_t width, uint64_t count) {
+    uint8_t header[RSA_HEADER_SIZE] = { 0 };
+    memcpy(header, RSA_MAGIC, 4);
+    header[4] = RSA_VERSION;
+    header[5] = flags;
+    put_be(header + 8, width, 4);
+    put_be(header + 12, count, 8);
+    writer_add(out, header, RSA_HEADER_SIZE);
+    return writer_flush(out);
+}
+
+// read_header()
+// read_header() reads the binary container header, returns false if it is malformed
+static bool read_header(reader_t *in, uint8_t *flags, uint64_t *width, uint64_t *count) {
+    uint8_t header[RSA_HEADER_SIZE];
+    if (reader_read(in, header, RSA_HEADER_SIZE) != RSA_HEADER_SIZE
+        || memcmp(header, RSA_MAGIC, 4) != 0 || header[4] != RSA_VERSION) {
+        return false;
+    }
+    *flags = header[5];
+    *width = get_be(header + 8, 4);
+    *count = get_be(header + 12, 8);
+    return true;
+}
+
+// write_index()
+// write_index() writes the block index of count hex lines with the given marks
+static void write_index(
+    FILE *index, uint64_t k, uint64_t count, uint64_t *marks, uint64_t nmarks) {
+    uint8_t header[RSA_INDEX_SIZE] = { 0 };
+    memcpy(header, RSA_INDEX_MAGIC, 4);
+    header[4] = RSA_VERSION;
+    put_be(header + 8, RSA_INDEX_STRIDE, 4);
+    put_be(header + 12, k, 4);
+    put_be(header + 16, count, 8);
+    fwrite(header, sizeof(uint8_t), RSA_INDEX_SIZE, index);
+    uint8_t be[8];
+    for (uint64_t i = 0; i < nmarks; i++) {
+        put_be(be, marks[i], 8);
+        fwrite(be, sizeof(uint8_t), 8, index);
+    }
+    fflush(index);
+}
+
+// read_index()
+// read_index() looks up the last mark at or before block first in the index of a hex
+// ciphertext with k byte blocks, setting its block and byte offset
+// Returns false if the index is malformed or was made for another block size
+static bool read_index(FILE *index, uint64_t k, uint64_t first, uint64_t *block, uint64_t *pos) {
+    uint8_t header[RSA_INDEX_SIZE];
+    if (fseeko(index, 0, SEEK_SET) != 0
+        || fread(header, sizeof(uint8_t), RSA_INDEX_SIZE, index) != RSA_INDEX_SIZE
+        || memcmp(header, RSA_INDEX_MAGIC, 4) != 0 || header[4] != RSA_VERSION
+        || get_be(header + 12, 4) != k) {
+        return false;
+    }
+    uint64_t stride = get_be(header + 8, 4);
+    uint64_t count = get_be(header + 16, 8);
+    if (stride == 0 || count == 0) {
+        return false;
+    }
+    // A range starting past the last block seeks to the last mark and runs out of lines
+    uint64_t marks = (count + stride - 1) / stride;
+    uint64_t mark = first / stride < marks ? first / stride : marks - 1;
+    uint8_t be[8];
+    if (fseeko(index, RSA_INDEX_SIZE + mark * 8, SEEK_SET) != 0
+        || fread(be, sizeof(uint8_t), 8, index) != 8) {
+        return false;
+    }
+    *block = mark * stride;
+    *pos = get_be(be, 8);
+    return true;
+}
+
+// export_fixed()
+// export_fixed() writes x big-endian into exactly width bytes, zero padded on the left
+static void export_fixed(uint8_t *buf, uint64_t width, mpz_t x) {
+    size_t len = mpz_sgn(x) == 0 ? 0 : (mpz_sizeinbase(x, 2) + 7) / 8;
+    memset(buf, 0, width - len);
+    mpz_export(buf + width - len, NULL, 1, sizeof(uint8_t), 1, 0, x);
+}
+
+// encrypt_job_t
+// encrypt_job_t is one batch of plaintext blocks shared with the encrypt workers
+typedef struct {
+    mpz_ptr n, e;
+    uint64_t k; // Bytes per plaintext block
+    uint64_t width; // Bytes per binary ciphertext block, 0 for hex output
+    uint8_t *blocks; // count * k bytes, each block starts with 0xFF
+    uint64_t *lens; // Bytes of each block to import
+    mpz_t *c; // Ciphertext of each block
+    uint8_t *out; // count * width bytes of binary ciphertext
+    uint64_t hexw; // Bytes per hex line, 0 for binary output
+    char *hex; // count * hexw bytes of hex lines
+    size_t *hexlens; // Bytes of each hex line
+    mpz_t *m; // Per worker message
+    mont_t *ctx; // Per worker Montgomery context
+    uint64_t count; // Blocks in the batch
+    uint64_t lanes; // Blocks per pool item, 1 on the scalar path
+    mb_t *mb; // Per worker multi-buffer context when lanes > 1
+    mpz_t *lm; // Per worker lane messages, MB_MAX_LANES each
+} encrypt_job_t;
+
+// format_block()
+// format_block() turns the ciphertext of block i into its binary block or hex line
+static void format_block(encrypt_job_t *job, uint64_t i) {
+    if (job->width > 0) {
+        export_fixed(job->out + i * job->width, job->width, job->c[i]);
+    } else {
+        // Format the hex line here too so the main thread only writes
+        char *line = job->hex + i * job->hexw;
+        mpz_get_str(line, 16, job->c[i]);
+        size_t len = strlen(line);
+        line[len] = '\n';
+        job->hexlens[i] = len + 1;
+    }
+}
+
+// encrypt_block()
+// encrypt_block() encrypts block i of the batch on worker w
+static void encrypt_block(void *arg, uint64_t i, uint64_t w) {
+    encrypt_job_t *job = (encrypt_job_t *) arg;
+    mpz_import(job->m[w], job->lens[i], 1, sizeof(uint8_t), 1, 0, job->blocks + i * job->k);
+    uint64_t start = stats_clock();
+    ctx_pow_mod(job->c[i], job->m[w], job->e, job->n, &job->ctx[w]);
+    stats_block(start);
+    format_block(job, i);
+}
+
+// encrypt_lanes()
+// encrypt_lanes() encrypts group g of job->lanes blocks of the batch on worker w, one block
+// per SIMD lane, a short group at the end of the file goes through encrypt_block()
+static void encrypt_lanes(void *arg, uint64_t g, uint64_t w) {
+    encrypt_job_t *job = (encrypt_job_t *) arg;
+    uint64_t first = g * job->lanes;
+    if (job->count - first < job->lanes) {
+        for (uint64_t i = first; i < job->count; i++) {
+            encrypt_block(arg, i, w);
+        }
+        return;
+    }
+    mpz_t *m = job->lm + w * MB_MAX_LANES;
+    for (uint64_t l = 0; l < job->lanes; l++) {
+        uint64_t i = first + l;
+        mpz_import(m[l], job->lens[i], 1, sizeof(uint8_t), 1, 0, job->blocks + i * job->k);
+    }
+    uint64_t start = stats_clock();
+    mb_pow(&job->mb[w], job->c + first, m, job->lanes, job->e);
+    stats_blocks(start, job->lanes);
+    for (uint64_t l = 0; l < job->lanes; l++) {
+        format_block(job, first + l);
+    }
+}
+
+// plain_read()
+// plain_read() reads the next len bytes to encrypt, from the compressor when there is one
+static size_t plain_read(reader_t *reader, lz_enc_t *lz, uint8_t *buf, size_t len) {
+    return lz != NULL ? lz_read(lz, buf, len) : reader_read(reader, buf, len);
+}
+
+// random_bytes()
+// random_bytes() fills buf from the system random source, returns false if it can't be read
+static bool random_bytes(uint8_t *buf, size_t len) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(fd, buf + got, len - got);
+        if (r <= 0) {
+            close(fd);
+            return false;
+        }
+        got += r;
+    }
+    close(fd);
+    return true;
+}
+
+// pad_session()
+// pad_session() pads the size byte secret into the width byte block of an RSA encryption,
+// see HYBRID_PAD
+// Returns false if no random bytes could be drawn
+static bool pad_session(uint8_t *block, uint64_t width, const uint8_t *secret, size_t size) {
+    uint64_t fill = width - size - 1;
+    block[0] = 0x00;
+    block[1] = 0x02;
+    if (!random_bytes(block + 2, fill - 2)) {
+        return false;
+    }
+    for (uint64_t i = 2; i < fill; i++) {
+        while (block[i] == 0) {
+            if (!random_bytes(block + i, 1)) {
+                return false;
+            }
+        }
+    }
+    block[fill] = 0x00;
+    memcpy(block + fill + 1, secret, size);
+    return true;
+}
+
+// hybrid_nonce()
+// hybrid_nonce() xors the big-endian record index into the last 8 bytes of the base nonce
+static void hybrid_nonce(uint8_t nonce[AEAD_NONCE], uint8_t base[AEAD_NONCE], uint64_t index) {
+    uint8_t be[8];
+    put_be(be, index, 8);
+    memcpy(nonce, base, AEAD_NONCE);
+    for (int i = 0; i < 8; i++) {
+        nonce[AEAD_NONCE - 8 + i] ^= be[i];
+    }
+}
+
+// encrypt_hybrid()
+// encrypt_hybrid() wraps a fresh session key and base nonce in one RSA block and encrypts the
+// file as ChaCha20-Poly1305 records
+// Each record is a 4 byte length with HYBRID_FINAL set on the last record, the ciphertext and
+// the tag. The length is authenticated and the record index is part of the nonce, so records
+// can't be reordered, dropped or cut off without the decrypt failing
+// The records hold the compressed stream when lz is set
+// Returns false if n is too small to wrap the key, e is below RSA_HYBRID_MIN_E, no random
+// key could be drawn or the output couldn't be written
+static bool encrypt_hybrid(reader_t *reader, writer_t *writer, mpz_t n, mpz_t e, lz_enc_t *lz) {
+    uint64_t width = (mpz_sizeinbase(n, 2) + 7) / 8;
+
+    // The wrapped block is the session key and the base nonce, padded to the width of n
+    uint8_t secret[AEAD_KEY + AEAD_NONCE];
+    uint8_t *key = secret;
+    uint8_t *base = secret + AEAD_KEY;
+    if (width < sizeof(secret) + 3 + HYBRID_PAD || mpz_cmp_ui(e, RSA_HYBRID_MIN_E) < 0
+        || !random_bytes(secret, sizeof(secret))) {
+        return false;
+    }
+    uint8_t *wrapped = (uint8_t *) calloc(width, sizeof(uint8_t));
+    if (!pad_session(wrapped, width, secret, sizeof(secret))) {
+        memset(secret, 0, sizeof(secret));
+        free(wrapped);
+        return false;
+    }
+
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    mpz_import(m, width, 1, sizeof(uint8_t), 1, 0, wrapped);
+    uint64_t start = stats_clock();
+    rsa_encrypt(c, m, e, n);
+    stats_block(start);
+    export_fixed(wrapped, width, c);
+    bool ok = write_header(writer, RSA_FLAG_HYBRID | (lz != NULL ? RSA_FLAG_LZ : 0), width, 0);
+    writer_add(writer, wrapped, width);
+
+    // A short read only happens at the end of the input, an exact multiple of the record
+    // size ends with an empty final record
+    uint8_t *in = (uint8_t *) malloc(HYBRID_RECORD);
+    uint8_t *out = (uint8_t *) malloc(HYBRID_RECORD);
+    uint8_t len[4], tag[AEAD_TAG], nonce[AEAD_NONCE];
+    bool final = false;
+    for (uint64_t index = 0; ok && !final; index++) {
+        start = stats_clock();
+        size_t got = plain_read(reader, lz, in, HYBRID_RECORD);
+        stats_phase(PHASE_READ, start);
+        final = got < HYBRID_RECORD;
+        put_be(len, got | (final ? HYBRID_FINAL : 0), 4);
+        hybrid_nonce(nonce, base, index);
+        start = stats_clock();
+        aead_seal(out, tag, in, got, len, sizeof(len), key, nonce);
+        stats_phase(PHASE_COMPUTE, start);
+        start = stats_clock();
+        writer_add(writer, len, sizeof(len));
+        writer_add(writer, out, got);
+        writer_add(writer, tag, AEAD_TAG);
+        ok = writer_flush(writer);
+        stats_phase(PHASE_WRITE, start);
+    }
+
+    // Don't leave the session key lying around
+    memset(secret, 0, sizeof(secret));
+    mpz_set_ui(m, 0);
+    mpz_clears(m, c, NULL);
+    free(wrapped);
+    free(in);
+    free(out);
+    return ok;
+}
+
 // rsa_encrypt_file()
 // rsa_encrypt_file() encrypts a file
 void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e) {
-    mpz_t m, c;
-    mpz_inits(m, c, NULL);
+    rsa_opts_t opts = { 0 };
+    rsa_encrypt_file_opts(infile, outfile, n, e, &opts);
+}
+
+// rsa_encrypt_file_opts()
+// rsa_encrypt_file_opts() encrypts a file, spreading each batch of blocks over opts->threads
+// workers, as hex lines or as the binary container when opts->binary is set
+// The blocks are written in input order so the output is the same for any thread count
+// With opts->hybrid only a session key is RSA encrypted and the data goes through ChaCha20
+// With opts->compress the plaintext is compressed first and flagged in the binary container,
+// which it always goes into as hex lines have no header
+// Hex lines also get their block index written to opts->index when it is set
+// Returns false if the hybrid session key couldn't be made, e is below RSA_HYBRID_MIN_E or
+// outfile couldn't be written
+bool rsa_encrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, rsa_opts_t *opts) {
+    reader_t *reader = reader_open(infile);
+    writer_t *writer = writer_open(outfile);
+    bool ok = rsa_encrypt_stream(reader, writer, n, e, opts);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    return ok && wrote;
+}
+
+// rsa_encrypt_stream()
+// rsa_encrypt_stream() is rsa_encrypt_file_opts() on a reader and writer, which may be
+// over memory, and stops at the first write that fails
+bool rsa_encrypt_stream(reader_t *reader, writer_t *writer, mpz_t n, mpz_t e, rsa_opts_t *opts) {
+    lz_enc_t lz;
+    lz_enc_t *z = NULL;
+    if (opts->compress) {
+        lz_enc_init(&lz, reader);
+        z = &lz;
+    }
+    if (opts->hybrid) {
+        bool ok = encrypt_hybrid(reader, writer, n, e, z);
+        if (z != NULL) {
+            lz_enc_clear(z);
+        }
+        return ok;
+    }
+    bool binary = opts->binary || opts->compress;
+
+    pool_t *pool = pool_create(opts->threads);
+    uint64_t workers = pool_threads(pool);
+    uint64_t batch = workers * BATCH;
 
     // Set j to 1 as the first bit is 0xFF
     uint64_t j = 1;
-    int k = (mpz_sizeinbase(n, 2) - 1) / 8;
+    uint64_t k = (mpz_sizeinbase(n, 2) - 1) / 8;
     uint8_t fbit = 0xFF;
 
-    // Dynamically allocate an array of uint8_t *
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+    // Dynamically allocate the batch of blocks and their ciphertexts
+    encrypt_job_t job = { 0 };
+    job.n = n;
+    job.e = e;
+    job.k = k;
+    job.width = binary ? (mpz_sizeinbase(n, 2) + 7) / 8 : 0;
+    job.out = (uint8_t *) calloc(batch * job.width, sizeof(uint8_t));
+    // A ciphertext has at most as many hex digits as n, plus the newline and terminator
+    job.hexw = binary ? 0 : mpz_sizeinbase(n, 16) + 2;
+    job.hex = (char *) calloc(batch * job.hexw, sizeof(char));
+    job.hexlens = (size_t *) calloc(batch, sizeof(size_t));
+    job.blocks = (uint8_t *) calloc(batch * k, sizeof(uint8_t));
+    job.lens = (uint64_t *) calloc(batch, sizeof(uint64_t));
+    job.c = (mpz_t *) calloc(batch, sizeof(mpz_t));
+    job.m = (mpz_t *) calloc(workers, sizeof(mpz_t));
+    job.ctx = (mont_t *) calloc(workers, sizeof(mont_t));
+    job.mb = (mb_t *) calloc(workers, sizeof(mb_t));
+    job.lm = (mpz_t *) calloc(workers * MB_MAX_LANES, sizeof(mpz_t));
+    for (uint64_t i = 0; i < batch; i++) {
+        mpz_init(job.c[i]);
+    }
+    for (uint64_t i = 0; i < workers * MB_MAX_LANES; i++) {
+        mpz_init(job.lm[i]);
+    }
 
-    // Set first value to 0xFF
-    block[0] = fbit;
+    // The modulus is the same for every block so set up Montgomery once per worker, and the
+    // exponent too so whole groups of blocks can share the SIMD lanes
+    mb_kernel_t kernel = opts->scalar ? MB_SCALAR : mb_best(mpz_sizeinbase(n, 2));
+    job.lanes = mb_lanes(kernel);
+    for (uint64_t w = 0; w < workers; w++) {
+        mpz_init(job.m[w]);
+        if (opts->nctx != NULL) {
+            mont_copy(&job.ctx[w], opts->nctx);
+        } else {
+            mont_init(&job.ctx[w], n);
+        }
+        if (job.lanes > 1 && !mb_init(&job.mb[w], n, kernel)) {
+            job.lanes = 1;
+        }
+    }
+
+    // The binary header goes out with an unknown block count that is patched at the end
+    // when the output can be seeked back to
+    uint64_t total = 0;
+    bool ok = !binary || write_header(writer, z != NULL ? RSA_FLAG_LZ : 0, job.width, 0);
+
+    // Byte offsets of every RSA_INDEX_STRIDE-th hex line when an index is asked for
+    bool indexed = opts->index != NULL && !binary;
+    uint64_t written = 0;
+    uint64_t *marks = NULL;
+    uint64_t nmarks = 0;
+    uint64_t capmarks = 0;
 
-    // Loop until j is less than or equal to 0
-    // read in the infile to get ciphertext
-    // import ciphertext to mpz
-    // encrypt the ciphertext
-    // print the encrypted message to outfile
-    while (j > 0) {
-        j = fread(block + 1, sizeof(uint8_t), k - 1, infile);
-        mpz_import(m, j + 1, 1, sizeof(uint8_t), 1, 0, block);
-        rsa_encrypt(c, m, e, n);
-        gmp_fprintf(outfile, "%Zx\n", c);
+    // Loop until j is less than or equal to 0 or a write fails
+    // read in a batch of blocks from the infile
+    // encrypt the batch across the workers
+    // print the encrypted blocks to outfile in order
+    while (ok && j > 0) {
+        uint64_t count = 0;
+        uint64_t start = stats_clock();
+        while (j > 0 && count < batch) {
+            uint8_t *block = job.blocks + count * k;
+            block[0] = fbit;
+            j = plain_read(reader, z, block + 1, k - 1);
+            job.lens[count++] = j + 1;
+        }
+        stats_phase(PHASE_READ, start);
+        start = stats_clock();
+        job.count = count;
+        if (job.lanes > 1) {
+            uint64_t groups = (count + job.lanes - 1) / job.lanes;
+            pool_run(pool, groups, (CHUNK + job.lanes - 1) / job.lanes, encrypt_lanes, &job);
+        } else {
+            pool_run(pool, count, CHUNK, encrypt_block, &job);
+        }
+        stats_phase(PHASE_COMPUTE, start);
+        start = stats_clock();
+        if (binary) {
+            writer_add(writer, job.out, count * job.width);
+        } else {
+            for (uint64_t i = 0; i < count; i++) {
+                if (indexed && (total + i) % RSA_INDEX_STRIDE == 0) {
+                    if (nmarks == capmarks) {
+                        capmarks = capmarks > 0 ? 2 * capmarks : 1024;
+                        marks = (uint64_t *) realloc(marks, capmarks * sizeof(uint64_t));
+                    }
+                    marks[nmarks++] = written;
+                }
+                written += job.hexlens[i];
+                writer_add(writer, job.hex + i * job.hexw, job.hexlens[i]);
+            }
+        }
+        ok = writer_flush(writer);
+        stats_phase(PHASE_WRITE, start);
+        total += count;
     }
 
-    // Clear mpz_t variables, free array and exit function
-    mpz_clears(m, c, NULL);
-    free(block);
-    return;
+    // Fill in the block count now that it is known, a pipe keeps the 0
+    if (binary) {
+        uint8_t be[8];
+        put_be(be, total, 8);
+        writer_patch(writer, 12, be, 8);
+    }
+    if (indexed) {
+        write_index(opts->index, k, total, marks, nmarks);
+    }
+
+    // Clear mpz_t variables, free arrays and exit function
+    for (uint64_t w = 0; w < workers; w++) {
+        mpz_clear(job.m[w]);
+        mont_clear(&job.ctx[w]);
+        mb_clear(&job.mb[w]);
+    }
+    for (uint64_t i = 0; i < batch; i++) {
+        mpz_clear(job.c[i]);
+    }
+    for (uint64_t i = 0; i < workers * MB_MAX_LANES; i++) {
+        mpz_clear(job.lm[i]);
+    }
+    free(job.blocks);
+    free(job.out);
+    free(job.hex);
+    free(job.hexlens);
+    free(job.lens);
+    free(job.c);
+    free(job.m);
+    free(job.ctx);
+    free(job.mb);
+    free(job.lm);
+    free(marks);
+    pool_destroy(pool);
+    if (z != NULL) {
+        lz_enc_clear(z);
+    }
+    return ok;
 }
 
 // rsa_decrypt()
@@ -134,40 +1026,692 @@ void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n) {
     pow_mod(m, c, d, n);
 }
 
+// garner()
+// garner() folds the residue v mod r into m, which is correct mod the product mp of the primes
+// before r, as m = m + mp * (t * (v - m) mod r) with t the inverse of mp mod r
+// h is scratch and must not alias the other arguments
+static void garner(mpz_t m, mpz_t mp, mpz_t v, mpz_t r, mpz_t t, mpz_t h) {
+    mpz_sub(h, v, m);
+    mpz_mul(h, h, t);
+    mpz_mod(h, h, r);
+    mpz_mul(h, h, mp);
+    mpz_add(m, m, h);
+}
+
+// crt_pow_mod()
+// crt_pow_mod() does the two half-size exponentiations mod p and q with prebuilt contexts
+// and recombines them with Garner's formula m = m2 + q * (qinv * (m1 - m2) mod p)
+// Each extra prime of a multi-prime key in x, NULL for none, is then folded in the same way
+// with its context in xctx, m must not be c
+// The temporaries come from ws so the per-block path doesn't allocate
+static void crt_pow_mod(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, mont_t *pctx, mont_t *qctx, mont_t *xctx, workspace_t *ws) {
+    mpz_ptr m1 = ws->crt.m1, m2 = ws->crt.m2, h = ws->crt.h;
+
+    // m1 = c^dp mod p
+    mpz_mod(h, c, p);
+    ctx_pow_mod(m1, h, dp, p, pctx);
+
+    // m2 = c^dq mod q
+    mpz_mod(h, c, q);
+    ctx_pow_mod(m2, h, dq, q, qctx);
+
+    // m = m2 + q * (qinv * (m1 - m2) mod p)
+    mpz_set(m, m2);
+    garner(m, q, m1, p, qinv, h);
+    if (x == NULL || x->count == 0) {
+        return;
+    }
+
+    // m1 = p q r[0] ... r[i - 1], the modulus m is correct for so far
+    mpz_mul(m1, p, q);
+    for (uint64_t i = 0; i < x->count; i++) {
+        // m2 = c^d[i] mod r[i]
+        mpz_mod(h, c, x->r[i]);
+        ctx_pow_mod(m2, h, x->d[i], x->r[i], &xctx[i]);
+        garner(m, m1, m2, x->r[i], x->t[i], h);
+        mpz_mul(m1, m1, x->r[i]);
+    }
+}
+
+// rsa_decrypt_crt()
+// rsa_decrypt_crt() decrypts a message with two half-size exponentiations mod p and q
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv) {
+    mont_t pctx, qctx;
+    workspace_t ws;
+    mont_init(&pctx, p);
+    mont_init(&qctx, q);
+    ws_init(&ws, 0);
+    crt_pow_mod(m, c, p, q, dp, dq, qinv, NULL, &pctx, &qctx, NULL, &ws);
+    mont_clear(&pctx);
+    mont_clear(&qctx);
+    ws_clear(&ws);
+}
+
+// rsa_decrypt_multi()
+// rsa_decrypt_multi() decrypts a message with one exponentiation mod each prime of a
+// multi-prime key, m must not be c
+void rsa_decrypt_multi(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x) {
+    mont_t pctx, qctx, xctx[RSA_MAX_PRIMES - 2];
+    workspace_t ws;
+    mont_init(&pctx, p);
+    mont_init(&qctx, q);
+    for (uint64_t i = 0; i < x->count; i++) {
+        mont_init(&xctx[i], x->r[i]);
+    }
+    ws_init(&ws, 0);
+    crt_pow_mod(m, c, p, q, dp, dq, qinv, x, &pctx, &qctx, xctx, &ws);
+    mont_clear(&pctx);
+    mont_clear(&qctx);
+    for (uint64_t i = 0; i < x->count; i++) {
+        mont_clear(&xctx[i]);
+    }
+    ws_clear(&ws);
+}
+
+// rsa_encrypt_ctx()
+// rsa_encrypt_ctx() encrypts a message with a Montgomery context prebuilt for n
+void rsa_encrypt_ctx(mpz_t c, mpz_t m, mpz_t e, mpz_t n, mont_t *ctx) {
+    ctx_pow_mod(c, m, e, n, ctx);
+}
+
+// rsa_decrypt_ctx()
+// rsa_decrypt_ctx() decrypts (or signs) a message with a Montgomery context prebuilt for n
+void rsa_decrypt_ctx(mpz_t m, mpz_t c, mpz_t d, mpz_t n, mont_t *ctx) {
+    ctx_pow_mod(m, c, d, n, ctx);
+}
+
+// rsa_decrypt_crt_ctx()
+// rsa_decrypt_crt_ctx() decrypts (or signs) a message using CRT with contexts prebuilt for
+// p and q and the temporaries of ws
+void rsa_decrypt_crt_ctx(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    mont_t *pctx, mont_t *qctx, workspace_t *ws) {
+    crt_pow_mod(m, c, p, q, dp, dq, qinv, NULL, pctx, qctx, NULL, ws);
+}
+
+// rsa_decrypt_multi_ctx()
+// rsa_decrypt_multi_ctx() is rsa_decrypt_crt_ctx() for a multi-prime key, with a context in
+// xctx for each extra prime, m must not be c
+void rsa_decrypt_multi_ctx(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, mont_t *pctx, mont_t *qctx, mont_t *xctx, workspace_t *ws) {
+    crt_pow_mod(m, c, p, q, dp, dq, qinv, x, pctx, qctx, xctx, ws);
+}
+
+// decrypt_job_t
+// decrypt_job_t is one batch of ciphertext blocks shared with the decrypt workers
+// p is NULL when only n and d are available, extra is NULL for a two prime key
+typedef struct {
+    mpz_ptr n, d, p, q, dp, dq, qinv;
+    rsa_extra_t *extra;
+    uint64_t slot; // Bytes reserved for each decrypted block
+    mpz_t *c; // Ciphertext of each block
+    uint8_t *blocks; // count * slot bytes of decrypted blocks
+    size_t *lens; // Bytes exported for each block
+    mpz_t *m; // Per worker message
+    mont_t *nctx, *pctx, *qctx; // Per worker Montgomery contexts
+    mont_t *xctx; // Per worker contexts for the extra primes, RSA_MAX_PRIMES - 2 each
+    workspace_t *ws; // Per worker temporaries
+    uint64_t count; // Blocks in the batch
+    uint64_t lanes; // Blocks per pool item, 1 on the scalar path
+    mb_t *mb; // Per worker multi-buffer contexts for n, or p, q and the extra primes
+    mpz_t *lc; // Per worker lane inputs, MB_MAX_LANES each
+    mpz_t *lr; // Per worker lane results, MB_MAX_LANES for each of RSA_MAX_PRIMES moduli
+    uint64_t drop; // Plaintext bytes still to pass over before the range starts
+    uint64_t want; // Plaintext bytes of the range still to write, UINT64_MAX without a range
+    lz_dec_t *lz; // Decompressor of a compressed container, NULL otherwise
+    writer_t *writer; // Where the decompressor writes
+} decrypt_job_t;
+
+// range_units()
+// range_units() finds the units of per plaintext bytes, blocks or hybrid records, covering the
+// range in opts, sets first to the first of them and returns how many there are
+// Also sets what emit() drops and keeps, without a range that is every unit and every byte
+static uint64_t range_units(decrypt_job_t *job, rsa_opts_t *opts, uint64_t per, uint64_t *first) {
+    *first = 0;
+    job->drop = 0;
+    job->want = UINT64_MAX;
+    if (!opts->range) {
+        return UINT64_MAX;
+    }
+    if (job->lz != NULL) {
+        // Compressed frames don't line up with the plaintext, so every unit is decrypted and
+        // emit() trims the restored plaintext
+        job->drop = opts->offset;
+        job->want = opts->length;
+        return UINT64_MAX;
+    }
+    *first = opts->offset / per;
+    job->drop = opts->offset - *first * per;
+    job->want = opts->length;
+    if (opts->length == 0) {
+        return 0;
+    }
+    return opts->length > UINT64_MAX - per ? UINT64_MAX : (job->drop + opts->length - 1) / per + 1;
+}
+
+// emit()
+// emit() writes the part of len decrypted bytes at buf that falls in the range
+static void emit(writer_t *writer, decrypt_job_t *job, const uint8_t *buf, uint64_t len) {
+    uint64_t skip = len < job->drop ? len : job->drop;
+    job->drop -= skip;
+    len -= skip;
+    len = len < job->want ? len : job->want;
+    job->want -= len;
+    if (len > 0) {
+        writer_add(writer, buf + skip, len);
+    }
+}
+
+// restored()
+// restored() is the decompressor's output, each frame is written out at once as its buffer
+// is reused for the next one. A failed write stays in the writer for the loop to see.
+static void restored(void *arg, const uint8_t *buf, size_t len) {
+    decrypt_job_t *job = (decrypt_job_t *) arg;
+    emit(job->writer, job, buf, len);
+    writer_flush(job->writer);
+}
+
+// plain()
+// plain() passes len decrypted bytes on, through the decompressor when the container is
+// compressed, returns false if the compressed stream is malformed
+static bool plain(writer_t *writer, decrypt_job_t *job, const uint8_t *buf, uint64_t len) {
+    if (job->lz != NULL) {
+        return lz_write(job->lz, buf, len);
+    }
+    emit(writer, job, buf, len);
+    return true;
+}
+
+// decrypt_block()
+// decrypt_block() decrypts block i of the batch on worker w
+static void decrypt_block(void *arg, uint64_t i, uint64_t w) {
+    decrypt_job_t *job = (decrypt_job_t *) arg;
+    uint64_t start = stats_clock();
+    if (job->p != NULL) {
+        crt_pow_mod(job->m[w], job->c[i], job->p, job->q, job->dp, job->dq, job->qinv,
+            job->extra, &job->pctx[w], &job->qctx[w], &job->xctx[w * (RSA_MAX_PRIMES - 2)],
+            &job->ws[w]);
+    } else {
+        ctx_pow_mod(job->m[w], job->c[i], job->d, job->n, &job->nctx[w]);
+    }
+    stats_block(start);
+    // Export block to message
+    mpz_export(job->blocks + i * job->slot, &job->lens[i], 1, sizeof(uint8_t), 1, 0, job->m[w]);
+}
+
+// decrypt_lanes()
+// decrypt_lanes() decrypts group g of job->lanes blocks of the batch on worker w, one block
+// per SIMD lane, a short group at the end of the file goes through decrypt_block()
+// With CRT each prime gets its own multi-buffer exponentiation and every lane is then
+// recombined with Garner's formula as in crt_pow_mod()
+static void decrypt_lanes(void *arg, uint64_t g, uint64_t w) {
+    decrypt_job_t *job = (decrypt_job_t *) arg;
+    uint64_t first = g * job->lanes;
+    if (job->count - first < job->lanes) {
+        for (uint64_t i = first; i < job->count; i++) {
+            decrypt_block(arg, i, w);
+        }
+        return;
+    }
+    mb_t *mb = job->mb + w * RSA_MAX_PRIMES;
+    mpz_t *c = job->lc + w * MB_MAX_LANES;
+    mpz_t *r = job->lr + w * RSA_MAX_PRIMES * MB_MAX_LANES;
+    uint64_t start = stats_clock();
+    if (job->p == NULL) {
+        mb_pow(&mb[0], r, job->c + first, job->lanes, job->d);
+    } else {
+        // r[j][l] = c[l]^d_j mod prime j, for p, q and then the extra primes
+        uint64_t primes = 2 + (job->extra != NULL ? job->extra->count : 0);
+        for (uint64_t j = 0; j < primes; j++) {
+            mpz_ptr prime = j == 0 ? job->p : j == 1 ? job->q : job->extra->r[j - 2];
+            mpz_ptr exp = j == 0 ? job->dp : j == 1 ? job->dq : job->extra->d[j - 2];
+            for (uint64_t l = 0; l < job->lanes; l++) {
+                mpz_mod(c[l], job->c[first + l], prime);
+            }
+            mb_pow(&mb[j], r + j * MB_MAX_LANES, c, job->lanes, exp);
+        }
+        mpz_ptr mp = job->ws[w].crt.m1, h = job->ws[w].crt.h;
+        for (uint64_t l = 0; l < job->lanes; l++) {
+            mpz_set(c[l], r[MB_MAX_LANES + l]);
+            garner(c[l], job->q, r[l], job->p, job->qinv, h);
+            mpz_mul(mp, job->p, job->q);
+            for (uint64_t j = 2; j < primes; j++) {
+                rsa_extra_t *x = job->extra;
+                garner(c[l], mp, r[j * MB_MAX_LANES + l], x->r[j - 2], x->t[j - 2], h);
+                mpz_mul(mp, mp, x->r[j - 2]);
+            }
+            mpz_swap(r[l], c[l]);
+        }
+    }
+    stats_blocks(start, job->lanes);
+    for (uint64_t l = 0; l < job->lanes; l++) {
+        uint64_t i = first + l;
+        mpz_export(job->blocks + i * job->slot, &job->lens[i], 1, sizeof(uint8_t), 1, 0, r[l]);
+    }
+}
+
+// unwrap_session()
+// unwrap_session() decrypts the wrapped block of a hybrid container into the session key and
+// base nonce, returns false if the block doesn't decrypt to one padded as HYBRID_PAD says
+static bool unwrap_session(uint8_t *secret, size_t size, uint8_t *in, uint64_t width,
+    decrypt_job_t *job) {
+    mpz_t m, c;
+    mpz_inits(m, c, NULL);
+    mont_t nctx = { 0 }, pctx = { 0 }, qctx = { 0 }, xctx[RSA_MAX_PRIMES - 2] = { { 0 } };
+    workspace_t ws;
+    ws_init(&ws, 0);
+    mpz_import(c, width, 1, sizeof(uint8_t), 1, 0, in);
+    uint64_t start = stats_clock();
+    if (job->p != NULL) {
+        crt_pow_mod(
+            m, c, job->p, job->q, job->dp, job->dq, job->qinv, job->extra, &pctx, &qctx, xctx, &ws);
+    } else {
+        ctx_pow_mod(m, c, job->d, job->n, &nctx);
+    }
+    stats_block(start);
+
+    // m is below n, so it fits the width, and the zero ending the padding sits right before
+    // the last size bytes
+    uint8_t *block = (uint8_t *) malloc(width);
+    export_fixed(block, width, m);
+    uint64_t fill = width - size - 1;
+    bool ok = width >= size + 3 + HYBRID_PAD && block[0] == 0x00 && block[1] == 0x02
+              && block[fill] == 0x00;
+    for (uint64_t i = 2; ok && i < fill; i++) {
+        ok = block[i] != 0x00;
+    }
+    if (ok) {
+        memcpy(secret, block + fill + 1, size);
+    }
+    memset(block, 0, width);
+    free(block);
+    mpz_set_ui(m, 0);
+    ws_clear(&ws);
+    mpz_clears(m, c, NULL);
+    return ok;
+}
+
+// finish_plain()
+// finish_plain() frees the decompressor of a compressed container, returns ok unless the
+// stream also stopped part way through a frame
+static bool finish_plain(decrypt_job_t *job, bool ok) {
+    if (job->lz != NULL) {
+        ok = ok && lz_dec_finish(job->lz);
+        lz_dec_clear(job->lz);
+        job->lz = NULL;
+    }
+    return ok;
+}
+
+// decrypt_hybrid()
+// decrypt_hybrid() unwraps the session key from the first block of a hybrid container and
+// decrypts the records after it, see encrypt_hybrid()
+// Each record is written only after its tag checks out. Every record but the final one is
+// full, so a range skips straight to the records covering it and stops after them.
+// Returns false on a wrong key, a bad tag, a missing final record, trailing data or a failed
+// write
+static bool decrypt_hybrid(
+    reader_t *reader, writer_t *writer, decrypt_job_t *job, uint64_t width, rsa_opts_t *opts) {
+    uint8_t secret[AEAD_KEY + AEAD_NONCE];
+    uint8_t *key = secret;
+    uint8_t *base = secret + AEAD_KEY;
+    uint64_t size = width > HYBRID_RECORD + AEAD_TAG ? width : HYBRID_RECORD + AEAD_TAG;
+    uint8_t *in = (uint8_t *) malloc(size);
+    uint8_t *out = (uint8_t *) malloc(HYBRID_RECORD);
+    uint8_t len[4], nonce[AEAD_NONCE];
+
+    bool ok = reader_read(reader, in, width) == width
+              && unwrap_session(secret, sizeof(secret), in, width, job);
+    uint64_t first = 0;
+    uint64_t units = range_units(job, opts, HYBRID_RECORD, &first);
+    uint64_t skip = first * (sizeof(len) + HYBRID_RECORD + AEAD_TAG);
+    // A range starting past the end of the file has nothing to decrypt
+    if (ok && reader_skip(reader, skip) != skip) {
+        units = 0;
+    }
+    bool final = false;
+    for (uint64_t index = first; ok && !final && units > 0; index++, units--) {
+        if (reader_read(reader, len, sizeof(len)) != sizeof(len)) {
+            ok = false;
+            break;
+        }
+        final = (get_be(len, 4) & HYBRID_FINAL) != 0;
+        uint64_t l = get_be(len, 4) & ~(uint64_t) HYBRID_FINAL;
+        hybrid_nonce(nonce, base, index);
+        uint64_t start = stats_clock();
+        ok = l <= HYBRID_RECORD && reader_read(reader, in, l + AEAD_TAG) == l + AEAD_TAG;
+        stats_phase(PHASE_READ, start);
+        start = stats_clock();
+        ok = ok && aead_open(out, in, l, in + l, len, sizeof(len), key, nonce);
+        stats_phase(PHASE_COMPUTE, start);
+        if (ok) {
+            start = stats_clock();
+            ok = plain(writer, job, out, l);
+            ok = writer_flush(writer) && ok;
+            stats_phase(PHASE_WRITE, start);
+        }
+    }
+    // Trailing data is only seen when the records ran to the final one
+    ok = ok && (!final || reader_peek(reader) == EOF);
+
+    memset(secret, 0, sizeof(secret));
+    free(in);
+    free(out);
+    return ok;
+}
+
+// decrypt_blocks()
+// decrypt_blocks() is decrypt_file() on a reader and writer
+static bool decrypt_blocks(
+    reader_t *reader, writer_t *writer, decrypt_job_t *job, rsa_opts_t *opts) {
+    bool more = true;
+    bool ok = true;
+
+    // A decrypted block is smaller than n, size the slots from n so a wrong key can't overflow
+    job->slot = (mpz_sizeinbase(job->n, 2) + 7) / 8;
+
+    // Check for the binary container
+    uint64_t width = 0;
+    uint64_t left = 0;
+    int first = reader_peek(reader);
+    if (first == EOF) {
+        return true;
+    }
+    bool binary = first == (uint8_t) RSA_MAGIC[0];
+    uint8_t flags = 0;
+    if (binary && (!read_header(reader, &flags, &width, &left) || width != job->slot
+                      || (flags & ~(RSA_FLAG_HYBRID | RSA_FLAG_LZ)) != 0)) {
+        return false;
+    }
+    // A compressed container is restored on its way to the writer and has to end on a frame
+    lz_dec_t lz;
+    if (flags & RSA_FLAG_LZ) {
+        lz_dec_init(&lz, restored, job);
+        job->lz = &lz;
+        job->writer = writer;
+    }
+    if (flags & RSA_FLAG_HYBRID) {
+        ok = decrypt_hybrid(reader, writer, job, width, opts);
+        return finish_plain(job, ok);
+    }
+    // A count of 0 means the writer couldn't seek back, so read until the end of the file
+    bool counted = left > 0;
+
+    pool_t *pool = pool_create(opts->threads);
+    uint64_t workers = pool_threads(pool);
+    uint64_t batch = workers * BATCH;
+    // Room for a binary block, or a hex line with as many digits again of leading zeros
+    uint64_t cap = binary ? job->slot : 4 * job->slot + 2;
+    uint8_t *in = (uint8_t *) calloc(cap, sizeof(uint8_t));
+
+    // Go straight to the blocks covering a range, the binary blocks are fixed-width and the
+    // hex lines are found from the nearest mark in the index, or from the start without one,
+    // stepping over the lines in between without decrypting them
+    uint64_t k = (mpz_sizeinbase(job->n, 2) - 1) / 8;
+    uint64_t from = 0;
+    uint64_t units = range_units(job, opts, k > 1 ? k - 1 : 1, &from);
+    if (binary) {
+        uint64_t skip = counted && from > left ? left : from;
+        reader_skip(reader, skip * width);
+        left -= counted ? skip : 0;
+    } else if (from > 0) {
+        uint64_t line = 0;
+        uint64_t pos = 0;
+        if (opts->index != NULL) {
+            ok = read_index(opts->index, k, from, &line, &pos) && reader_skip(reader, pos) == pos;
+        }
+        while (ok && line < from) {
+            size_t len = reader_token(reader, (char *) in, cap);
+            if (len == 0) {
+                break;
+            }
+            ok = len < cap;
+            line++;
+        }
+    }
+    more = ok;
+
+    // Dynamically allocate the batch of blocks
+    job->blocks = (uint8_t *) calloc(batch * job->slot, sizeof(uint8_t));
+    job->lens = (size_t *) calloc(batch, sizeof(size_t));
+    job->c = (mpz_t *) calloc(batch, sizeof(mpz_t));
+    job->m = (mpz_t *) calloc(workers, sizeof(mpz_t));
+    job->nctx = (mont_t *) calloc(workers, sizeof(mont_t));
+    job->pctx = (mont_t *) calloc(workers, sizeof(mont_t));
+    job->qctx = (mont_t *) calloc(workers, sizeof(mont_t));
+    job->xctx = (mont_t *) calloc(workers * (RSA_MAX_PRIMES - 2), sizeof(mont_t));
+    job->ws = (workspace_t *) calloc(workers, sizeof(workspace_t));
+    job->mb = (mb_t *) calloc(workers * RSA_MAX_PRIMES, sizeof(mb_t));
+    job->lc = (mpz_t *) calloc(workers * MB_MAX_LANES, sizeof(mpz_t));
+    job->lr = (mpz_t *) calloc(workers * RSA_MAX_PRIMES * MB_MAX_LANES, sizeof(mpz_t));
+    for (uint64_t i = 0; i < batch; i++) {
+        mpz_init(job->c[i]);
+    }
+    for (uint64_t i = 0; i < workers * MB_MAX_LANES; i++) {
+        mpz_init(job->lc[i]);
+    }
+    for (uint64_t i = 0; i < workers * RSA_MAX_PRIMES * MB_MAX_LANES; i++) {
+        mpz_init(job->lr[i]);
+    }
+
+    // Set up Montgomery once per worker for n, or for p, q and any extra primes when
+    // decrypting with CRT
+    for (uint64_t w = 0; w < workers; w++) {
+        for (uint64_t i = 0; job->extra != NULL && i < job->extra->count; i++) {
+            mont_init(&job->xctx[w * (RSA_MAX_PRIMES - 2) + i], job->extra->r[i]);
+        }
+        mpz_init(job->m[w]);
+        ws_init(&job->ws[w], mpz_sizeinbase(job->n, 2));
+        if (job->p != NULL && opts->pctx != NULL) {
+            mont_copy(&job->pctx[w], opts->pctx);
+            mont_copy(&job->qctx[w], opts->qctx);
+        } else if (job->p != NULL) {
+            mont_init(&job->pctx[w], job->p);
+            mont_init(&job->qctx[w], job->q);
+        } else if (opts->nctx != NULL) {
+            mont_copy(&job->nctx[w], opts->nctx);
+        } else {
+            mont_init(&job->nctx[w], job->n);
+        }
+    }
+
+    // Each worker also gets a multi-buffer context per modulus, if any of them can't have one
+    // every block takes the scalar path, the kernel is picked for the largest modulus
+    uint64_t primes = 2 + (job->extra != NULL ? job->extra->count : 0);
+    uint64_t bits = mpz_sizeinbase(job->p != NULL ? job->p : job->n, 2);
+    for (uint64_t i = 1; job->p != NULL && i < primes; i++) {
+        uint64_t b = mpz_sizeinbase(i == 1 ? job->q : job->extra->r[i - 2], 2);
+        bits = b > bits ? b : bits;
+    }
+    mb_kernel_t kernel = opts->scalar ? MB_SCALAR : mb_best(bits);
+    job->lanes = mb_lanes(kernel);
+    for (uint64_t w = 0; w < workers && job->lanes > 1; w++) {
+        mb_t *mb = job->mb + w * RSA_MAX_PRIMES;
+        bool ok = mb_init(&mb[0], job->p != NULL ? job->p : job->n, kernel);
+        for (uint64_t i = 1; ok && job->p != NULL && i < primes; i++) {
+            ok = mb_init(&mb[i], i == 1 ? job->q : job->extra->r[i - 2], kernel);
+        }
+        job->lanes = ok ? job->lanes : 1;
+    }
+
+    // Loop until entire file is scanned
+    // Scan in a batch of encrypted blocks from infile
+    // Decrypt and export the batch across the workers
+    // Write the decoded blocks to outfile in order
+    while (more) {
+        uint64_t count = 0;
+        uint64_t start = stats_clock();
+        if (binary) {
+            while (count < batch && units > 0 && (!counted || left > 0)) {
+                size_t got = reader_read(reader, in, width);
+                if (got != width) {
+                    // Only a clean end of file is allowed, and only when the count is unknown
+                    ok = ok && got == 0 && !counted;
+                    break;
+                }
+                mpz_import(job->c[count++], width, 1, sizeof(uint8_t), 1, 0, in);
+                left -= counted ? 1 : 0;
+                units--;
+            }
+            stats_phase(PHASE_READ, start);
+        } else {
+            while (count < batch && units > 0) {
+                size_t len = reader_token(reader, (char *) in, cap);
+                if (len == 0) {
+                    break;
+                }
+                if (len == cap || mpz_set_str(job->c[count], (char *) in, 16) != 0) {
+                    ok = false;
+                    break;
+                }
+                count++;
+                units--;
+            }
+            stats_phase(PHASE_FORMAT, start);
+        }
+        more = ok && count == batch;
+        start = stats_clock();
+        job->count = count;
+        if (job->lanes > 1) {
+            uint64_t groups = (count + job->lanes - 1) / job->lanes;
+            pool_run(pool, groups, (CHUNK + job->lanes - 1) / job->lanes, decrypt_lanes, job);
+        } else {
+            pool_run(pool, count, CHUNK, decrypt_block, job);
+        }
+        stats_phase(PHASE_COMPUTE, start);
+        start = stats_clock();
+        for (uint64_t i = 0; i < count; i++) {
+            // Skip the 0xFF prefix byte of each block
+            if (ok && job->lens[i] > 0) {
+                ok = plain(writer, job, job->blocks + i * job->slot + 1, job->lens[i] - 1);
+            }
+        }
+        ok = writer_flush(writer) && ok;
+        more = more && ok;
+        stats_phase(PHASE_WRITE, start);
+    }
+
+    // Clear mpz_t variables, free arrays and exit function
+    for (uint64_t w = 0; w < workers; w++) {
+        mpz_clear(job->m[w]);
+        mont_clear(&job->nctx[w]);
+        mont_clear(&job->pctx[w]);
+        mont_clear(&job->qctx[w]);
+        for (int i = 0; i < RSA_MAX_PRIMES - 2; i++) {
+            mont_clear(&job->xctx[w * (RSA_MAX_PRIMES - 2) + i]);
+        }
+        ws_clear(&job->ws[w]);
+    }
+    for (uint64_t i = 0; i < workers * RSA_MAX_PRIMES; i++) {
+        mb_clear(&job->mb[i]);
+    }
+    for (uint64_t i = 0; i < batch; i++) {
+        mpz_clear(job->c[i]);
+    }
+    for (uint64_t i = 0; i < workers * MB_MAX_LANES; i++) {
+        mpz_clear(job->lc[i]);
+    }
+    for (uint64_t i = 0; i < workers * RSA_MAX_PRIMES * MB_MAX_LANES; i++) {
+        mpz_clear(job->lr[i]);
+    }
+    free(in);
+    free(job->blocks);
+    free(job->lens);
+    free(job->c);
+    free(job->m);
+    free(job->nctx);
+    free(job->pctx);
+    free(job->qctx);
+    free(job->xctx);
+    free(job->ws);
+    free(job->mb);
+    free(job->lc);
+    free(job->lr);
+    pool_destroy(pool);
+    return finish_plain(job, ok);
+}
+
+// decrypt_file()
+// decrypt_file() is the block loop shared by the rsa_decrypt_file() variants
+// The input format is detected from the first byte, hex lines never start with RSA_MAGIC
+// Each batch is spread over opts->threads workers and written in input order
+// With opts->range only the blocks covering it are decrypted, see decrypt_blocks()
+// Returns false if the input is malformed or outfile couldn't be written
+static bool decrypt_file(FILE *infile, FILE *outfile, decrypt_job_t *job, rsa_opts_t *opts) {
+    reader_t *reader = reader_open(infile);
+    writer_t *writer = writer_open(outfile);
+    bool ok = decrypt_blocks(reader, writer, job, opts);
+    bool wrote = writer_close(writer);
+    reader_close(reader);
+    return ok && wrote;
+}
+
 // rsa_decrypt_file()
 // rsa_decrypt_file() decrypts an encrypted message
 void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d) {
+    rsa_opts_t opts = { 0 };
+    rsa_decrypt_file_opts(infile, outfile, n, d, &opts);
+}
 
-    // Declare and initialize variables
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
-    uint64_t k = 0;
-    uint64_t bytes = 1;
+// rsa_decrypt_file_opts()
+// rsa_decrypt_file_opts() decrypts an encrypted message with opts->threads workers
+// Returns false if the input is malformed or outfile couldn't be written
+bool rsa_decrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_opts_t *opts) {
+    decrypt_job_t job = { 0 };
+    job.n = n;
+    job.d = d;
+    return decrypt_file(infile, outfile, &job, opts);
+}
 
-    // Calculate k
-    k = (mpz_sizeinbase(n, 2) - 1) / 8;
+// rsa_decrypt_file_crt()
+// rsa_decrypt_file_crt() decrypts an encrypted message using the CRT private key fields
+void rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv) {
+    rsa_opts_t opts = { 0 };
+    rsa_decrypt_file_crt_opts(infile, outfile, n, p, q, dp, dq, qinv, &opts);
+}
 
-    // Dynamically allocate an array of uint8_t *
-    uint8_t *block = (uint8_t *) calloc(k, sizeof(uint8_t));
+// rsa_decrypt_file_crt_opts()
+// rsa_decrypt_file_crt_opts() decrypts an encrypted message using the CRT private key fields
+// and the extra primes in opts->extra of a multi-prime key, with opts->threads workers
+// Returns false if the input is malformed or outfile couldn't be written
+bool rsa_decrypt_file_crt_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv, rsa_opts_t *opts) {
+    decrypt_job_t job = { 0 };
+    job.n = n;
+    job.p = p;
+    job.q = q;
+    job.dp = dp;
+    job.dq = dq;
+    job.qinv = qinv;
+    job.extra = opts->extra;
+    return decrypt_file(infile, outfile, &job, opts);
+}
 
-    // Loop until entire file is scanned
-    // Scan in encrypted message from infile
-    // Decrypt the encoded message
-    // Export to mpz
-    // Write the decoded message to outfile
-    while (!feof(infile)) {
-        bytes = gmp_fscanf(infile, "%Zx\n", c);
-        rsa_decrypt(m, c, d, n); // Decrypt ciphertext
-        // Export block to message
-        mpz_export(block, &bytes, 1, sizeof(uint8_t), 1, 0, m);
-        // Write decrypted message to outfile
-        fwrite((block + 1), sizeof(uint8_t), bytes - 1, outfile);
-    }
-
-    // Clear mpz_t variables, free array and exit function
-    mpz_clears(c, m, NULL);
-    free(block);
-    return;
+// rsa_decrypt_stream()
+// rsa_decrypt_stream() is rsa_decrypt_file_opts() on a reader and writer, which may be
+// over memory
+bool rsa_decrypt_stream(reader_t *reader, writer_t *writer, mpz_t n, mpz_t d, rsa_opts_t *opts) {
+    decrypt_job_t job = { 0 };
+    job.n = n;
+    job.d = d;
+    return decrypt_blocks(reader, writer, &job, opts);
+}
+
+// rsa_decrypt_stream_crt()
+// rsa_decrypt_stream_crt() is rsa_decrypt_file_crt_opts() on a reader and writer
+bool rsa_decrypt_stream_crt(reader_t *reader, writer_t *writer, mpz_t n, mpz_t p, mpz_t q,
+    mpz_t dp, mpz_t dq, mpz_t qinv, rsa_opts_t *opts) {
+    decrypt_job_t job = { 0 };
+    job.n = n;
+    job.p = p;
+    job.q = q;
+    job.dp = dp;
+    job.dq = dq;
+    job.qinv = qinv;
+    job.extra = opts->extra;
+    return decrypt_blocks(reader, writer, &job, opts);
 }
 
 // rsa_sign()
@@ -176,18 +1720,93 @@ void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n) {
     pow_mod(s, m, d, n);
 }
 
+// rsa_sign_crt()
+// rsa_sign_crt() creates the signature using the CRT private key fields
+void rsa_sign_crt(mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv) {
+    rsa_decrypt_crt(s, m, p, q, dp, dq, qinv);
+}
+
+// rsa_sign_multi()
+// rsa_sign_multi() creates the signature using the CRT fields of a multi-prime key
+void rsa_sign_multi(mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x) {
+    rsa_decrypt_multi(s, m, p, q, dp, dq, qinv, x);
+}
+
 // rsa_verify()
 // rsa_verify() verifies the signature in public key
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n) {
-    mpz_t t;
-    mpz_init(t);
+    workspace_t ws;
+    ws_init(&ws, 0);
+    bool valid = rsa_verify_ws(m, s, e, n, &ws);
+    ws_clear(&ws);
+    return valid;
+}
 
-    pow_mod(t, s, e, n);
-    if (mpz_cmp(t, m) == 0) {
-        mpz_clear(t);
-        return true;
-    } else {
-        mpz_clear(t);
+// rsa_verify_ws()
+// rsa_verify_ws() is rsa_verify() using ws, a caller checking many signatures under one n
+// keeps its Montgomery context
+bool rsa_verify_ws(mpz_t m, mpz_t s, mpz_t e, mpz_t n, workspace_t *ws) {
+    mpz_ptr t = ws->verify.m;
+    pow_mod_ws(t, s, e, n, ws);
+    return mpz_cmp(t, m) == 0;
+}
+
+// DER DigestInfo prefix of a SHA-256 digest, RFC 8017 section 9.2 note 1
+static const uint8_t sha256_info[] = { 0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48,
+    0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20 };
+
+// rsa_digest_file()
+// rsa_digest_file() streams infile through SHA-256 in chunks of up to IO_BUFFER bytes, hashed
+// where the reader holds them
+void rsa_digest_file(uint8_t digest[SHA256_DIGEST], FILE *infile) {
+    reader_t *reader = reader_open(infile);
+    sha256_t ctx;
+    sha256_init(&ctx);
+    const uint8_t *data = NULL;
+    size_t got = 0;
+    do {
+        uint64_t start = stats_clock();
+        got = reader_next(reader, &data, IO_BUFFER);
+        stats_phase(PHASE_READ, start);
+        start = stats_clock();
+        sha256_update(&ctx, data, got);
+        stats_phase(PHASE_COMPUTE, start);
+    } while (got > 0);
+    reader_close(reader);
+    sha256_final(&ctx, digest);
+}
+
+// rsa_pad_digest()
+// rsa_pad_digest() encodes a SHA-256 digest for signing under n with EMSA-PKCS1-v1_5,
+// 0x00 0x01 0xFF ... 0xFF 0x00 DigestInfo digest, as wide as n in bytes
+// Returns false if n is too small to hold the encoding with 8 bytes of padding
+bool rsa_pad_digest(mpz_t m, uint8_t digest[SHA256_DIGEST], mpz_t n) {
+    uint64_t k = (mpz_sizeinbase(n, 2) + 7) / 8;
+    uint64_t t = sizeof(sha256_info) + SHA256_DIGEST;
+    if (k < t + 11) {
         return false;
     }
+    uint8_t *em = (uint8_t *) malloc(k);
+    em[0] = 0x00;
+    em[1] = 0x01;
+    memset(em + 2, 0xFF, k - t - 3);
+    em[k - t - 1] = 0x00;
+    memcpy(em + k - t, sha256_info, sizeof(sha256_info));
+    memcpy(em + k - SHA256_DIGEST, digest, SHA256_DIGEST);
+    mpz_import(m, k, 1, sizeof(uint8_t), 1, 0, em);
+    free(em);
+    return true;
+}
+
+// rsa_verify_digest()
+// rsa_verify_digest() checks a signature over a SHA-256 digest by encoding the digest again
+// and comparing it with s^e mod n, rather than parsing what s decrypts to
+bool rsa_verify_digest(uint8_t digest[SHA256_DIGEST], mpz_t s, mpz_t e, mpz_t n) {
+    mpz_t m;
+    mpz_init(m);
+    bool valid = mpz_sgn(s) > 0 && mpz_cmp(s, n) < 0 && rsa_pad_digest(m, digest, n)
+                 && rsa_verify(m, s, e, n);
+    mpz_clear(m);
+    return valid;
 }
@@ -4,27 +4,155 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <gmp.h>
+#include "mont.h"
+#include "mbpow.h"
+#include "numtheory.h"
+#include "sha256.h"
+#include "fileio.h"
+
+// Longest username a public key file can hold, without and with its terminating NUL
+// KEY_USER_LEN is a plain number so rsa_read_pub() can paste it into its scanf width.
+#define KEY_USER_LEN 1023
+#define KEY_USER_MAX (KEY_USER_LEN + 1)
+
+// Smallest public exponent hybrid mode wraps a session key under, a small e leaves too little
+// between the padded key and a plain integer root of its encryption
+#define RSA_HYBRID_MIN_E 65537
+
+// Most primes a multi-prime key can have, more stop paying off below 4096 bits
+#define RSA_MAX_PRIMES 4
+
+// The primes of a multi-prime key past p and q, as in the RFC 8017 otherPrimeInfos
+// Each r[i] comes with its CRT exponent d[i] = d mod (r[i] - 1) and Garner coefficient t[i],
+// the inverse of p q r[0] ... r[i - 1] mod r[i]. count is 0 for a two prime key.
+typedef struct {
+    uint64_t count;
+    mpz_t r[RSA_MAX_PRIMES - 2];
+    mpz_t d[RSA_MAX_PRIMES - 2];
+    mpz_t t[RSA_MAX_PRIMES - 2];
+} rsa_extra_t;
+
+// Options for the file loops, a zeroed struct gives the defaults
+typedef struct {
+    uint64_t threads; // Worker threads, 0 or 1 runs on the calling thread
+    bool binary; // Encrypt to the binary container instead of hex lines
+    bool hybrid; // Encrypt with a session key wrapped in the binary container
+    mont_t *nctx; // Prebuilt contexts for n, p and q copied to each worker, NULL builds them
+    mont_t *pctx;
+    mont_t *qctx;
+    rsa_extra_t *extra; // Primes past p and q for the CRT loops, NULL for a two prime key
+    bool scalar; // Exponentiate one block at a time even when mb_best() has a SIMD kernel
+    FILE *index; // Block index of hex lines, written by encrypt and used by a range decrypt
+    bool range; // Decrypt only the length plaintext bytes starting at offset
+    uint64_t offset;
+    uint64_t length;
+    bool compress; // Run the plaintext through the LZ stage of lz.h, always in the container
+} rsa_opts_t;
+
+void rsa_extra_init(rsa_extra_t *x);
+
+void rsa_extra_clear(rsa_extra_t *x);
 
 void rsa_make_pub(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters);
 
+void rsa_make_pub_r(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    gmp_randstate_t rs);
+
+void rsa_make_pub_mt(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed);
+
+void rsa_make_pub_e(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed);
+
+void rsa_make_pub_pool(mpz_t p, mpz_t q, mpz_t n, mpz_t e, uint64_t nbits, uint64_t iters,
+    uint64_t threads, uint64_t seed, const char *pooldir);
+
+void rsa_make_pub_multi(mpz_t p, mpz_t q, rsa_extra_t *x, mpz_t n, mpz_t e, uint64_t nbits,
+    uint64_t primes, uint64_t iters, uint64_t threads, uint64_t seed);
+
 void rsa_write_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_read_pub(mpz_t n, mpz_t e, mpz_t s, char username[], FILE *pbfile);
 
 void rsa_make_priv(mpz_t d, mpz_t e, mpz_t p, mpz_t q);
 
+void rsa_make_priv_ws(mpz_t d, mpz_t e, mpz_t p, mpz_t q, workspace_t *ws);
+
 void rsa_write_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
 void rsa_read_priv(mpz_t n, mpz_t d, FILE *pvfile);
 
+void rsa_make_crt(mpz_t dp, mpz_t dq, mpz_t qinv, mpz_t d, mpz_t p, mpz_t q);
+
+void rsa_write_priv_crt(
+    mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, FILE *pvfile);
+
+bool rsa_read_priv_crt(
+    mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv, FILE *pvfile);
+
+void rsa_make_priv_multi(mpz_t d, mpz_t e, mpz_t p, mpz_t q, rsa_extra_t *x);
+
+void rsa_make_crt_multi(rsa_extra_t *x, mpz_t d, mpz_t p, mpz_t q);
+
+void rsa_write_priv_multi(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, FILE *pvfile);
+
+bool rsa_read_priv_multi(mpz_t n, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, FILE *pvfile);
+
 void rsa_encrypt(mpz_t c, mpz_t m, mpz_t e, mpz_t n);
 
 void rsa_encrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t e);
 
+bool rsa_encrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t e, rsa_opts_t *opts);
+
+bool rsa_encrypt_stream(reader_t *reader, writer_t *writer, mpz_t n, mpz_t e, rsa_opts_t *opts);
+
 void rsa_decrypt(mpz_t m, mpz_t c, mpz_t d, mpz_t n);
 
 void rsa_decrypt_file(FILE *infile, FILE *outfile, mpz_t n, mpz_t d);
 
+bool rsa_decrypt_file_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t d, rsa_opts_t *opts);
+
+void rsa_decrypt_crt(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv);
+
+void rsa_decrypt_multi(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x);
+
+void rsa_decrypt_file_crt(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv);
+
+bool rsa_decrypt_file_crt_opts(FILE *infile, FILE *outfile, mpz_t n, mpz_t p, mpz_t q, mpz_t dp,
+    mpz_t dq, mpz_t qinv, rsa_opts_t *opts);
+
+bool rsa_decrypt_stream(reader_t *reader, writer_t *writer, mpz_t n, mpz_t d, rsa_opts_t *opts);
+
+bool rsa_decrypt_stream_crt(reader_t *reader, writer_t *writer, mpz_t n, mpz_t p, mpz_t q,
+    mpz_t dp, mpz_t dq, mpz_t qinv, rsa_opts_t *opts);
+
+void rsa_encrypt_ctx(mpz_t c, mpz_t m, mpz_t e, mpz_t n, mont_t *ctx);
+
+void rsa_decrypt_ctx(mpz_t m, mpz_t c, mpz_t d, mpz_t n, mont_t *ctx);
+
+void rsa_decrypt_crt_ctx(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    mont_t *pctx, mont_t *qctx, workspace_t *ws);
+
+void rsa_decrypt_multi_ctx(mpz_t m, mpz_t c, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x, mont_t *pctx, mont_t *qctx, mont_t *xctx, workspace_t *ws);
+
 void rsa_sign(mpz_t s, mpz_t m, mpz_t d, mpz_t n);
 
+void rsa_sign_crt(mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv);
+
+void rsa_sign_multi(mpz_t s, mpz_t m, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    rsa_extra_t *x);
+
 bool rsa_verify(mpz_t m, mpz_t s, mpz_t e, mpz_t n);
+
+bool rsa_verify_ws(mpz_t m, mpz_t s, mpz_t e, mpz_t n, workspace_t *ws);
+
+void rsa_digest_file(uint8_t digest[SHA256_DIGEST], FILE *infile);
+
+bool rsa_pad_digest(mpz_t m, uint8_t digest[SHA256_DIGEST], mpz_t n);
+
+bool rsa_verify_digest(uint8_t digest[SHA256_DIGEST], mpz_t s, mpz_t e, mpz_t n);
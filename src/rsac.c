@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include "frame.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS "s:m:i:o:h"
+
+// help()
+// help() prints out the program usage and help.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Sends one request to the rsad daemon and writes the response.\n\
+\n\
+USAGE\n\
+   ./rsac [-h] [-s socket] [-i infile] [-o outfile] -m mode\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -s socket       Socket path (default: rsa.sock).\n\
+   -m mode         encrypt, decrypt or sign.\n\
+   -i infile       Input message (default: stdin).\n\
+   -o outfile      Output (default: stdout).\n");
+    return;
+}
+
+// main()
+// main() reads the message, sends it as one frame and writes the body of the response.
+int main(int argc, char **argv) {
+    int opt = 0;
+    char *sockpath = "rsa.sock";
+    uint8_t op = 0;
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 's': sockpath = optarg; break;
+        case 'm':
+            if (strcmp(optarg, "encrypt") == 0) {
+                op = OP_ENCRYPT;
+            } else if (strcmp(optarg, "decrypt") == 0) {
+                op = OP_DECRYPT;
+            } else if (strcmp(optarg, "sign") == 0) {
+                op = OP_SIGN;
+            } else {
+                fprintf(stderr, "Error: unknown mode.\n");
+                return 1;
+            }
+            break;
+        case 'i':
+            infile = fopen(optarg, "r");
+            if (infile == NULL) {
+                fprintf(stderr, "Error: failed to open infile.\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            outfile = fopen(optarg, "w");
+            if (outfile == NULL) {
+                fprintf(stderr, "Error: failed to open outfile.\n");
+                return 1;
+            }
+            break;
+        case 'h': help(); return 0;
+        default: help(); return 1;
+        }
+    }
+    if (op == 0) {
+        help();
+        return 1;
+    }
+
+    // Read the whole message, it has to fit in one frame
+    uint8_t *buf = (uint8_t *) malloc(FRAME_MAX);
+    size_t len = fread(buf, sizeof(uint8_t), FRAME_MAX - 1, infile);
+
+    int fd = frame_connect(sockpath);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to connect to %s.\n", sockpath);
+        free(buf);
+        return 1;
+    }
+
+    uint32_t got = 0;
+    if (!frame_write(fd, op, buf, len) || !frame_read(fd, buf, &got)) {
+        fprintf(stderr, "Error: request failed.\n");
+        close(fd);
+        free(buf);
+        return 1;
+    }
+    close(fd);
+
+    int rc = 0;
+    if (buf[0] == STATUS_OK) {
+        fwrite(buf + 1, sizeof(uint8_t), got - 1, outfile);
+    } else {
+        fprintf(stderr, "Error: %.*s.\n", (int) got - 1, (char *) buf + 1);
+        rc = 1;
+    }
+    free(buf);
+    fclose(infile);
+    fclose(outfile);
+    return rc;
+}
@@ -0,0 +1,582 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "mont.h"
+#include "frame.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define OPTIONS "n:d:s:t:vh"
+
+// Pending connections the kernel can hold until the dispatcher accepts them
+#define BACKLOG 256
+
+// Bytes read from a connection at a time
+#define READ_SIZE (64 * 1024)
+
+// Most requests a worker takes from the queue at once, from any connections
+#define BATCH 32
+
+// A connection isn't read further while this many of its requests are unanswered, or while
+// this many bytes of its responses are unwritten, so a client that never reads can't pile up
+// work or memory
+#define CONN_PENDING 256
+#define CONN_OUT     FRAME_MAX
+
+// help()
+// help() prints out the program usage and help.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Serves RSA encrypt, decrypt and sign requests over a Unix domain socket.\n\
+   Keys are loaded and set up once at start up.\n\
+\n\
+USAGE\n\
+   ./rsad [-hv] [-n pbfile] [-d pvfile] [-s socket] [-t threads]\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -v              Display verbose program output.\n\
+   -n pbfile       Public key file for encrypt requests (default: rsa.pub).\n\
+   -d pvfile       Private key file for decrypt and sign requests (default: rsa.priv).\n\
+   -s socket       Socket path (default: rsa.sock).\n\
+   -t threads      Worker threads (default: 4).\n");
+    return;
+}
+
+// The loaded keys, read only once the workers start
+static mpz_t pub_n, pub_e, n, d, p, q, dp, dq, qinv;
+static rsa_extra_t extra; // Primes past p and q of a multi-prime key
+static bool have_pub = false;
+static bool have_priv = false;
+static bool crt = false;
+
+typedef struct conn conn_t;
+
+// job_t
+// job_t is one request frame, queued for the workers and then holding its response until the
+// dispatcher writes it back in the order the connection sent its requests
+typedef struct job {
+    conn_t *conn;
+    struct job *next; // Next in the work queue
+    struct job *after; // Next request of the same connection
+    bool done; // Set by the worker under lock once resp is filled in
+    uint8_t *resp; // Whole response frame
+    size_t resplen;
+    uint8_t op;
+    uint32_t len;
+    uint8_t body[];
+} job_t;
+
+// conn_t
+// conn_t is one client connection, only the dispatcher thread touches it
+struct conn {
+    int fd;
+    uint8_t *in; // Bytes read that don't make up a whole frame yet
+    size_t have, incap;
+    uint8_t *out; // Responses not yet written
+    size_t outpos, outlen, outcap;
+    job_t *first, *last; // Requests not yet answered, in arrival order
+    uint64_t pending;
+    bool eof; // Nothing more is read, the connection closes once its responses are out
+    bool dead; // A write failed, responses are dropped until the workers are done with it
+};
+
+// Work queue between the dispatcher and the workers
+static job_t *qhead = NULL, *qtail = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+
+// A worker writes a byte here after a batch so the dispatcher's poll() wakes to send it
+static int wake[2];
+
+static volatile sig_atomic_t quit = 0;
+
+// worker_t
+// worker_t is the per worker copy of the key setup and scratch values
+typedef struct {
+    mont_t ectx, dctx, pctx, qctx;
+    mont_t xctx[RSA_MAX_PRIMES - 2];
+    workspace_t ws;
+    mpz_t m, c;
+} worker_t;
+
+// on_signal()
+// on_signal() asks the accept loop to stop
+static void on_signal(int sig) {
+    (void) sig;
+    quit = 1;
+}
+
+// reply()
+// reply() sets the response frame of a job
+static void reply(job_t *j, uint8_t status, const uint8_t *body, uint32_t len) {
+    j->resp = (uint8_t *) malloc(len + 5);
+    frame_put_len(j->resp, len + 1);
+    j->resp[4] = status;
+    memcpy(j->resp + 5, body, len);
+    j->resplen = len + 5;
+}
+
+// reply_error()
+// reply_error() sets an error response with a message
+static void reply_error(job_t *j, const char *msg) {
+    reply(j, STATUS_ERROR, (const uint8_t *) msg, strlen(msg));
+}
+
+// reply_fixed()
+// reply_fixed() sets x as a big-endian number of exactly width bytes
+static void reply_fixed(job_t *j, mpz_t x, uint64_t width) {
+    uint8_t buf[width];
+    size_t len = mpz_sgn(x) == 0 ? 0 : (mpz_sizeinbase(x, 2) + 7) / 8;
+    memset(buf, 0, width - len);
+    mpz_export(buf + width - len, NULL, 1, sizeof(uint8_t), 1, 0, x);
+    reply(j, STATUS_OK, buf, width);
+}
+
+// handle()
+// handle() runs one request and sets its response
+static void handle(worker_t *w, job_t *j) {
+    uint8_t op = j->op;
+    const uint8_t *body = j->body;
+    uint32_t len = j->len;
+    switch (op) {
+    case OP_ENCRYPT: {
+        // Same block layout as rsa_encrypt_file(), 0xFF then at most k - 1 bytes
+        if (!have_pub) {
+            reply_error(j, "no public key loaded");
+            return;
+        }
+        uint64_t k = (mpz_sizeinbase(pub_n, 2) - 1) / 8;
+        if (len > k - 1) {
+            reply_error(j, "message too long for one block");
+            return;
+        }
+        uint8_t block[k];
+        block[0] = 0xFF;
+        memcpy(block + 1, body, len);
+        mpz_import(w->m, len + 1, 1, sizeof(uint8_t), 1, 0, block);
+        rsa_encrypt_ctx(w->c, w->m, pub_e, pub_n, &w->ectx);
+        reply_fixed(j, w->c, (mpz_sizeinbase(pub_n, 2) + 7) / 8);
+        return;
+    }
+    case OP_DECRYPT:
+    case OP_SIGN: {
+        if (!have_priv) {
+            reply_error(j, "no private key loaded");
+            return;
+        }
+        mpz_import(w->c, len, 1, sizeof(uint8_t), 1, 0, body);
+        if (mpz_cmp(w->c, n) >= 0) {
+            reply_error(j, "input is not less than n");
+            return;
+        }
+        // Signing is the same exponentiation as decrypting
+        if (crt) {
+            rsa_decrypt_multi_ctx(
+                w->m, w->c, p, q, dp, dq, qinv, &extra, &w->pctx, &w->qctx, w->xctx, &w->ws);
+        } else {
+            rsa_decrypt_ctx(w->m, w->c, d, n, &w->dctx);
+        }
+        if (op == OP_SIGN) {
+            reply_fixed(j, w->m, (mpz_sizeinbase(n, 2) + 7) / 8);
+            return;
+        }
+        uint64_t slot = (mpz_sizeinbase(n, 2) + 7) / 8;
+        uint8_t block[slot];
+        size_t bytes = 0;
+        mpz_export(block, &bytes, 1, sizeof(uint8_t), 1, 0, w->m);
+        if (bytes == 0 || block[0] != 0xFF) {
+            reply_error(j, "bad padding");
+            return;
+        }
+        reply(j, STATUS_OK, block + 1, bytes - 1);
+        return;
+    }
+    default: reply_error(j, "unknown operation"); return;
+    }
+}
+
+// worker_main()
+// worker_main() sets up the worker's contexts once and then answers queued requests a batch
+// at a time
+static void *worker_main(void *arg) {
+    (void) arg;
+    worker_t w;
+    memset(&w, 0, sizeof(w));
+    mpz_inits(w.m, w.c, NULL);
+    ws_init(&w.ws, have_priv ? mpz_sizeinbase(n, 2) : 0);
+    if (have_pub) {
+        mont_init(&w.ectx, pub_n);
+    }
+    if (have_priv && crt) {
+        mont_init(&w.pctx, p);
+        mont_init(&w.qctx, q);
+        for (uint64_t i = 0; i < extra.count; i++) {
+            mont_init(&w.xctx[i], extra.r[i]);
+        }
+    } else if (have_priv) {
+        mont_init(&w.dctx, n);
+    }
+
+    job_t *batch[BATCH];
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (qhead == NULL) {
+            pthread_cond_wait(&ready, &lock);
+        }
+        uint64_t count = 0;
+        while (qhead != NULL && count < BATCH) {
+            batch[count++] = qhead;
+            qhead = qhead->next;
+        }
+        if (qhead == NULL) {
+            qtail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        for (uint64_t i = 0; i < count; i++) {
+            handle(&w, batch[i]);
+        }
+        pthread_mutex_lock(&lock);
+        for (uint64_t i = 0; i < count; i++) {
+            batch[i]->done = true;
+        }
+        pthread_mutex_unlock(&lock);
+        // A full pipe already has the dispatcher woken up
+        uint8_t byte = 0;
+        if (write(wake[1], &byte, 1) < 0) {
+            continue;
+        }
+    }
+    return NULL;
+}
+
+// conn_read()
+// conn_read() reads what a connection has sent and queues every complete frame in it
+// A malformed length ends the connection once the requests before it are answered
+static void conn_read(conn_t *c) {
+    if (c->incap - c->have < READ_SIZE) {
+        c->incap = c->have + READ_SIZE;
+        c->in = (uint8_t *) realloc(c->in, c->incap);
+    }
+    ssize_t got = read(c->fd, c->in + c->have, READ_SIZE);
+    if (got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if (got <= 0) {
+        c->eof = true;
+        return;
+    }
+    c->have += got;
+
+    job_t *first = NULL, *last = NULL;
+    size_t at = 0;
+    while (c->have - at >= 4) {
+        uint32_t len = frame_get_len(c->in + at);
+        if (len == 0 || len > FRAME_MAX) {
+            c->eof = true;
+            break;
+        }
+        if (c->have - at - 4 < len) {
+            break;
+        }
+        job_t *j = (job_t *) calloc(1, sizeof(job_t) + len - 1);
+        j->conn = c;
+        j->op = c->in[at + 4];
+        j->len = len - 1;
+        memcpy(j->body, c->in + at + 5, len - 1);
+        if (c->last != NULL) {
+            c->last->after = j;
+        } else {
+            c->first = j;
+        }
+        c->last = j;
+        c->pending++;
+        if (last != NULL) {
+            last->next = j;
+        } else {
+            first = j;
+        }
+        last = j;
+        at += 4 + len;
+    }
+    memmove(c->in, c->in + at, c->have - at);
+    c->have -= at;
+
+    if (first != NULL) {
+        pthread_mutex_lock(&lock);
+        if (qtail != NULL) {
+            qtail->next = first;
+        } else {
+            qhead = first;
+        }
+        qtail = last;
+        pthread_cond_broadcast(&ready);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+// conn_flush()
+// conn_flush() moves the answered requests at the front of a connection to its output and
+// writes as much of it as the socket takes without blocking
+static void conn_flush(conn_t *c) {
+    // Only the done flags are shared, the jobs before the first unanswered one are ours again
+    job_t *stop = c->first;
+    pthread_mutex_lock(&lock);
+    while (stop != NULL && stop->done) {
+        stop = stop->after;
+    }
+    pthread_mutex_unlock(&lock);
+    while (c->first != stop) {
+        job_t *j = c->first;
+        if (!c->dead) {
+            if (c->outlen + j->resplen > c->outcap) {
+                c->outcap = 2 * c->outcap + j->resplen;
+                c->out = (uint8_t *) realloc(c->out, c->outcap);
+            }
+            memcpy(c->out + c->outlen, j->resp, j->resplen);
+            c->outlen += j->resplen;
+        }
+        c->first = j->after;
+        c->pending--;
+        free(j->resp);
+        free(j);
+    }
+    if (c->first == NULL) {
+        c->last = NULL;
+    }
+
+    while (!c->dead && c->outpos < c->outlen) {
+        ssize_t put = write(c->fd, c->out + c->outpos, c->outlen - c->outpos);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (put <= 0) {
+            c->dead = true;
+            c->eof = true;
+            break;
+        }
+        c->outpos += put;
+    }
+    if (c->dead || c->outpos == c->outlen) {
+        c->outpos = c->outlen = 0;
+    }
+}
+
+// nonblocking()
+// nonblocking() puts a descriptor in non-blocking mode
+static bool nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+// load_keys()
+// load_keys() reads whichever key files exist and checks the public key signature
+static bool load_keys(char *pbpath, char *pvpath, bool stats) {
+    char username[KEY_USER_MAX];
+    mpz_t s, user;
+    mpz_inits(pub_n, pub_e, n, d, p, q, dp, dq, qinv, s, user, NULL);
+    rsa_extra_init(&extra);
+
+    FILE *pbfile = fopen(pbpath, "r");
+    if (pbfile != NULL) {
+        rsa_read_pub(pub_n, pub_e, s, username, pbfile);
+        fclose(pbfile);
+        mpz_set_str(user, username, 62);
+        if (!rsa_verify(user, s, pub_e, pub_n)) {
+            fprintf(stderr, "Error: Couldn't verify signature.\n");
+            mpz_clears(s, user, NULL);
+            return false;
+        }
+        have_pub = true;
+    }
+
+    FILE *pvfile = fopen(pvpath, "r");
+    if (pvfile != NULL) {
+        crt = rsa_read_priv_multi(n, d, p, q, dp, dq, qinv, &extra, pvfile);
+        fclose(pvfile);
+        have_priv = true;
+    }
+    mpz_clears(s, user, NULL);
+
+    if (stats) {
+        if (have_pub) {
+            gmp_fprintf(stdout, "public n (%zu bits), e (%zu bits)\n", mpz_sizeinbase(pub_n, 2),
+                mpz_sizeinbase(pub_e, 2));
+        }
+        if (have_priv) {
+            gmp_fprintf(stdout, "private n (%zu bits)%s, %d primes\n", mpz_sizeinbase(n, 2),
+                crt ? ", CRT" : "", crt ? (int) extra.count + 2 : 2);
+        }
+        fflush(stdout);
+    }
+    return have_pub || have_priv;
+}
+
+// main()
+// main() loads the keys, starts the workers and hands them connections until signalled.
+int main(int argc, char **argv) {
+    int opt = 0;
+    bool stats = false;
+    char *pbpath = "rsa.pub";
+    char *pvpath = "rsa.priv";
+    char *sockpath = "rsa.sock";
+    uint64_t threads = 4;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'n': pbpath = optarg; break;
+        case 'd': pvpath = optarg; break;
+        case 's': sockpath = optarg; break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            if (threads < 1) {
+                fprintf(stderr, "Error: Number of threads is invalid.\n");
+                return 1;
+            }
+            break;
+        case 'v': stats = true; break;
+        case 'h': help(); return 0;
+        default: help(); return 1;
+        }
+    }
+
+    if (!load_keys(pbpath, pvpath, stats)) {
+        fprintf(stderr, "Error: failed to load a public or private key.\n");
+        return 1;
+    }
+
+    // Listen on the socket, only the owner may connect since it can use the private key
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: socket path is too long.\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, sockpath);
+
+    // Only a socket left behind by an earlier run is replaced, any other file is kept
+    struct stat st;
+    if (lstat(sockpath, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Error: %s exists and is not a socket.\n", sockpath);
+            return 1;
+        }
+        unlink(sockpath);
+    }
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0077);
+    if (lfd < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || listen(lfd, BACKLOG) < 0 || !nonblocking(lfd) || pipe(wake) != 0
+        || !nonblocking(wake[0]) || !nonblocking(wake[1])) {
+        fprintf(stderr, "Error: failed to listen on socket.\n");
+        return 1;
+    }
+    umask(mask);
+
+    // A client hanging up mid-reply must not kill the daemon, SIGINT/SIGTERM stop it
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (uint64_t i = 0; i < threads; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_main, NULL);
+        pthread_detach(tid);
+    }
+
+    // Dispatch until signalled: one poll() over the socket, the wake pipe and every client
+    // reads whole frames into the work queue and writes answered ones back, so an idle client
+    // holds no worker and the workers batch requests across all connections
+    uint64_t nconns = 0, cap = 64;
+    conn_t **conns = (conn_t **) malloc(cap * sizeof(conn_t *));
+    struct pollfd *fds = (struct pollfd *) malloc(cap * sizeof(struct pollfd));
+    while (!quit) {
+        fds[0] = (struct pollfd) { .fd = wake[0], .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = lfd, .events = POLLIN };
+        for (uint64_t i = 0; i < nconns; i++) {
+            conn_t *c = conns[i];
+            bool room = c->pending < CONN_PENDING && c->outlen - c->outpos < CONN_OUT;
+            short events = (short) ((!c->eof && room ? POLLIN : 0)
+                                    | (c->outpos < c->outlen ? POLLOUT : 0));
+            // A hung up client waiting on the workers would make poll() return at once
+            fds[i + 2] = (struct pollfd) { .fd = events != 0 ? c->fd : -1, .events = events };
+        }
+        if (poll(fds, nconns + 2, -1) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint8_t drain[256];
+            while (read(wake[0], drain, sizeof(drain)) > 0) { }
+        }
+        for (uint64_t i = 0; i < nconns; i++) {
+            short got = fds[i + 2].revents;
+            if ((fds[i + 2].events & POLLIN) && (got & (POLLIN | POLLHUP | POLLERR))) {
+                conn_read(conns[i]);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                if (!nonblocking(fd)) {
+                    close(fd);
+                    continue;
+                }
+                // Grow before the arrays fill, a listener left with clients waiting would keep
+                // poll() returning at once
+                if (nconns + 2 >= cap) {
+                    cap *= 2;
+                    conns = (conn_t **) realloc(conns, cap * sizeof(conn_t *));
+                    fds = (struct pollfd *) realloc(fds, cap * sizeof(struct pollfd));
+                }
+                conn_t *c = (conn_t *) calloc(1, sizeof(conn_t));
+                c->fd = fd;
+                conns[nconns++] = c;
+            }
+        }
+
+        // Send what the workers answered and drop the connections that are finished
+        uint64_t kept = 0;
+        for (uint64_t i = 0; i < nconns; i++) {
+            conn_t *c = conns[i];
+            conn_flush(c);
+            if (c->eof && c->first == NULL && c->outpos == c->outlen) {
+                close(c->fd);
+                free(c->in);
+                free(c->out);
+                free(c);
+            } else {
+                conns[kept++] = c;
+            }
+        }
+        nconns = kept;
+    }
+    free(conns);
+    free(fds);
+
+    close(lfd);
+    unlink(sockpath);
+    return 0;
+}
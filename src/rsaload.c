@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include "frame.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#define OPTIONS "s:m:c:r:b:p:h"
+
+// help()
+// help() prints out the program usage and help.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Generates load against the rsad daemon and reports request latency.\n\
+\n\
+USAGE\n\
+   ./rsaload [-h] [-s socket] [-m mode] [-c conns] [-r requests] [-b bytes] [-p depth]\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -s socket       Socket path (default: rsa.sock).\n\
+   -m mode         encrypt, decrypt or sign (default: decrypt).\n\
+   -c conns        Concurrent connections, one thread each (default: 4).\n\
+   -r requests     Requests per connection (default: 1000).\n\
+   -b bytes        Message size in bytes (default: 16).\n\
+   -p depth        Requests in flight per connection (default: 1).\n");
+    return;
+}
+
+// conn_t
+// conn_t is one load generating connection and the latencies it measured
+typedef struct {
+    char *sockpath;
+    uint8_t op;
+    uint8_t *msg;
+    uint32_t len;
+    uint64_t requests;
+    uint64_t depth;
+    double *lat; // Latency of each request in seconds
+    uint64_t errors;
+    bool failed;
+} conn_t;
+
+// now()
+// now() returns a monotonic timestamp in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// cmp_double()
+// cmp_double() orders latencies for qsort()
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// run_conn()
+// run_conn() keeps depth requests in flight until all of them are answered
+// Responses come back in request order, so the oldest send time belongs to the next response
+static void *run_conn(void *arg) {
+    conn_t *c = (conn_t *) arg;
+    int fd = frame_connect(c->sockpath);
+    if (fd < 0) {
+        c->failed = true;
+        return NULL;
+    }
+    uint8_t *buf = (uint8_t *) malloc(FRAME_MAX);
+    double *sent = (double *) calloc(c->requests, sizeof(double));
+    uint64_t next = 0;
+    for (uint64_t done = 0; done < c->requests; done++) {
+        while (next < c->requests && next - done < c->depth) {
+            sent[next++] = now();
+            if (!frame_write(fd, c->op, c->msg, c->len)) {
+                c->failed = true;
+                break;
+            }
+        }
+        uint32_t got = 0;
+        if (c->failed || !frame_read(fd, buf, &got)) {
+            c->failed = true;
+            break;
+        }
+        c->lat[done] = now() - sent[done];
+        c->errors += buf[0] == STATUS_OK ? 0 : 1;
+    }
+    free(sent);
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+// main()
+// main() runs the connections in parallel and prints throughput and latency percentiles.
+int main(int argc, char **argv) {
+    int opt = 0;
+    char *sockpath = "rsa.sock";
+    uint8_t op = OP_DECRYPT;
+    uint64_t conns = 4;
+    uint64_t requests = 1000;
+    uint64_t bytes = 16;
+    uint64_t depth = 1;
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 's': sockpath = optarg; break;
+        case 'm':
+            if (strcmp(optarg, "encrypt") == 0) {
+                op = OP_ENCRYPT;
+            } else if (strcmp(optarg, "decrypt") == 0) {
+                op = OP_DECRYPT;
+            } else if (strcmp(optarg, "sign") == 0) {
+                op = OP_SIGN;
+            } else {
+                fprintf(stderr, "Error: unknown mode.\n");
+                return 1;
+            }
+            break;
+        case 'c': conns = strtoul(optarg, NULL, 10); break;
+        case 'r': requests = strtoul(optarg, NULL, 10); break;
+        case 'b': bytes = strtoul(optarg, NULL, 10); break;
+        case 'p': depth = strtoul(optarg, NULL, 10); break;
+        case 'h': help(); return 0;
+        default: help(); return 1;
+        }
+    }
+    if (conns < 1 || requests < 1 || depth < 1 || bytes >= FRAME_MAX) {
+        fprintf(stderr, "Error: invalid load parameters.\n");
+        return 1;
+    }
+
+    // A fixed message, decrypt load sends a real ciphertext of it from an encrypt request
+    uint8_t *msg = (uint8_t *) malloc(FRAME_MAX);
+    uint32_t len = bytes;
+    for (uint64_t i = 0; i < bytes; i++) {
+        msg[i] = 'a' + i % 26;
+    }
+    if (op == OP_DECRYPT) {
+        int fd = frame_connect(sockpath);
+        if (fd < 0 || !frame_write(fd, OP_ENCRYPT, msg, len) || !frame_read(fd, msg, &len)
+            || msg[0] != STATUS_OK) {
+            fprintf(stderr, "Error: failed to get a ciphertext to decrypt.\n");
+            return 1;
+        }
+        close(fd);
+        len -= 1;
+        memmove(msg, msg + 1, len);
+    }
+
+    conn_t *c = (conn_t *) calloc(conns, sizeof(conn_t));
+    pthread_t *tids = (pthread_t *) calloc(conns, sizeof(pthread_t));
+    double start = now();
+    for (uint64_t i = 0; i < conns; i++) {
+        c[i] = (conn_t) { sockpath, op, msg, len, requests, depth, NULL, 0, false };
+        c[i].lat = (double *) calloc(requests, sizeof(double));
+        pthread_create(&tids[i], NULL, run_conn, &c[i]);
+    }
+    for (uint64_t i = 0; i < conns; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    // Gather every latency and sort for the percentiles
+    double *all = (double *) calloc(conns * requests, sizeof(double));
+    uint64_t total = 0;
+    uint64_t errors = 0;
+    bool failed = false;
+    for (uint64_t i = 0; i < conns; i++) {
+        memcpy(all + total, c[i].lat, requests * sizeof(double));
+        total += requests;
+        errors += c[i].errors;
+        failed = failed || c[i].failed;
+        free(c[i].lat);
+    }
+    qsort(all, total, sizeof(double), cmp_double);
+
+    fprintf(stdout, "requests %" PRIu64 ", errors %" PRIu64 ", %.3f s, %.1f req/s\n", total,
+        errors, elapsed, total / elapsed);
+    fprintf(stdout, "latency p50 %.1f us, p99 %.1f us, max %.1f us\n", all[total / 2] * 1e6,
+        all[(total * 99) / 100] * 1e6, all[total - 1] * 1e6);
+    if (failed) {
+        fprintf(stderr, "Error: some connections failed.\n");
+    }
+
+    free(all);
+    free(c);
+    free(tids);
+    free(msg);
+    return failed ? 1 : 0;
+}
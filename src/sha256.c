@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include "sha256.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SHA256_X86
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = { 0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+    0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6,
+    0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d,
+    0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85,
+    0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585,
+    0x106aa070, 0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa,
+    0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// sha256_supported()
+// sha256_supported() checks whether this CPU can run the kernel
+bool sha256_supported(sha256_kernel_t kernel) {
+#ifdef SHA256_X86
+    if (kernel == SHA256_SHANI) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+    }
+#endif
+    return kernel == SHA256_SCALAR;
+}
+
+// sha256_name()
+// sha256_name() returns the name of a kernel for reports
+const char *sha256_name(sha256_kernel_t kernel) {
+    return kernel == SHA256_SHANI ? "sha-ni" : "scalar";
+}
+
+// blocks_scalar()
+// blocks_scalar() runs the compression function over count 64 byte blocks
+static void blocks_scalar(uint32_t h[8], const uint8_t *p, size_t count) {
+    uint32_t w[64];
+    for (; count > 0; count--, p += SHA256_BLOCK) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16
+                   | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g))
+                          + K[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    }
+}
+
+#ifdef SHA256_X86
+// blocks_shani()
+// blocks_shani() is blocks_scalar() on the SHA extensions, four rounds per pair of
+// sha256rnds2 and the message schedule on sha256msg1/sha256msg2
+// The instructions want the state as ABEF and CDGH halves, so it is shuffled in and out.
+__attribute__((target("sha,sse4.1"))) static void blocks_shani(
+    uint32_t h[8], const uint8_t *p, size_t count) {
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xB1);
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(t, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, t, 0xF0);
+
+    for (; count > 0; count--, p += SHA256_BLOCK) {
+        __m128i abef0 = abef, cdgh0 = cdgh;
+        __m128i w[4];
+        // Unrolled so w stays in registers
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            // w[i % 4] holds words 4i to 4i + 3 of the schedule
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), swap);
+            } else {
+                __m128i x = _mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]);
+                x = _mm_add_epi32(x, _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4));
+                w[i % 4] = _mm_sha256msg2_epu32(x, w[(i + 3) % 4]);
+            }
+            __m128i m = _mm_add_epi32(w[i % 4], _mm_loadu_si128((const __m128i *) &K[4 * i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, m);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(m, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef0);
+        cdgh = _mm_add_epi32(cdgh, cdgh0);
+    }
+
+    t = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *) &h[0], _mm_blend_epi16(t, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *) &h[4], _mm_alignr_epi8(cdgh, t, 8));
+}
+#endif
+
+// blocks()
+// blocks() runs the context's kernel over count whole blocks
+static void blocks(sha256_t *ctx, const uint8_t *p, size_t count) {
+#ifdef SHA256_X86
+    if (ctx->kernel == SHA256_SHANI) {
+        blocks_shani(ctx->h, p, count);
+        return;
+    }
+#endif
+    blocks_scalar(ctx->h, p, count);
+}
+
+// sha256_init()
+// sha256_init() starts a new hash on the fastest kernel this CPU supports
+void sha256_init(sha256_t *ctx) {
+    static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+        0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(ctx->h, iv, sizeof(iv));
+    ctx->len = 0;
+    ctx->fill = 0;
+    ctx->kernel = sha256_supported(SHA256_SHANI) ? SHA256_SHANI : SHA256_SCALAR;
+}
+
+// sha256_update()
+// sha256_update() hashes len more bytes, whole blocks go straight from data to the kernel
+void sha256_update(sha256_t *ctx, const uint8_t *data, size_t len) {
+    ctx->len += len;
+    if (ctx->fill > 0) {
+        size_t take = SHA256_BLOCK - ctx->fill < len ? SHA256_BLOCK - ctx->fill : len;
+        memcpy(ctx->buf + ctx->fill, data, take);
+        ctx->fill += take;
+        data += take;
+        len -= take;
+        if (ctx->fill < SHA256_BLOCK) {
+            return;
+        }
+        blocks(ctx, ctx->buf, 1);
+        ctx->fill = 0;
+    }
+    blocks(ctx, data, len / SHA256_BLOCK);
+    data += len - len % SHA256_BLOCK;
+    memcpy(ctx->buf, data, len % SHA256_BLOCK);
+    ctx->fill = len % SHA256_BLOCK;
+}
+
+// sha256_final()
+// sha256_final() pads the message, writes the digest and wipes the context
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST]) {
+    uint64_t bits = ctx->len * 8;
+    uint8_t pad[2 * SHA256_BLOCK] = { 0x80 };
+    size_t padlen = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+    for (int i = 0; i < 8; i++) {
+        pad[padlen + i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    sha256_update(ctx, pad, padlen + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t) (ctx->h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t) (ctx->h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t) (ctx->h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t) ctx->h[i];
+    }
+    memset(ctx, 0, sizeof(sha256_t));
+}
+
+// sha256()
+// sha256() hashes one buffer
+void sha256(uint8_t digest[SHA256_DIGEST], const uint8_t *data, size_t len) {
+    sha256_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming SHA-256 (FIPS 180-4) for hashing files of any size
+// sha256_init() picks the SHA-NI kernel when the CPU has the SHA extensions and the portable
+// one otherwise, both give the same digest.
+#define SHA256_DIGEST 32
+#define SHA256_BLOCK  64
+
+typedef enum { SHA256_SCALAR, SHA256_SHANI } sha256_kernel_t;
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len; // Bytes hashed so far
+    uint8_t buf[SHA256_BLOCK]; // Partial block waiting for more input
+    size_t fill;
+    sha256_kernel_t kernel;
+} sha256_t;
+
+bool sha256_supported(sha256_kernel_t kernel);
+
+const char *sha256_name(sha256_kernel_t kernel);
+
+void sha256_init(sha256_t *ctx);
+
+void sha256_update(sha256_t *ctx, const uint8_t *data, size_t len);
+
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST]);
+
+void sha256(uint8_t digest[SHA256_DIGEST], const uint8_t *data, size_t len);
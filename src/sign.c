@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "stats.h"
+#include "keycache.h"
+#include "librsa.h"
+#include "sha256.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define OPTIONS "i:o:n:Cvh"
+
+static struct option longopts[] = { { "stats-json", required_argument, NULL, 'J' },
+    { NULL, 0, NULL, 0 } };
+
+// help()
+// help() prints out the program usage and help.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Signs a file of any size with an RSA private key.\n\
+   The detached signature is checked by the verify program.\n\
+\n\
+USAGE\n\
+   ./sign [-hvC] [-i infile] [-o sigfile] [--stats-json file] -n privkey\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -v              Display verbose program output, phase timings go to stderr.\n\
+   -i infile       Input file to sign (default: stdin).\n\
+   -o sigfile      Output file for the signature (default: stdout).\n\
+   -n pvfile       Private key file (default: rsa.priv).\n\
+   -C              Load the key from pvfile.cache, made on the first run and remade\n\
+                   whenever pvfile changes, skipping the parse and setup.\n\
+   --stats-json f  Write phase timings and counters as JSON to f.\n");
+    return;
+}
+
+// main()
+// main() hashes the input file with SHA-256 and writes the signature of the digest as a hex
+// line, one private key operation however large the file is
+int main(int argc, char **argv) {
+
+    // opt for getopt
+    int opt = 0;
+
+    bool stats = false;
+    bool cache = false;
+    FILE *jsonfile = NULL;
+    char *pvpath = "rsa.priv";
+    FILE *infile = stdin;
+    FILE *outfile = stdout;
+
+    // gets all command line options
+    while ((opt = getopt_long(argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            infile = fopen(optarg, "r");
+            if (infile == NULL) {
+                fprintf(stderr, "Error: failed to open infile.\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            outfile = fopen(optarg, "w");
+            if (outfile == NULL) {
+                fprintf(stderr, "Error: failed to open sigfile.\n");
+                return 1;
+            }
+            break;
+        case 'n': pvpath = optarg; break;
+        case 'J':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open stats file.\n");
+                return 1;
+            }
+            break;
+        case 'v': stats = true; break;
+        case 'C': cache = true; break;
+        case 'h': help(); return 0;
+        default: help(); return 1;
+        }
+    }
+
+    uint64_t start = stats_clock();
+    FILE *pvfile = fopen(pvpath, "r");
+    if (pvfile == NULL) {
+        fprintf(stderr, "Error: failed to open private key.\n");
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+    privkey_t key;
+    privkey_init(&key);
+    char cachepath[4096];
+    snprintf(cachepath, sizeof(cachepath), "%s%s", pvpath, KEYCACHE_SUFFIX);
+    bool cached = false;
+    if (!privkey_load(&key, pvfile, cache ? cachepath : NULL, &cached)) {
+        fprintf(stderr, "Error: failed to read private key.\n");
+        privkey_clear(&key);
+        fclose(pvfile);
+        fclose(infile);
+        fclose(outfile);
+        return 1;
+    }
+    if (cache && !cached && !privkey_save(&key, cachepath)) {
+        fprintf(stderr, "Warning: failed to write key cache %s.\n", cachepath);
+    }
+    fclose(pvfile);
+    stats_phase(PHASE_KEY_LOAD, start);
+
+    // Hash the whole input, then sign only the padded digest
+    uint8_t digest[SHA256_DIGEST];
+    rsa_digest_file(digest, infile);
+    rsa_work_t work;
+    rsa_work_init(&work);
+    mpz_t s;
+    mpz_init(s);
+    int rc = 0;
+    start = stats_clock();
+    if (!privkey_sign_digest(&key, s, digest, &work)) {
+        fprintf(stderr, "Error: key is too small to sign a SHA-256 digest.\n");
+        rc = 1;
+    } else {
+        stats_block(start);
+        stats_phase(PHASE_COMPUTE, start);
+        gmp_fprintf(outfile, "%Zx\n", s);
+    }
+
+    if (stats) {
+        fprintf(stdout, "sha256 ");
+        for (int i = 0; i < SHA256_DIGEST; i++) {
+            fprintf(stdout, "%02x", digest[i]);
+        }
+        fprintf(stdout, "\n");
+        gmp_fprintf(stdout, "n (%zu bits) %Zd\n", mpz_sizeinbase(key.n, 2), key.n);
+    }
+    fflush(outfile);
+    if (stats) {
+        stats_print(stderr);
+    }
+    if (jsonfile != NULL) {
+        stats_write_json(jsonfile);
+        fclose(jsonfile);
+    }
+
+    mpz_clear(s);
+    rsa_work_clear(&work);
+    privkey_clear(&key);
+    fclose(infile);
+    fclose(outfile);
+    return rc;
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include "stats.h"
+#include "numtheory.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+rsa_stats_t rsa_stats;
+
+static const char *phase_names[PHASES] = { "key_load", "verify", "keygen", "read", "compute",
+    "format", "write" };
+
+// stats_clock()
+// stats_clock() returns a monotonic timestamp in nanoseconds
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// stats_phase()
+// stats_phase() adds the time since start to phase
+void stats_phase(phase_t phase, uint64_t start) {
+    atomic_fetch_add(&rsa_stats.ns[phase], stats_clock() - start);
+}
+
+// stats_block()
+// stats_block() records one exponentiation that began at start
+void stats_block(uint64_t start) {
+    stats_blocks(start, 1);
+}
+
+// stats_blocks()
+// stats_blocks() records count exponentiations run together in SIMD lanes since start, each
+// charged an equal share of the time in the histogram
+void stats_blocks(uint64_t start, uint64_t count) {
+    uint64_t ns = stats_clock() - start;
+    uint64_t us = ns / count / 1000;
+    uint64_t b = 0;
+    while (b + 1 < STATS_BUCKETS && us >= (2ULL << b)) {
+        b++;
+    }
+    atomic_fetch_add(&rsa_stats.blocks, count);
+    atomic_fetch_add(&rsa_stats.pow_ns, ns);
+    atomic_fetch_add(&rsa_stats.hist[b], count);
+}
+
+// stats_print()
+// stats_print() prints the phase times, counters and the non-empty histogram buckets
+void stats_print(FILE *f) {
+    for (int i = 0; i < PHASES; i++) {
+        fprintf(f, "%-10s %12.3f ms\n", phase_names[i], atomic_load(&rsa_stats.ns[i]) / 1e6);
+    }
+    uint64_t blocks = atomic_load(&rsa_stats.blocks);
+    fprintf(f, "blocks     %12" PRIu64 "\n", blocks);
+    fprintf(f, "pow        %12.3f ms summed over workers\n", atomic_load(&rsa_stats.pow_ns) / 1e6);
+    fprintf(f, "sieved     %12" PRIu64 "\n", prime_stats.sieved);
+    fprintf(f, "mr tested  %12" PRIu64 "\n", prime_stats.tested);
+    fprintf(f, "mr rounds  %12" PRIu64 "\n", prime_stats.rounds);
+    fprintf(f, "lucas      %12" PRIu64 "\n", prime_stats.lucas);
+    fprintf(f, "retries    %12" PRIu64 "\n", rsa_stats.retries);
+    fprintf(f, "pooled     %12" PRIu64 "\n", rsa_stats.pooled);
+    uint64_t plain = atomic_load(&rsa_stats.lz_plain);
+    uint64_t packed = atomic_load(&rsa_stats.lz_packed);
+    if (plain > 0) {
+        fprintf(f, "lz plain   %12" PRIu64 "\n", plain);
+        fprintf(f, "lz packed  %12" PRIu64 " (%.2fx)\n", packed, (double) plain / packed);
+    }
+    if (blocks > 0) {
+        fprintf(f, "block latency (us):\n");
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            uint64_t count = atomic_load(&rsa_stats.hist[b]);
+            if (count > 0) {
+                fprintf(f, "  [%8llu, %8llu) %12" PRIu64 "\n", b == 0 ? 0ULL : 1ULL << b,
+                    2ULL << b, count);
+            }
+        }
+    }
+}
+
+// stats_write_json()
+// stats_write_json() writes the same data as stats_print() as a JSON object
+void stats_write_json(FILE *f) {
+    fprintf(f, "{\n  \"phases_ms\": {");
+    for (int i = 0; i < PHASES; i++) {
+        fprintf(f, "%s\"%s\": %.3f", i == 0 ? "" : ", ", phase_names[i],
+            atomic_load(&rsa_stats.ns[i]) / 1e6);
+    }
+    fprintf(f, "},\n");
+    fprintf(f, "  \"blocks\": %" PRIu64 ",\n", (uint64_t) atomic_load(&rsa_stats.blocks));
+    fprintf(f, "  \"pow_ms\": %.3f,\n", atomic_load(&rsa_stats.pow_ns) / 1e6);
+    fprintf(f, "  \"sieved\": %" PRIu64 ",\n", prime_stats.sieved);
+    fprintf(f, "  \"mr_tested\": %" PRIu64 ",\n", prime_stats.tested);
+    fprintf(f, "  \"mr_rounds\": %" PRIu64 ",\n", prime_stats.rounds);
+    fprintf(f, "  \"lucas\": %" PRIu64 ",\n", prime_stats.lucas);
+    fprintf(f, "  \"retries\": %" PRIu64 ",\n", rsa_stats.retries);
+    fprintf(f, "  \"pooled\": %" PRIu64 ",\n", rsa_stats.pooled);
+    fprintf(f, "  \"lz_plain\": %" PRIu64 ",\n", (uint64_t) atomic_load(&rsa_stats.lz_plain));
+    fprintf(f, "  \"lz_packed\": %" PRIu64 ",\n", (uint64_t) atomic_load(&rsa_stats.lz_packed));
+    fprintf(f, "  \"block_latency_us\": [");
+    bool first = true;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        uint64_t count = atomic_load(&rsa_stats.hist[b]);
+        if (count > 0) {
+            fprintf(f, "%s{\"ge\": %llu, \"lt\": %llu, \"count\": %" PRIu64 "}",
+                first ? "" : ", ", b == 0 ? 0ULL : 1ULL << b, 2ULL << b, count);
+            first = false;
+        }
+    }
+    fprintf(f, "]\n}\n");
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Phases timed by the programs and the file loops, in nanoseconds of wall time
+typedef enum {
+    PHASE_KEY_LOAD, // Opening and parsing key files
+    PHASE_VERIFY, // Checking the public key signature
+    PHASE_KEYGEN, // Making primes and the key
+    PHASE_READ, // Reading raw input blocks
+    PHASE_COMPUTE, // Batches of blocks on the workers, including the exponentiations
+    PHASE_FORMAT, // Hex parsing and printing
+    PHASE_WRITE, // Writing raw output blocks and key files
+    PHASES
+} phase_t;
+
+// Block latency bucket b counts exponentiations that took [2^b, 2^(b+1)) microseconds
+#define STATS_BUCKETS 24
+
+// Counters updated by the file loops, the workers add to them concurrently
+typedef struct {
+    atomic_uint_fast64_t ns[PHASES];
+    atomic_uint_fast64_t blocks; // Blocks exponentiated
+    atomic_uint_fast64_t pow_ns; // Exponentiation time summed over the workers
+    atomic_uint_fast64_t hist[STATS_BUCKETS];
+    atomic_uint_fast64_t lz_plain; // Plaintext bytes through the LZ stage
+    atomic_uint_fast64_t lz_packed; // Frame bytes they came to
+    uint64_t retries; // rsa_make_pub() prime pairs rejected for the size of n or e
+    uint64_t pooled; // Primes keygen drew from the prime pool
+} rsa_stats_t;
+
+extern rsa_stats_t rsa_stats;
+
+uint64_t stats_clock(void);
+
+void stats_phase(phase_t phase, uint64_t start);
+
+void stats_block(uint64_t start);
+
+void stats_blocks(uint64_t start, uint64_t count);
+
+void stats_print(FILE *f);
+
+void stats_write_json(FILE *f);
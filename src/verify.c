@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <gmp.h>
+#include "randstate.h"
+#include "numtheory.h"
+#include "rsa.h"
+#include "stats.h"
+#include "keycache.h"
+#include "librsa.h"
+#include "sha256.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#define OPTIONS "i:s:n:Cvh"
+
+static struct option longopts[] = { { "stats-json", required_argument, NULL, 'J' },
+    { NULL, 0, NULL, 0 } };
+
+// help()
+// help() prints out the program usage and help.
+void help(void) {
+    fprintf(stdout, "SYNOPSIS\n\
+   Checks a detached signature made by the sign program against a file.\n\
+   Exits 0 when the signature matches and 1 when it doesn't.\n\
+\n\
+USAGE\n\
+   ./verify [-hvC] [-i infile] [-n pbfile] [--stats-json file] -s sigfile\n\
+\n\
+OPTIONS\n\
+   -h              Display program help and usage.\n\
+   -v              Display verbose program output, phase timings go to stderr.\n\
+   -i infile       Input file that was signed (default: stdin).\n\
+   -s sigfile      Signature file written by sign.\n\
+   -n pbfile       Public key file (default: rsa.pub).\n\
+   -C              Load the key from pbfile.cache, made on the first run and remade\n\
+                   whenever pbfile changes, skipping the parse and signature check.\n\
+   --stats-json f  Write phase timings and counters as JSON to f.\n");
+    return;
+}
+
+// main()
+// main() hashes the input file with SHA-256 and checks the signature of the digest
+int main(int argc, char **argv) {
+
+    // opt for getopt
+    int opt = 0;
+
+    bool stats = false;
+    bool cache = false;
+    FILE *jsonfile = NULL;
+    char *keypath = "rsa.pub";
+    FILE *infile = stdin;
+    FILE *sigfile = NULL;
+
+    // gets all command line options
+    while ((opt = getopt_long(argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            infile = fopen(optarg, "r");
+            if (infile == NULL) {
+                fprintf(stderr, "Error: failed to open infile.\n");
+                return 1;
+            }
+            break;
+        case 's':
+            sigfile = fopen(optarg, "r");
+            if (sigfile == NULL) {
+                fprintf(stderr, "Error: failed to open sigfile.\n");
+                return 1;
+            }
+            break;
+        case 'n': keypath = optarg; break;
+        case 'J':
+            jsonfile = fopen(optarg, "w");
+            if (jsonfile == NULL) {
+                fprintf(stderr, "Error: failed to open stats file.\n");
+                return 1;
+            }
+            break;
+        case 'v': stats = true; break;
+        case 'C': cache = true; break;
+        case 'h': help(); return 0;
+        default: help(); return 1;
+        }
+    }
+    if (sigfile == NULL) {
+        fprintf(stderr, "Error: a signature file is required.\n");
+        help();
+        return 1;
+    }
+
+    // Read the public key, from its cache when asked to and the cache is current
+    uint64_t start = stats_clock();
+    FILE *pubkey = fopen(keypath, "r");
+    if (pubkey == NULL) {
+        fprintf(stderr, "Error: failed to open public key.\n");
+        fclose(infile);
+        fclose(sigfile);
+        return 1;
+    }
+    pubkey_t key;
+    pubkey_init(&key);
+    rsa_work_t work;
+    rsa_work_init(&work);
+    mpz_t s;
+    mpz_init(s);
+    char cachepath[4096];
+    snprintf(cachepath, sizeof(cachepath), "%s%s", keypath, KEYCACHE_SUFFIX);
+    bool cached = false;
+    bool ok = pubkey_load(&key, pubkey, cache ? cachepath : NULL, &cached);
+    fclose(pubkey);
+    if (!ok) {
+        fprintf(stderr, "Error: failed to read public key.\n");
+    }
+    stats_phase(PHASE_KEY_LOAD, start);
+
+    // The key's own signature of its username, as encrypt checks it
+    start = stats_clock();
+    if (ok && !pubkey_check(&key, &work)) {
+        fprintf(stderr, "Error: Couldn't verify signature.\n");
+        ok = false;
+    }
+    stats_phase(PHASE_VERIFY, start);
+    if (ok && cache && !cached && !pubkey_save(&key, cachepath)) {
+        fprintf(stderr, "Warning: failed to write key cache %s.\n", cachepath);
+    }
+    if (ok && gmp_fscanf(sigfile, "%Zx", s) != 1) {
+        fprintf(stderr, "Error: malformed signature.\n");
+        ok = false;
+    }
+
+    // Hash the whole input and check the signature of its padded digest
+    uint8_t digest[SHA256_DIGEST];
+    if (ok) {
+        rsa_digest_file(digest, infile);
+        start = stats_clock();
+        ok = pubkey_verify_digest(&key, digest, s, &work);
+        stats_phase(PHASE_VERIFY, start);
+        if (!ok) {
+            fprintf(stderr, "Error: signature does not match.\n");
+        }
+        if (stats) {
+            fprintf(stdout, "sha256 ");
+            for (int i = 0; i < SHA256_DIGEST; i++) {
+                fprintf(stdout, "%02x", digest[i]);
+            }
+            fprintf(stdout, "\n%s\n", ok ? "signature ok" : "signature bad");
+        }
+    }
+    if (stats) {
+        stats_print(stderr);
+    }
+    if (jsonfile != NULL) {
+        stats_write_json(jsonfile);
+        fclose(jsonfile);
+    }
+
+    mpz_clear(s);
+    rsa_work_clear(&work);
+    pubkey_clear(&key);
+    fclose(infile);
+    fclose(sigfile);
+    return ok ? 0 : 1;
+}